@@ -0,0 +1,210 @@
+//
+//  bgzfreader.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "bgzfreader.h"
+#include "main.h"
+#include <boost/bind.hpp>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+// The number of blocks each inflater thread may read ahead of the consumer.
+const size_t BLOCKS_PER_THREAD = 4;
+// The size of the fixed part of the gzip header of a BGZF block.
+const size_t BGZF_HEADER_SIZE = 12;
+// The size of the CRC32 and ISIZE fields at the end of a BGZF block.
+const size_t BGZF_FOOTER_SIZE = 8;
+
+/**
+ * A helper function that reads a little-endian unsigned integer of the given
+ * number of bytes.
+ * @param p a pointer to the first byte of the integer.
+ * @param n the number of bytes in the integer.
+ * @return The value of the integer.
+ */
+inline size_t read_le(const char* p, size_t n) {
+  size_t val = 0;
+  for (size_t i = 0; i < n; ++i) {
+    val |= (size_t)(unsigned char)p[i] << (8*i);
+  }
+  return val;
+}
+
+BGZFReader::BGZFReader(const string& file_name, size_t num_threads)
+    : _in(file_name.c_str(), ios::in | ios::binary),
+      _file_name(file_name),
+      _num_threads(max(num_threads, (size_t)1)),
+      _window(_num_threads * BLOCKS_PER_THREAD) {
+  if (!_in.is_open()) {
+    logger.severe("Unable to open input BAM file '%s'.", file_name.c_str());
+  }
+  start();
+}
+
+BGZFReader::~BGZFReader() {
+  stop();
+}
+
+void BGZFReader::start() {
+  _next_read = 0;
+  _next_out = 0;
+  _eof = false;
+  _stop = false;
+  _curr.clear();
+  _curr_pos = 0;
+  foreach (Block& b, _window) {
+    b.ready = false;
+  }
+  for (size_t i = 0; i < _num_threads; ++i) {
+    _workers.create_thread(boost::bind(&BGZFReader::inflate_blocks, this));
+  }
+}
+
+void BGZFReader::stop() {
+  {
+    boost::unique_lock<boost::mutex> lock(_mut);
+    _stop = true;
+    _slot_free.notify_all();
+  }
+  _workers.join_all();
+}
+
+void BGZFReader::rewind() {
+  stop();
+  _in.clear();
+  _in.seekg(0, ios::beg);
+  start();
+}
+
+bool BGZFReader::read_block(vector<char>& compressed) {
+  char header[BGZF_HEADER_SIZE];
+  _in.read(header, BGZF_HEADER_SIZE);
+  if (_in.gcount() == 0) {
+    return false;
+  }
+  if ((size_t)_in.gcount() != BGZF_HEADER_SIZE ||
+      (unsigned char)header[0] != 31 || (unsigned char)header[1] != 139 ||
+      (unsigned char)header[2] != 8 || !(header[3] & 4)) {
+    logger.severe("Input BAM file '%s' contains an invalid BGZF block header.",
+                  _file_name.c_str());
+  }
+
+  // Find the BSIZE field in the extra subfields.
+  size_t xlen = read_le(header + 10, 2);
+  vector<char> extra(xlen + 1);
+  _in.read(&extra[0], xlen);
+  size_t block_size = 0;
+  for (size_t i = 0; i + 4 <= xlen; ) {
+    size_t slen = read_le(&extra[i+2], 2);
+    if (extra[i] == 'B' && extra[i+1] == 'C' && slen == 2 && i + 6 <= xlen) {
+      block_size = read_le(&extra[i+4], 2) + 1;
+      break;
+    }
+    i += 4 + slen;
+  }
+  if (block_size < BGZF_HEADER_SIZE + xlen + BGZF_FOOTER_SIZE) {
+    logger.severe("Input BAM file '%s' contains a BGZF block without a valid "
+                  "size.", _file_name.c_str());
+  }
+
+  compressed.resize(block_size - BGZF_HEADER_SIZE - xlen);
+  _in.read(&compressed[0], compressed.size());
+  if ((size_t)_in.gcount() != compressed.size()) {
+    logger.severe("Input BAM file '%s' is truncated.", _file_name.c_str());
+  }
+  return true;
+}
+
+void BGZFReader::inflate_blocks() {
+  vector<char> compressed;
+  vector<char> data;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -15) != Z_OK) {
+    logger.severe("Unable to initialize zlib for BGZF decompression.");
+  }
+
+  while (true) {
+    size_t seq;
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      while (!_stop && !_eof && _next_read - _next_out >= _window.size()) {
+        _slot_free.wait(lock);
+      }
+      if (_stop || _eof) {
+        break;
+      }
+      if (!read_block(compressed)) {
+        _eof = true;
+        _block_ready.notify_all();
+        break;
+      }
+      seq = _next_read++;
+    }
+
+    size_t cdata_len = compressed.size() - BGZF_FOOTER_SIZE;
+    const char* footer = &compressed[cdata_len];
+    size_t isize = read_le(footer + 4, 4);
+    data.resize(isize);
+    if (isize) {
+      inflateReset(&zs);
+      zs.next_in = (Bytef*)&compressed[0];
+      zs.avail_in = (uInt)cdata_len;
+      zs.next_out = (Bytef*)&data[0];
+      zs.avail_out = (uInt)isize;
+      if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != isize ||
+          crc32(crc32(0L, Z_NULL, 0), (Bytef*)&data[0], (uInt)isize) !=
+          read_le(footer, 4)) {
+        logger.severe("Input BAM file '%s' contains a corrupt BGZF block.",
+                      _file_name.c_str());
+      }
+    }
+
+    boost::unique_lock<boost::mutex> lock(_mut);
+    Block& b = _window[seq % _window.size()];
+    b.data.swap(data);
+    b.ready = true;
+    _block_ready.notify_all();
+  }
+
+  inflateEnd(&zs);
+}
+
+bool BGZFReader::next_block() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  Block& b = _window[_next_out % _window.size()];
+  while (!b.ready) {
+    if (_eof && _next_out == _next_read) {
+      return false;
+    }
+    _block_ready.wait(lock);
+  }
+  _curr.swap(b.data);
+  _curr_pos = 0;
+  b.ready = false;
+  _next_out++;
+  _slot_free.notify_all();
+  return true;
+}
+
+size_t BGZFReader::read(char* buff, size_t len) {
+  size_t copied = 0;
+  while (copied < len) {
+    if (_curr_pos == _curr.size()) {
+      if (!next_block()) {
+        break;
+      }
+      continue;
+    }
+    size_t n = min(len - copied, _curr.size() - _curr_pos);
+    memcpy(buff + copied, &_curr[_curr_pos], n);
+    _curr_pos += n;
+    copied += n;
+  }
+  return copied;
+}
@@ -0,0 +1,154 @@
+/**
+ *  bgzfreader.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_bgzfreader_h
+#define express_bgzfreader_h
+
+#include <boost/thread.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * The BGZFReader class reads a BGZF-compressed file (such as BAM) as a stream
+ * of uncompressed bytes. Compressed blocks are read from disk and inflated by a
+ * pool of worker threads ahead of the consumer, and are handed over strictly in
+ * file order so that the output is identical to a serial decompression.
+ *  @copyright Artistic License 2.0
+ **/
+class BGZFReader {
+  /**
+   * A private struct holding a single inflated block in the read-ahead window.
+   */
+  struct Block {
+    /**
+     * A public vector containing the uncompressed contents of the block.
+     */
+    std::vector<char> data;
+    /**
+     * A public bool that is true iff the block has been inflated and not yet
+     * handed to the consumer.
+     */
+    bool ready;
+    Block() : ready(false) {}
+  };
+  /**
+   * A private input stream for the compressed file.
+   */
+  std::ifstream _in;
+  /**
+   * A private string storing the path to the compressed file.
+   */
+  std::string _file_name;
+  /**
+   * A private size_t for the number of inflater threads to use.
+   */
+  size_t _num_threads;
+  /**
+   * A private ring buffer of blocks that have been read from the file, indexed
+   * by their sequence number modulo its size.
+   */
+  std::vector<Block> _window;
+  /**
+   * A private size_t for the sequence number of the next block to read from the
+   * file.
+   */
+  size_t _next_read;
+  /**
+   * A private size_t for the sequence number of the next block to hand to the
+   * consumer.
+   */
+  size_t _next_out;
+  /**
+   * A private bool that is true once the end of the file has been reached.
+   */
+  bool _eof;
+  /**
+   * A private bool used to signal the inflater threads to stop.
+   */
+  bool _stop;
+  /**
+   * A private mutex protecting the file and the read-ahead window.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable signalled when a block has been inflated.
+   */
+  boost::condition_variable _block_ready;
+  /**
+   * A private condition variable signalled when a slot in the window is freed.
+   */
+  boost::condition_variable _slot_free;
+  /**
+   * A private group of the inflater threads.
+   */
+  boost::thread_group _workers;
+  /**
+   * A private vector containing the uncompressed block currently being
+   * consumed.
+   */
+  std::vector<char> _curr;
+  /**
+   * A private size_t for the position of the next unconsumed byte in _curr.
+   */
+  size_t _curr_pos;
+  /**
+   * A private member function that reads the next compressed block from the
+   * file. Must be called while holding _mut.
+   * @param compressed a vector to fill with the block contents following the
+   *        header (compressed data, CRC32 and uncompressed size).
+   * @return True iff a block was read. False at the end of the file.
+   */
+  bool read_block(std::vector<char>& compressed);
+  /**
+   * A private member function that drives each inflater thread. Blocks are
+   * read under the lock and inflated outside of it.
+   */
+  void inflate_blocks();
+  /**
+   * A private member function that waits for the next block in file order and
+   * swaps it into _curr.
+   * @return True iff a block was available. False at the end of the file.
+   */
+  bool next_block();
+  /**
+   * A private member function that starts the inflater threads at the
+   * beginning of the file.
+   */
+  void start();
+
+ public:
+  /**
+   * BGZFReader constructor opens the file and starts the inflater threads.
+   * @param file_name the path to the BGZF-compressed file.
+   * @param num_threads the number of inflater threads to use (at least 1).
+   */
+  BGZFReader(const std::string& file_name, size_t num_threads);
+  /**
+   * BGZFReader destructor stops the inflater threads.
+   */
+  ~BGZFReader();
+  /**
+   * A member function that copies the next len uncompressed bytes into buff.
+   * @param buff the buffer to copy the bytes into.
+   * @param len the number of bytes requested.
+   * @return The number of bytes copied, which is less than len only if the end
+   *         of the file was reached.
+   */
+  size_t read(char* buff, size_t len);
+  /**
+   * A member function that signals the inflater threads to stop and waits for
+   * them to finish. They are restarted by rewind.
+   */
+  void stop();
+  /**
+   * A member function that rewinds the reader to the beginning of the file.
+   */
+  void rewind();
+};
+
+#endif
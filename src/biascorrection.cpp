@@ -15,6 +15,7 @@
 
 #include "fragments.h"
 #include "frequencymatrix.h"
+#include "logmath.h"
 #include "main.h"
 #include "sequence.h"
 #include "targets.h"
@@ -96,6 +97,22 @@ void SeqWeightTable::copy_expected(const SeqWeightTable& other) {
   _expected = other._expected;
 }
 
+void SeqWeightTable::merge_observed(const SeqWeightTable& other) {
+  _observed.merge(other._observed);
+}
+
+void SeqWeightTable::merge_expected(const SeqWeightTable& other) {
+  _expected.merge(other._expected);
+}
+
+void SeqWeightTable::clear_observed() {
+  _observed.clear();
+}
+
+void SeqWeightTable::clear_expected() {
+  _expected.clear();
+}
+
 void SeqWeightTable::increment_expected(const Sequence& seq, double mass,
                                         const vector<double>& fl_cdf) {
   _expected.fast_learn(seq, mass, fl_cdf);
@@ -111,9 +128,14 @@ void SeqWeightTable::increment_observed(const Sequence& seq, size_t i,
   _observed.update(seq, left, mass);
 }
 
-double SeqWeightTable::get_weight(const Sequence& seq, size_t i) const {
-  int left = (int)i - SURROUND;
-  return _observed.seq_prob(seq, left) - _expected.seq_prob(seq, left);
+void SeqWeightTable::get_weights(const Sequence& seq,
+                                 vector<double>& weights) const {
+  vector<double> expected;
+  _observed.seq_probs(seq, -SURROUND, weights);
+  _expected.seq_probs(seq, -SURROUND, expected);
+  for (size_t i = 0; i < weights.size(); ++i) {
+    weights[i] -= expected[i];
+  }
 }
 
 void SeqWeightTable::append_output(ofstream& outfile) const {
@@ -204,22 +226,66 @@ void BiasBoss::copy_expectations(const BiasBoss& other) {
   _3_seq_bias.copy_expected(other._3_seq_bias);
 }
 
+void BiasBoss::merge_observations(const BiasBoss& other) {
+  _5_seq_bias.merge_observed(other._5_seq_bias);
+  _3_seq_bias.merge_observed(other._3_seq_bias);
+}
+
+void BiasBoss::clear_observations() {
+  _5_seq_bias.clear_observed();
+  _3_seq_bias.clear_observed();
+}
+
+void BiasBoss::merge_expectations(const BiasBoss& other) {
+  _5_seq_bias.merge_expected(other._5_seq_bias);
+  _3_seq_bias.merge_expected(other._3_seq_bias);
+}
+
+void BiasBoss::clear_expectations() {
+  _5_seq_bias.clear_expected();
+  _3_seq_bias.clear_expected();
+}
+
 void BiasBoss::update_expectations(const Target& targ, double mass,
                                    const vector<double>& fl_cdf) {
+  update_expectations(targ.seq(0), targ.seq(1), mass, fl_cdf);
+}
+
+void BiasBoss::update_expectations(const Sequence& seq_fwd,
+                                   const Sequence& seq_rev, double mass,
+                                   const vector<double>& fl_cdf) {
   if (mass == LOG_0) {
     return;
   }
 
   if (direction != R) {
-    const Sequence& seq_fwd = targ.seq(0);
     _5_seq_bias.increment_expected(seq_fwd, mass, fl_cdf);
   }
   if (direction != F) {
-    const Sequence& seq_rev = targ.seq(1);
     _3_seq_bias.increment_expected(seq_rev, mass, fl_cdf);
   }
 }
 
+string BiasBoss::serialize_expectations() const {
+  return _5_seq_bias.serialize_expected() + _3_seq_bias.serialize_expected();
+}
+
+bool BiasBoss::deserialize_expectations(const char* data, size_t size) {
+  if (size % 2) {
+    return false;
+  }
+  size_t table_size = size / 2;
+  if (direction != R &&
+      !_5_seq_bias.deserialize_expected(data, table_size)) {
+    return false;
+  }
+  if (direction != F &&
+      !_3_seq_bias.deserialize_expected(data + table_size, table_size)) {
+    return false;
+  }
+  return true;
+}
+
 void BiasBoss::normalize_expectations() {
   _5_seq_bias.normalize_expected();
   _3_seq_bias.normalize_expected();
@@ -244,18 +310,20 @@ void BiasBoss::update_observed(const FragHit& hit, double normalized_mass)
 double BiasBoss::get_target_bias(std::vector<float>& start_bias,
                                  std::vector<float>& end_bias,
                                  const Target& targ) const {
-  double tot_start = LOG_0;
-  double tot_end = LOG_0;
-
   const Sequence& t_seq_fwd = targ.seq(0);
   const Sequence& t_seq_rev = targ.seq(1);
 
+  vector<double> weights;
+  _5_seq_bias.get_weights(t_seq_fwd, weights);
+  for (size_t i = 0; i < targ.length(); ++i) {
+    start_bias[i] = weights[i];
+  }
+  _3_seq_bias.get_weights(t_seq_rev, weights);
   for (size_t i = 0; i < targ.length(); ++i) {
-    start_bias[i] = _5_seq_bias.get_weight(t_seq_fwd, i);
-    end_bias[targ.length()-i-1] = _3_seq_bias.get_weight(t_seq_rev, i);
-    tot_start = log_add(tot_start, start_bias[i]);
-    tot_end = log_add(tot_end, end_bias[i]);
+    end_bias[targ.length()-i-1] = weights[i];
   }
+  double tot_start = log_sum(&start_bias[0], targ.length());
+  double tot_end = log_sum(&end_bias[0], targ.length());
 
   double avg_bias = (tot_start + tot_end) - (2*log((double)targ.length()));
   assert(!isnan(avg_bias));
@@ -19,6 +19,7 @@
 
 class BiasBoss;
 class FragHit;
+class Sequence;
 class Target;
 
 /**
@@ -83,6 +84,42 @@ public:
    * @param other another SeqWeightTable from which to copy the parameters.
    */
   void copy_expected(const SeqWeightTable& other);
+  /**
+   * A member function that adds the "observed" counts from another
+   * SeqWeightTable to this one.
+   * @param other another SeqWeightTable from which to add the counts.
+   */
+  void merge_observed(const SeqWeightTable& other);
+  /**
+   * A member function that adds the "expected" counts from another
+   * SeqWeightTable to this one.
+   * @param other another SeqWeightTable from which to add the counts.
+   */
+  void merge_expected(const SeqWeightTable& other);
+  /**
+   * A member function that sets the "observed" counts to 0.
+   */
+  void clear_observed();
+  /**
+   * A member function that sets the "expected" counts to 0.
+   */
+  void clear_expected();
+  /**
+   * A member function that serializes the (unnormalized) "expected" counts into
+   * an array of bytes.
+   * @return A string containing the serialized counts.
+   */
+  std::string serialize_expected() const { return _expected.serialize(); }
+  /**
+   * A member function that overwrites the (unnormalized) "expected" counts with
+   * those serialized by another SeqWeightTable of the same order.
+   * @param data a pointer to the serialized counts.
+   * @param size the size of the serialized counts in bytes.
+   * @return True iff the size matched and the counts were loaded.
+   */
+  bool deserialize_expected(const char* data, size_t size) {
+    return _expected.deserialize(data, size);
+  }
   /**
    * A member function that increments the expected counts for a sliding window
    * through the given target sequence by some mass.
@@ -108,14 +145,14 @@ public:
    */
    void increment_observed(const Sequence& seq, size_t i, double mass);
   /**
-   * A member function that calculates the bias weight (logged) of a window.
-   * This is the ratio of the observed and expected weights given by the two
-   * Markov models.
-   * @param seq the target sequence.
-   * @param i the central point of the bias window, ie the fragment end.
-   * @return The bias weight for the window.
+   * A member function that computes the bias weight (logged) of the window
+   * centered at every position in the given sequence in a single pass. This is
+   * the ratio of the observed and expected weights given by the two Markov
+   * models.
+   * @param seq the sequence to compute the weights for.
+   * @param weights a vector to fill with the weights (logged).
    */
-   double get_weight(const Sequence& seq, size_t i) const;
+  void get_weights(const Sequence& seq, std::vector<double>& weights) const;
   /**
    * A member function that appends the marginal and conditional probabilities
    * for the foreground and background Markov models to the given file,
@@ -187,6 +224,29 @@ public:
    * @param other a BiasBoss to copy the parameters from.
    */
   void copy_expectations(const BiasBoss& other);
+  /**
+   * A member function that adds the observed counts from another BiasBoss
+   * (usually constructed with 0 pseudo-counts) to this one.
+   * @param other a BiasBoss to add the counts from.
+   */
+  void merge_observations(const BiasBoss& other);
+  /**
+   * A member function that sets the observed counts to 0 so that the BiasBoss
+   * can be used to accumulate observations again after being merged.
+   */
+  void clear_observations();
+  /**
+   * A member function that adds the expected counts from another BiasBoss to
+   * this one, so that expectations accumulated over separate sets of targets
+   * can be combined before they are normalized.
+   * @param other a BiasBoss to add the counts from.
+   */
+  void merge_expectations(const BiasBoss& other);
+  /**
+   * A member function that sets the expected counts to 0, removing the
+   * pseudo-counts so that the BiasBoss can be merged into another.
+   */
+  void clear_expectations();
   /**
    * A member function that updates the expectation parameters assuming uniform
    * abundance of and coverage accross the target's sequence.
@@ -195,6 +255,33 @@ public:
    void update_expectations(const Target& targ,
                             double mass = 0,
                             const std::vector<double>& fl_cdf = std::vector<double>());
+  /**
+   * A member function that updates the expectation parameters assuming uniform
+   * abundance of and coverage accross the given target sequence.
+   * @param seq_fwd the forward target sequence to measure expected counts from.
+   * @param seq_rev the reverse target sequence to measure expected counts from.
+   * @param mass the amount to increment the expected counts by (logged).
+   * @param fl_cdf the fragment length CDF.
+   */
+  void update_expectations(const Sequence& seq_fwd, const Sequence& seq_rev,
+                           double mass = 0,
+                           const std::vector<double>& fl_cdf = std::vector<double>());
+  /**
+   * A member function that serializes the (unnormalized) expected counts of
+   * both the 5' and 3' tables into an array of bytes.
+   * @return A string containing the serialized counts.
+   */
+  std::string serialize_expectations() const;
+  /**
+   * A member function that overwrites the (unnormalized) expected counts with
+   * those serialized by another BiasBoss of the same order. As in
+   * update_expectations, only the tables for the allowed read directions are
+   * loaded.
+   * @param data a pointer to the serialized counts.
+   * @param size the size of the serialized counts in bytes.
+   * @return True iff the size matched and the counts were loaded.
+   */
+  bool deserialize_expectations(const char* data, size_t size);
   /**
    * A member function that normalizes the expected counts and fills in the
    * lower-ordered marginals.
@@ -14,79 +14,181 @@
 using namespace std;
 
 void CovarTable::increment(TargID targ1, TargID targ2, double incr_amt) {
-  size_t pair_id = size()*min(targ1, targ2)+max(targ1, targ2);
-  if (_covar_map.count(pair_id)) {
-    _covar_map[pair_id] = log_add(_covar_map[pair_id], incr_amt);
+  uint64_t key = covar_key(targ1, targ2);
+  CovarShard& shard = _shards[CovarTable::shard(key)];
+  boost::unique_lock<boost::mutex> lock(shard.mut);
+  CovarMap::iterator it = shard.covar_map.find(key);
+  if (it != shard.covar_map.end()) {
+    it->second = log_add(it->second, incr_amt);
   } else {
-    _covar_map[pair_id] = incr_amt;
+    shard.covar_map[key] = incr_amt;
+  }
+}
+
+void CovarTable::merge(const CovarMap& covar_map) {
+  vector<vector<CovarMap::value_type> > by_shard(COVAR_SHARDS);
+  foreach(const CovarMap::value_type& val, covar_map) {
+    by_shard[shard(val.first)].push_back(val);
+  }
+  for (size_t i = 0; i < COVAR_SHARDS; ++i) {
+    if (by_shard[i].empty()) {
+      continue;
+    }
+    CovarShard& shard = _shards[i];
+    boost::unique_lock<boost::mutex> lock(shard.mut);
+    foreach(const CovarMap::value_type& val, by_shard[i]) {
+      CovarMap::iterator it = shard.covar_map.find(val.first);
+      if (it != shard.covar_map.end()) {
+        it->second = log_add(it->second, val.second);
+      } else {
+        shard.covar_map.insert(val);
+      }
+    }
   }
 }
 
 double CovarTable::get(TargID targ1, TargID targ2) {
-  size_t pair_id = size()*min(targ1, targ2)+max(targ1, targ2);
-  if (_covar_map.count(pair_id)) {
-    return _covar_map[pair_id];
+  uint64_t key = covar_key(targ1, targ2);
+  CovarShard& shard = _shards[CovarTable::shard(key)];
+  boost::unique_lock<boost::mutex> lock(shard.mut);
+  CovarMap::const_iterator it = shard.covar_map.find(key);
+  if (it != shard.covar_map.end()) {
+    return it->second;
   } else {
     return LOG_0;
   }
 }
 
+size_t CovarTable::size() const {
+  size_t n = 0;
+  for (size_t i = 0; i < COVAR_SHARDS; ++i) {
+    boost::unique_lock<boost::mutex> lock(_shards[i].mut);
+    n += _shards[i].covar_map.size();
+  }
+  return n;
+}
+
+void CovarBuffer::increment(CovarTable& table, TargID targ1, TargID targ2,
+                            double incr_amt) {
+  if (_table != &table) {
+    flush();
+    _table = &table;
+  }
+  uint64_t key = covar_key(targ1, targ2);
+  CovarMap::iterator it = _covar_map.find(key);
+  if (it != _covar_map.end()) {
+    it->second = log_add(it->second, incr_amt);
+  } else {
+    _covar_map[key] = incr_amt;
+  }
+  if (_covar_map.size() >= COVAR_BUFFER_SIZE) {
+    flush();
+  }
+}
+
+void CovarBuffer::flush() {
+  if (_table) {
+    _table->merge(_covar_map);
+    _covar_map.clear();
+    _table = NULL;
+  }
+}
+
+/**
+ * Helper function that bijectively mixes the bits of a value (the SplitMix64
+ * finalizer), used to assign pseudo-random linking priorities to bundles.
+ * @param x the value to mix.
+ * @return The mixed value.
+ */
+size_t mix_bits(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return (size_t)(x ^ (x >> 31));
+}
+
 Bundle::Bundle(Target* targ)
-    : _counts(targ->tot_counts()),
+    : _size(1),
+      _counts(targ->tot_counts()),
       _mass(targ->mass(true)),
-      _merged_into(NULL) {
+      _merged_into(NULL),
+      _priority(mix_bits(targ->id())) {
   _targets.push_back(targ);
 }
 
-size_t Bundle::size() const {
-  boost::unique_lock<boost::mutex>(_mut);
-  if (_merged_into) {
-    return _targets.size() + _merged_into->size();
+Bundle* Bundle::get_rep() const {
+  Bundle* b = const_cast<Bundle*>(this);
+  while (true) {
+    Bundle* parent = b->_merged_into.load(boost::memory_order_acquire);
+    if (!parent) {
+      return b;
+    }
+    Bundle* grandparent = parent->_merged_into.load(boost::memory_order_acquire);
+    if (!grandparent) {
+      return parent;
+    }
+    // Path halving. Failure means another thread already moved the pointer
+    // closer to the root.
+    b->_merged_into.compare_exchange_weak(parent, grandparent,
+                                          boost::memory_order_release,
+                                          boost::memory_order_relaxed);
+    b = grandparent;
   }
-  return _targets.size();
 }
 
-void Bundle::incr_counts(size_t incr_amt) {
-  boost::unique_lock<boost::mutex>(_mut);
-  if (_merged_into) {
-    _merged_into->incr_counts(incr_amt);
-  } else {
-    _counts += incr_amt;
+void Bundle::add_mass(double incr_amt) {
+  if (incr_amt == LOG_0) {
+    return;
   }
+  double old_mass = _mass.load(boost::memory_order_relaxed);
+  while (!_mass.compare_exchange_weak(old_mass, log_add(old_mass, incr_amt))) {}
 }
 
-void Bundle::incr_mass(double incr_amt) {
-  boost::unique_lock<boost::mutex>(_mut);
-  if (_merged_into) {
-    _merged_into->incr_mass(incr_amt);
-  } else {
-    _mass = log_add(_mass, incr_amt);
+void Bundle::flush() {
+  // An amount added to a root that is concurrently linked is either seen by the
+  // exchanges of the merging thread or sees the new parent here.
+  Bundle* b = this;
+  while (b->_merged_into.load()) {
+    size_t size = b->_size.exchange(0);
+    size_t counts = b->_counts.exchange(0);
+    double mass = b->_mass.exchange(LOG_0);
+    Bundle* rep = b->get_rep();
+    rep->_size.fetch_add(size);
+    rep->_counts.fetch_add(counts);
+    rep->add_mass(mass);
+    b = rep;
   }
 }
 
+size_t Bundle::size() const {
+  return get_rep()->_size.load();
+}
+
+void Bundle::incr_counts(size_t incr_amt) {
+  Bundle* rep = get_rep();
+  rep->_counts.fetch_add(incr_amt);
+  rep->flush();
+}
+
+void Bundle::incr_mass(double incr_amt) {
+  Bundle* rep = get_rep();
+  rep->add_mass(incr_amt);
+  rep->flush();
+}
+
 void Bundle::reset_mass() {
-  boost::unique_lock<boost::mutex>(_mut);
-  _mass = LOG_0;
+  _mass.store(LOG_0);
 }
 
 size_t Bundle::counts() const {
-  boost::unique_lock<boost::mutex>(_mut);
-  if (_merged_into) {
-    return _merged_into->counts();
-  }
-  return _counts;
+  return get_rep()->_counts.load();
 }
 
 double Bundle::mass() const {
-  boost::unique_lock<boost::mutex>(_mut);
-  if (_merged_into) {
-    return _merged_into->mass();
-  }
-  return _mass;
+  return get_rep()->_mass.load();
 }
 
 
-BundleTable::BundleTable() : _threadsafe_mode(false) {}
+BundleTable::BundleTable() : _num_roots(0), _threadsafe_mode(false) {}
 
 BundleTable::~BundleTable() {
   foreach(Bundle* bundle, _bundles) {
@@ -94,64 +196,63 @@ BundleTable::~BundleTable() {
   }
 }
 
-Bundle* BundleTable::get_rep(Bundle* b) {
-  if (b->_merged_into) {
-    return get_rep(b->_merged_into);
-  }
-  return b;
-}
-
 Bundle* BundleTable::create_bundle(Target* targ) {
   Bundle* b = new Bundle(targ);
   _bundles.insert(b);
+  _num_roots++;
   return b;
 }
 
 Bundle* BundleTable::merge(Bundle* b1, Bundle* b2) {
-  // Lock so that only one merge can happen at a time...
-  boost::unique_lock<boost::mutex>(_mut);
-  
-  b1 = get_rep(b1);
-  b2 = get_rep(b2);
+  if (_threadsafe_mode) {
+    while (true) {
+      b1 = b1->get_rep();
+      b2 = b2->get_rep();
+      if (b1 == b2) {
+        return b1;
+      }
+      if (b1->_priority < b2->_priority) {
+        swap(b1, b2);
+      }
+      // Link b2 below b1, unless another thread has linked b2 first.
+      Bundle* root = NULL;
+      if (b2->_merged_into.compare_exchange_strong(root, b1)) {
+        _num_roots--;
+        b2->flush();
+        return b1;
+      }
+    }
+  }
+
+  b1 = b1->get_rep();
+  b2 = b2->get_rep();
   if (b1==b2) {
     return b1;
   }
-  
-  if (b1->size() < b2->size()) {
+
+  if (b1->_targets.size() < b2->_targets.size()) {
     swap(b1, b2);
   }
-  
-  if (_threadsafe_mode) {
-    // Lock b1 and b2
-    boost::unique_lock<boost::mutex>(b1->_mut);
-    boost::unique_lock<boost::mutex>(b2->_mut);
-    b1->_counts += b2->_counts;
-    b1->_mass = log_add(b1->_mass, b2->_mass);
-    b2->_counts = 0;
-    b2->_mass = LOG_0;
-    b2->_merged_into = b1;
-  } else {
-    foreach(Target* targ, b2->_targets) {
-      targ->bundle(b1);
-      b1->_targets.push_back(targ);
-    }
 
-    b1->incr_counts(b2->counts());
-    b1->incr_mass(b2->mass());
-    _bundles.erase(b2);
-    delete b2;
+  foreach(Target* targ, b2->_targets) {
+    targ->bundle(b1);
+    b1->_targets.push_back(targ);
   }
-  
+
+  b1->_size += b2->_size.load();
+  b1->_counts += b2->_counts.load();
+  b1->add_mass(b2->_mass.load());
+  _bundles.erase(b2);
+  delete b2;
+  _num_roots--;
+
   return b1;
 }
 
 void BundleTable::collapse() {
-  // Lock
-  boost::unique_lock<boost::mutex>(_mut);
-  
   BundleSet to_delete;
   foreach(Bundle* b, _bundles) {
-    Bundle* rep = get_rep(b);
+    Bundle* rep = b->get_rep();
     if (rep != b) {
       foreach(Target* targ, b->_targets) {
         targ->bundle(rep);
@@ -9,45 +9,98 @@
 #ifndef express_bundles_h
 #define express_bundles_h
 
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
+#include <algorithm>
+#include <cassert>
+#include <stdint.h>
 #include <vector>
+#include "threadsafety.h"
 
 class Target;
 typedef size_t TargID;
-typedef boost::unordered_map<size_t, float> CovarMap;
+typedef boost::unordered_map<uint64_t, float> CovarMap;
+
+/**
+ * The number of independently locked shards in a CovarTable. Must be a power of
+ * two.
+ */
+const size_t COVAR_SHARDS = 64;
+/**
+ * The number of target pairs a CovarBuffer accumulates before flushing them to
+ * its CovarTable.
+ */
+const size_t COVAR_BUFFER_SIZE = 4096;
+
+/**
+ * Helper function that returns the key for a pair of targets, which is
+ * independent of their order.
+ * @param targ1 one of the targets in the pair.
+ * @param targ2 the other target in the pair.
+ * @return The key for the pair.
+ */
+inline uint64_t covar_key(TargID targ1, TargID targ2) {
+  assert(targ1 <= UINT32_MAX && targ2 <= UINT32_MAX);
+  return ((uint64_t)std::min(targ1, targ2) << 32) | std::max(targ1, targ2);
+}
 
 /**
  * The CovarTable is a sparse matrix for storing and updating pairwise
- * covariances between targets.
+ * covariances between targets. Pairs are hashed into shards that are locked
+ * independently, so that it can be updated by multiple threads.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
  **/
 class CovarTable {
   /**
-   * A private map to look up the covariance for pairs of Targets by their
-   * combined hashed TargIDs. These values are stored positive and logged,
-   * even though the true covariances are negative.
+   * The CovarShard struct stores the covariances for a subset of pairs along
+   * with the mutex protecting them.
    */
-  CovarMap _covar_map;
+  struct CovarShard {
+    boost::mutex mut;
+    CovarMap covar_map;
+    char pad[CACHE_LINE_SIZE];
+  };
+  /**
+   * A private array of shards to look up the covariance for pairs of Targets by
+   * their covar_key. These values are stored positive and logged, even though
+   * the true covariances are negative.
+   */
+  boost::scoped_array<CovarShard> _shards;
+  /**
+   * A private member function that returns the shard a pair is stored in.
+   * @param key the covar_key of the pair.
+   * @return The index of the shard for the pair.
+   */
+  static size_t shard(uint64_t key) {
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (COVAR_SHARDS - 1);
+  }
 
 public:
   /**
    * CovarTable Constructor.
    */
-  CovarTable() {};
+  CovarTable() : _shards(new CovarShard[COVAR_SHARDS]) {};
   /**
    * A member function that increases the covariance between two targets by the
    * specified amount (logged). These values are stored positive even though
-   * the true covariance is negative.
+   * the true covariance is negative. Threadsafe.
    * @param targ1 one of the targets in the pair.
    * @param targ2 the other target in the pair.
    * @param covar a double specifying the amount to increase the pair's
    *        covariance by (logged, positive).
    */
   void increment(TargID targ1, TargID targ2, double covar);
+  /**
+   * A member function that adds the covariances in the given map, keyed by
+   * covar_key, taking the lock of each shard only once. Threadsafe.
+   * @param covar_map the covariances to add (logged, positive).
+   */
+  void merge(const CovarMap& covar_map);
   /**
    * A member function that returns the covariance between two targets.
    * The returned value will be the the negative of the true value (logged).
@@ -61,14 +114,60 @@ public:
    * covariance.
    * @return The number of target pairs with non-zero covariance.
    */
-  size_t size() const { return _covar_map.size(); }
+  size_t size() const;
+};
+
+/**
+ * The CovarBuffer class accumulates covariance updates made by a single thread
+ * and adds them to a shared CovarTable in bulk, so that fragments processed on
+ * different threads do not contend for the shard locks.
+ *  @copyright Artistic License 2.0
+ **/
+class CovarBuffer {
+  /**
+   * A private pointer to the table the buffered updates are for, or NULL if
+   * the buffer is empty.
+   */
+  CovarTable* _table;
+  /**
+   * A private map of the buffered covariance updates, keyed by covar_key.
+   */
+  CovarMap _covar_map;
+
+public:
+  /**
+   * CovarBuffer Constructor.
+   */
+  CovarBuffer() : _table(NULL) {}
+  /**
+   * CovarBuffer destructor flushes any buffered updates.
+   */
+  ~CovarBuffer() { flush(); }
+  /**
+   * A member function that buffers an increase of the covariance between two
+   * targets in the given table, flushing the buffer first if it is for a
+   * different table and afterwards if it is full.
+   * @param table the table the covariance is for.
+   * @param targ1 one of the targets in the pair.
+   * @param targ2 the other target in the pair.
+   * @param covar a double specifying the amount to increase the pair's
+   *        covariance by (logged, positive).
+   */
+  void increment(CovarTable& table, TargID targ1, TargID targ2, double covar);
+  /**
+   * A member function that adds the buffered updates to their table and clears
+   * the buffer.
+   */
+  void flush();
 };
 
 class BundleTable;
 
 /**
  * The Bundle class keeps track of a group of targets that have shared ambiguous
- * (multi-mapped) reads.
+ * (multi-mapped) reads. While the BundleTable is in threadsafe mode, bundles
+ * form a concurrent union-find forest and the totals of a group are held by
+ * its root.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
@@ -79,27 +178,51 @@ class Bundle {
    */
   std::vector<Target*> _targets;
   /**
-   * A private size_t that stores the total number of observed fragments mapped
-   * to targets in the bundle.
+   * A private atomic size_t that stores the number of targets in the bundle,
+   * including those of bundles merged into it that have not been collapsed.
+   */
+  boost::atomic<size_t> _size;
+  /**
+   * A private atomic size_t that stores the total number of observed fragments
+   * mapped to targets in the bundle.
    */
-  size_t _counts;
+  boost::atomic<size_t> _counts;
   /**
-   * A private double that stores the total mass of observed fragments mapped
-   * to targets in the bundle (logged), including the initial pseudo-mass.
+   * A private atomic double that stores the total mass of observed fragments
+   * mapped to targets in the bundle (logged), including the initial
+   * pseudo-mass.
    */
-  double _mass;
+  boost::atomic<double> _mass;
   /**
-   * A private pointer to the bundle this one was merged into for threadsafe
-   * collapsing. 
+   * A private atomic pointer to the bundle this one was merged into for
+   * threadsafe collapsing, or NULL if it is a root. Only changed from NULL by a
+   * compare-and-swap in BundleTable::merge, and afterwards only moved closer
+   * to the root by path halving.
    */
-  Bundle* _merged_into;
+  mutable boost::atomic<Bundle*> _merged_into;
   /**
-   * Mutex for threadafety.
+   * A private size_t that fixes the order in which roots are linked, so that
+   * concurrent merges cannot form a cycle. Derived from the id of the initial
+   * target by a bijective mixing function, making the linking randomized.
    */
-  mutable boost::mutex _mut;
-  
+  const size_t _priority;
+
   friend class BundleTable;
 
+  /**
+   * A private member function that atomically adds to the total bundle mass
+   * (logged) of this node, whether or not it is a root.
+   * @param incr_amt the amount to increase the mass by (logged).
+   */
+  void add_mass(double incr_amt);
+  /**
+   * A private member function that moves the totals held by this node and any
+   * of its ancestors that are no longer roots up to the current root. Called
+   * after adding to a node, so that amounts added to a root while it is being
+   * merged are not lost.
+   */
+  void flush();
+
 public:
   /**
    * Bundle Constructor.
@@ -107,12 +230,12 @@ public:
    */
   Bundle(Target* targ);
   /**
-   * A private method for returning the root of the merge tree that this bundle
-   * is a node in.
-   * @return A pointer to the bundle at the root of the merge tree for this 
+   * A member function for returning the root of the merge tree that this bundle
+   * is a node in. Halves the path to the root as it goes.
+   * @return A pointer to the bundle at the root of the merge tree for this
    *         bundle.
    */
-  const Bundle* get_rep() const;
+  Bundle* get_rep() const;
   /**
    * A member function that increases the total bundle observed fragment counts
    * by a given amount.
@@ -171,20 +294,14 @@ class BundleTable {
    */
   BundleSet _bundles;
   /**
-   * A private boolean specifying if methods needs to be threadsafe.
-   */
-  bool _threadsafe_mode;
-  /**
-   * A private mutex for threadsafety.
+   * A private atomic size_t for the number of bundles that are roots of their
+   * merge trees.
    */
-  mutable boost::mutex _mut;
+  boost::atomic<size_t> _num_roots;
   /**
-   * A private method for returning the root of the merge tree that the given
-   * bundle is a node in.
-   * @return A pointer to the bundle at the root of the merge tree for the given
-   *         bundle.
+   * A private boolean specifying if methods needs to be threadsafe.
    */
-  Bundle* get_rep(Bundle* b);
+  bool _threadsafe_mode;
 public:
   /**
    * BundleTable Constructor.
@@ -202,10 +319,11 @@ public:
    */
   const BundleSet& bundles() const { return _bundles; }
   /**
-   * An accessor for the current number of Bundles.
+   * An accessor for the current number of Bundles, not counting those that
+   * have been merged into others but not yet collapsed.
    * @return The current number of Bundles.
    */
-  size_t size() const { return _bundles.size(); }
+  size_t size() const { return _num_roots.load(boost::memory_order_relaxed); }
   /**
    * A member function that creates a new Bundle, initially containing only the
    * single given Target.
@@ -214,8 +332,10 @@ public:
    */
   Bundle* create_bundle(Target* targ);
   /**
-   * A member function that merges two Bundle objects into one. The Targets are
-   * all moved to the larger bundles and the other is deleted.
+   * A member function that merges two Bundle objects into one. In threadsafe
+   * mode, the root of one is linked to the root of the other without locking.
+   * Otherwise, the Targets are all moved to the larger bundles and the other is
+   * deleted.
    * @param b1 a pointer to one of the Bundle objects to merge.
    * @param b2 a pointer to the other Bundle object to merge.
    * @return A pointer to the merged Bundle object.
@@ -223,7 +343,8 @@ public:
   Bundle* merge(Bundle* b1, Bundle* b2);
   /**
    * Collapses the merge tree so that all targets are placed in the target list
-   * of the root node and all other nodes are deleted.
+   * of the root node and all other nodes are deleted. Must not be called
+   * concurrently with merges.
    */
   void collapse();
   /**
@@ -0,0 +1,157 @@
+//
+//  fragcache.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "fragcache.h"
+#include "main.h"
+#include "fragments.h"
+#include <cstring>
+
+using namespace std;
+
+/**
+ * A helper function that appends the raw bytes of a value to a buffer.
+ * @param buff the buffer to append to.
+ * @param val the value to append.
+ */
+template <typename T>
+inline void append_val(vector<char>& buff, T val) {
+  const char* p = (const char*)&val;
+  buff.insert(buff.end(), p, p + sizeof(T));
+}
+
+/**
+ * A helper function that reads a value from a buffer and advances the read
+ * position past it.
+ * @param p a reference to the read position in the buffer.
+ * @return The value read.
+ */
+template <typename T>
+inline T read_val(const char*& p) {
+  T val;
+  memcpy(&val, p, sizeof(T));
+  p += sizeof(T);
+  return val;
+}
+
+FragCacheWriter::FragCacheWriter(const string& file_name)
+    : _out(file_name.c_str(), ios::out | ios::binary | ios::trunc) {
+  if (!_out.is_open()) {
+    logger.severe("Unable to open fragment cache file '%s' for writing.",
+                  file_name.c_str());
+  }
+}
+
+void FragCacheWriter::append_read(ReadHit& r) {
+  append_val<uint8_t>(_buff, (uint8_t)(r.first | (r.reversed << 1)));
+  append_val<uint32_t>(_buff, (uint32_t)r.targ_id);
+  append_val<uint32_t>(_buff, (uint32_t)r.left);
+  append_val<uint32_t>(_buff, (uint32_t)r.right);
+  append_val<int32_t>(_buff, (int32_t)r.mate_l);
+  append_val<uint32_t>(_buff, (uint32_t)r.inserts.size());
+  foreach (const Indel& indel, r.inserts) {
+    append_val<uint32_t>(_buff, (uint32_t)indel.pos);
+    append_val<uint32_t>(_buff, (uint32_t)indel.len);
+  }
+  append_val<uint32_t>(_buff, (uint32_t)r.deletes.size());
+  foreach (const Indel& indel, r.deletes) {
+    append_val<uint32_t>(_buff, (uint32_t)indel.pos);
+    append_val<uint32_t>(_buff, (uint32_t)indel.len);
+  }
+  string seq = r.seq.serialize();
+  append_val<uint32_t>(_buff, (uint32_t)r.seq.length());
+  _buff.insert(_buff.end(), seq.begin(), seq.end());
+}
+
+void FragCacheWriter::write_fragment(Fragment& f) {
+  // Reserve space for the record length, filled in below.
+  _buff.assign(sizeof(uint32_t), 0);
+  append_val<uint32_t>(_buff, (uint32_t)f.name().size());
+  _buff.insert(_buff.end(), f.name().begin(), f.name().end());
+
+  size_t num_reads = 0;
+  foreach (const FragHit* hit, f.hits()) {
+    num_reads += (hit->left_read() != NULL) + (hit->right_read() != NULL);
+  }
+  append_val<uint32_t>(_buff, (uint32_t)num_reads);
+
+  // Mates are written consecutively so that they pair up again when the reads
+  // are added back to a Fragment in this order.
+  foreach (FragHit* hit, f.hits()) {
+    if (hit->left_read()) {
+      append_read(*hit->left_read());
+    }
+    if (hit->right_read()) {
+      append_read(*hit->right_read());
+    }
+  }
+
+  uint32_t rec_len = (uint32_t)(_buff.size() - sizeof(uint32_t));
+  memcpy(&_buff[0], &rec_len, sizeof(uint32_t));
+  _out.write(&_buff[0], _buff.size());
+  if (!_out.good()) {
+    logger.severe("Unable to write to fragment cache file.");
+  }
+}
+
+FragCacheParser::FragCacheParser(const string& file_name)
+    : _in(file_name.c_str(), ios::in | ios::binary) {
+  if (!_in.is_open()) {
+    logger.severe("Unable to open fragment cache file '%s' for reading.",
+                  file_name.c_str());
+  }
+}
+
+bool FragCacheParser::next_fragment(Fragment& nf, ParseThreadSafety& pts) {
+  uint32_t rec_len;
+  _in.read((char*)&rec_len, sizeof(uint32_t));
+  if (_in.gcount() == 0) {
+    return false;
+  }
+  _buff.resize(max((size_t)rec_len, (size_t)1));
+  _in.read(&_buff[0], rec_len);
+  if ((size_t)_in.gcount() != rec_len) {
+    logger.severe("Fragment cache file is truncated.");
+  }
+
+  const char* p = &_buff[0];
+  size_t name_len = read_val<uint32_t>(p);
+  string name(p, name_len);
+  p += name_len;
+
+  size_t num_reads = read_val<uint32_t>(p);
+  for (size_t i = 0; i < num_reads; ++i) {
+    ReadHit* r = frag_pool.new_read();
+    r->name = name;
+    uint8_t flags = read_val<uint8_t>(p);
+    r->first = flags & 1;
+    r->reversed = flags & 2;
+    r->targ_id = read_val<uint32_t>(p);
+    r->left = read_val<uint32_t>(p);
+    r->right = read_val<uint32_t>(p);
+    r->mate_l = read_val<int32_t>(p);
+    size_t num_inserts = read_val<uint32_t>(p);
+    for (size_t j = 0; j < num_inserts; ++j) {
+      size_t pos = read_val<uint32_t>(p);
+      r->inserts.push_back(Indel(pos, read_val<uint32_t>(p)));
+    }
+    size_t num_deletes = read_val<uint32_t>(p);
+    for (size_t j = 0; j < num_deletes; ++j) {
+      size_t pos = read_val<uint32_t>(p);
+      r->deletes.push_back(Indel(pos, read_val<uint32_t>(p)));
+    }
+    size_t seq_len = read_val<uint32_t>(p);
+    r->seq.deserialize(p, seq_len);
+    p += (seq_len + 3) / 4;
+    nf.add_map_end(r);
+  }
+  return true;
+}
+
+void FragCacheParser::reset() {
+  _in.clear();
+  _in.seekg(0, ios::beg);
+}
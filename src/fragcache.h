@@ -0,0 +1,98 @@
+/**
+ *  fragcache.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_fragcache_h
+#define express_fragcache_h
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "mapparser.h"
+
+/**
+ * The FragCacheWriter class writes parsed Fragment objects to a compact binary
+ * file so that additional rounds can replay them with a FragCacheParser instead
+ * of decoding the SAM/BAM input again. Only the information used in processing
+ * is stored for each read: the target, coordinates, mate position, indels, and
+ * the encoded sequence with 2 bits per nucleotide. The file is only meant to be
+ * read back by the same process.
+ *  @copyright Artistic License 2.0
+ **/
+class FragCacheWriter {
+  /**
+   * A private output stream for the cache file.
+   */
+  std::ofstream _out;
+  /**
+   * A private buffer used to build each fragment record before writing.
+   */
+  std::vector<char> _buff;
+  /**
+   * A private member function that appends a single read alignment to _buff.
+   * @param r the ReadHit to append.
+   */
+  void append_read(ReadHit& r);
+
+ public:
+  /**
+   * FragCacheWriter constructor opens the cache file for writing.
+   * @param file_name the path to the cache file.
+   */
+  FragCacheWriter(const std::string& file_name);
+  /**
+   * A member function that appends the read alignments of a parsed Fragment to
+   * the cache.
+   * @param f the Fragment to write, which must not have been processed.
+   */
+  void write_fragment(Fragment& f);
+};
+
+/**
+ * The FragCacheParser class fills Fragment objects by reading back a file
+ * written by FragCacheWriter. The read alignments of each fragment are added
+ * in the order they were written, so the resulting Fragments are identical to
+ * those originally parsed. Raw alignments are not stored, so this parser cannot
+ * be used when alignments are being output.
+ *  @copyright Artistic License 2.0
+ **/
+class FragCacheParser : public Parser {
+  /**
+   * A private input stream for the cache file.
+   */
+  std::ifstream _in;
+  /**
+   * A private buffer holding the last fragment record read.
+   */
+  std::vector<char> _buff;
+
+ public:
+  /**
+   * FragCacheParser constructor opens the cache file for reading.
+   * @param file_name the path to the cache file.
+   */
+  FragCacheParser(const std::string& file_name);
+  /**
+   * An accessor for the header string, which is not stored in the cache.
+   * @return An empty string.
+   */
+  const std::string header() const { return ""; }
+  /**
+   * A member function that loads all mappings of the next fragment into the
+   * given Fragment object.
+   * @param nf the empty Fragment to add mappings to.
+   * @param pts the struct containing the queue for invalid alignments (unused
+   *        since invalid alignments are not cached).
+   * @return True iff a fragment was loaded.
+   */
+  bool next_fragment(Fragment& nf, ParseThreadSafety& pts);
+  /**
+   * A member function that rewinds to the beginning of the cache file.
+   */
+  void reset();
+};
+
+#endif
@@ -13,7 +13,9 @@
 
 using namespace std;
 
-Fragment::Fragment(Library* lib) : _lib(lib) {}
+FragmentPool frag_pool;
+
+Fragment::Fragment(Library* lib) : _mass(0), _aux_mass(0), _lib(lib) {}
 
 Fragment::~Fragment() {
   for (size_t i = 0; i < num_hits(); i++) {
@@ -36,7 +38,7 @@ bool Fragment::add_map_end(ReadHit* r)
   if (r->mate_l >= 0) {
     add_open_mate(r);
   } else {  // single-end fragment
-    _frag_hits.push_back(new FragHit(r));
+    _frag_hits.push_back(frag_pool.new_hit(r));
   }
 
   return true;
@@ -55,9 +57,9 @@ void Fragment::add_open_mate(ReadHit* nm) {
         nm->reversed != om->reversed) {
       FragHit* h = NULL;
 	    if (nm->left < om->left || (nm->left == om->left && om->reversed)) {
-        h = new FragHit(nm, om);
+        h = frag_pool.new_hit(nm, om);
       } else {
-        h = new FragHit(om, nm);
+        h = frag_pool.new_hit(om, nm);
       }
 
       found = true;
@@ -91,3 +93,178 @@ bool fraghit_compare(FragHit* h1, FragHit* h2) {
 void Fragment::sort_hits() {
   sort(_frag_hits.begin(), _frag_hits.end(), fraghit_compare);
 }
+
+namespace {
+
+/**
+ * The number of objects moved between a thread's free list and the shared free
+ * list at a time.
+ */
+const size_t POOL_BATCH_SIZE = 64;
+/**
+ * The maximum number of unused objects of each type retained by a thread.
+ */
+const size_t MAX_LOCAL_FREE = 4 * POOL_BATCH_SIZE;
+/**
+ * The maximum number of unused objects of each type retained by the shared free
+ * lists.
+ */
+const size_t MAX_SHARED_FREE = 1 << 16;
+
+/**
+ * Moves up to POOL_BATCH_SIZE objects from the shared free list to the local
+ * one.
+ * @param local the free list of the calling thread.
+ * @param shared the shared free list.
+ * @param mut the mutex protecting the shared free list.
+ */
+template <typename T>
+void refill(vector<T*>& local, vector<T*>& shared, boost::mutex& mut) {
+  boost::unique_lock<boost::mutex> lock(mut);
+  size_t n = min(shared.size(), POOL_BATCH_SIZE);
+  local.insert(local.end(), shared.end() - n, shared.end());
+  shared.resize(shared.size() - n);
+}
+
+/**
+ * Shrinks the local free list to the given size, moving the removed objects to
+ * the shared free list until it reaches MAX_SHARED_FREE and deleting the rest.
+ * @param local the free list of the calling thread.
+ * @param keep the number of objects to leave in the local free list.
+ * @param shared the shared free list.
+ * @param mut the mutex protecting the shared free list.
+ */
+template <typename T>
+void spill(vector<T*>& local, size_t keep, vector<T*>& shared,
+           boost::mutex& mut) {
+  typename vector<T*>::iterator it = local.begin() + keep;
+  {
+    boost::unique_lock<boost::mutex> lock(mut);
+    size_t room = MAX_SHARED_FREE - min(shared.size(), MAX_SHARED_FREE);
+    size_t n = min((size_t)(local.end() - it), room);
+    shared.insert(shared.end(), it, it + n);
+    it += n;
+  }
+  for (; it != local.end(); ++it) {
+    delete *it;
+  }
+  local.resize(keep);
+}
+
+}
+
+FragmentPool::LocalCache::~LocalCache() {
+  spill(reads, 0, pool->_reads, pool->_mut);
+  spill(hits, 0, pool->_hits, pool->_mut);
+  spill(frags, 0, pool->_frags, pool->_mut);
+}
+
+FragmentPool::~FragmentPool() {
+  _local.reset();
+  foreach (ReadHit* r, _reads) {
+    delete r;
+  }
+  foreach (FragHit* h, _hits) {
+    h->_read_l = NULL;
+    h->_read_r = NULL;
+    delete h;
+  }
+  foreach (Fragment* f, _frags) {
+    delete f;
+  }
+}
+
+FragmentPool::LocalCache& FragmentPool::local() {
+  LocalCache* cache = _local.get();
+  if (!cache) {
+    cache = new LocalCache(this);
+    _local.reset(cache);
+  }
+  return *cache;
+}
+
+void FragmentPool::recycle(ReadHit* r, vector<ReadHit*>& reads) {
+  r->inserts.clear();
+  r->deletes.clear();
+  reads.push_back(r);
+}
+
+ReadHit* FragmentPool::new_read() {
+  LocalCache& cache = local();
+  if (cache.reads.empty()) {
+    refill(cache.reads, _reads, _mut);
+    if (cache.reads.empty()) {
+      return new ReadHit();
+    }
+  }
+  ReadHit* r = cache.reads.back();
+  cache.reads.pop_back();
+  return r;
+}
+
+FragHit* FragmentPool::new_hit(ReadHit* l, ReadHit* r) {
+  LocalCache& cache = local();
+  if (cache.hits.empty()) {
+    refill(cache.hits, _hits, _mut);
+    if (cache.hits.empty()) {
+      return (r) ? new FragHit(l, r) : new FragHit(l);
+    }
+  }
+  FragHit* h = cache.hits.back();
+  cache.hits.pop_back();
+  h->reset(l, r);
+  return h;
+}
+
+Fragment* FragmentPool::new_frag(Library* lib) {
+  LocalCache& cache = local();
+  if (cache.frags.empty()) {
+    refill(cache.frags, _frags, _mut);
+    if (cache.frags.empty()) {
+      return new Fragment(lib);
+    }
+  }
+  Fragment* f = cache.frags.back();
+  cache.frags.pop_back();
+  f->_lib = lib;
+  return f;
+}
+
+void FragmentPool::release(ReadHit* r) {
+  LocalCache& cache = local();
+  recycle(r, cache.reads);
+  if (cache.reads.size() > MAX_LOCAL_FREE) {
+    spill(cache.reads, MAX_LOCAL_FREE - POOL_BATCH_SIZE, _reads, _mut);
+  }
+}
+
+void FragmentPool::release(Fragment* f) {
+  LocalCache& cache = local();
+  foreach (FragHit* h, f->_frag_hits) {
+    if (h->_read_l) {
+      recycle(h->_read_l, cache.reads);
+      h->_read_l = NULL;
+    }
+    if (h->_read_r) {
+      recycle(h->_read_r, cache.reads);
+      h->_read_r = NULL;
+    }
+    cache.hits.push_back(h);
+  }
+  foreach (ReadHit* r, f->_open_mates) {
+    recycle(r, cache.reads);
+  }
+  f->_frag_hits.clear();
+  f->_open_mates.clear();
+  f->_name.clear();
+  cache.frags.push_back(f);
+  if (cache.reads.size() > MAX_LOCAL_FREE) {
+    spill(cache.reads, MAX_LOCAL_FREE - POOL_BATCH_SIZE, _reads, _mut);
+  }
+  if (cache.hits.size() > MAX_LOCAL_FREE) {
+    spill(cache.hits, MAX_LOCAL_FREE - POOL_BATCH_SIZE, _hits, _mut);
+  }
+  if (cache.frags.size() > MAX_LOCAL_FREE) {
+    spill(cache.frags, MAX_LOCAL_FREE - POOL_BATCH_SIZE, _frags, _mut);
+  }
+}
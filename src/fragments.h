@@ -9,17 +9,22 @@
 #ifndef FRAGMENTS_H
 #define FRAGMENTS_H
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <stdint.h>
 #include <api/BamAlignment.h>
 #include "sequence.h"
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/tss.hpp"
 
 typedef size_t TargID;
 struct Library;
+class FragmentPool;
 class Target;
 class TargetTable;
 
@@ -41,21 +46,122 @@ enum PairStatus { PAIRED, LEFT_ONLY, RIGHT_ONLY };
  **/
 struct Indel {
   /**
-   * A public size_t for the position of the Indel in the read. 0-based.
+   * A public uint32_t for the position of the Indel in the read. 0-based.
    */
-  size_t pos;
+  uint32_t pos;
   /**
-   * A public size_t for the length of the Indel in the read.
+   * A public uint32_t for the length of the Indel in the read.
    */
-  size_t len;
+  uint32_t len;
+  /**
+   * Dummy Indel constructor.
+   */
+  Indel() : pos(0), len(0) {}
   /**
    * Indel constructor
    */
-  Indel(size_t p, size_t l) : pos(p), len(l) {}
+  Indel(size_t p, size_t l) : pos((uint32_t)p), len((uint32_t)l) {}
+};
+
+/**
+ * The IndelVector class is a vector of Indel objects that stores up to
+ * INLINE_INDELS elements without a heap allocation. Most reads have no more
+ * than one insertion or deletion, so this avoids a separate allocation per
+ * read in the common case. Iterators are plain pointers, which remain valid
+ * until the next push_back.
+ *  @copyright Artistic License 2.0
+ **/
+class IndelVector {
+  /**
+   * The number of Indel objects stored without a heap allocation.
+   */
+  static const size_t INLINE_INDELS = 2;
+  /**
+   * A private array storing the Indel objects until there are more than
+   * INLINE_INDELS of them.
+   */
+  Indel _inline[INLINE_INDELS];
+  /**
+   * A private pointer to the first element, which is either _inline or a heap
+   * array owned by this.
+   */
+  Indel* _data;
+  /**
+   * A private uint32_t for the number of elements.
+   */
+  uint32_t _size;
+  /**
+   * A private uint32_t for the number of elements that fit in _data.
+   */
+  uint32_t _capacity;
+
+  // IndelVectors belong to a single ReadHit and are not copyable.
+  IndelVector(const IndelVector&);
+  IndelVector& operator=(const IndelVector&);
+
+ public:
+  typedef Indel* iterator;
+  typedef const Indel* const_iterator;
+  IndelVector() : _data(_inline), _size(0), _capacity(INLINE_INDELS) {}
+  ~IndelVector() {
+    if (_data != _inline) {
+      delete[] _data;
+    }
+  }
+  /**
+   * A member function that appends an Indel, moving the elements to a larger
+   * heap array if they no longer fit.
+   * @param indel the Indel to append.
+   */
+  void push_back(const Indel& indel) {
+    if (_size == _capacity) {
+      Indel* data = new Indel[2 * _capacity];
+      std::copy(_data, _data + _size, data);
+      if (_data != _inline) {
+        delete[] _data;
+      }
+      _data = data;
+      _capacity *= 2;
+    }
+    _data[_size++] = indel;
+  }
+  /**
+   * A member function that removes all elements. Any heap array is kept for
+   * reuse.
+   */
+  void clear() { _size = 0; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  iterator begin() { return _data; }
+  iterator end() { return _data + _size; }
+  const_iterator begin() const { return _data; }
+  const_iterator end() const { return _data + _size; }
+  Indel& operator[](size_t i) { return _data[i]; }
+  const Indel& operator[](size_t i) const { return _data[i]; }
+};
+
+/**
+ * The RawAlignment struct stores the raw alignment of a read so that it can be
+ * output with the estimated probabilities.
+ *  @copyright Artistic License 2.0
+ **/
+struct RawAlignment {
+  /**
+   * A public BamAlignment object storing the raw alignment information from
+   * BamTools for the read. Only valid if BAM file is input.
+   */
+  BamTools::BamAlignment bam;
+  /**
+   * A public string storing the raw alignment information from for the read.
+   * Only valid if SAM file is input.
+   */
+  std::string sam;
 };
 
 /**
- * The ReadHit struct stores information for a single read alignment.
+ * The ReadHit struct stores information for a single read alignment. Only the
+ * information used in processing is stored inline, in fixed-width fields. The
+ * raw alignment is only allocated when alignments are being output.
  *  @author    Adam Roberts
  *  @date      2012
  *  @copyright Artistic License 2.0
@@ -66,60 +172,66 @@ struct ReadHit {
    */
   std::string name;
   /**
-   * A public bool specifying if this read was sequenced first according to the
-   * SAM flag.
+   * A public uint32_t for the ID of the target mapped to.
    */
-  bool first;
+  uint32_t targ_id;
   /**
-   * A public bool specifying if this read was reverse complemented in its
-   * alignment according to the SAM flag. This would also imply that the read
-   * is the left end of the fragment.
+   * A public uint32_t containing the 0-based leftmost coordinate mapped to in
+   * the target.
    */
-  bool reversed;
+  uint32_t left;
   /**
-   * A public TargID for the target mapped to.
+   * A public uint32_t containing the position following the 0-based rightmost
+   * coordinate mapped to in the target.
    */
-  size_t targ_id;
+  uint32_t right;
   /**
-   * A public size_t containing the 0-based leftmost coordinate mapped to in the
-   * target.
+   * A public int32_t containing the left position for the mate of the read.
+   * -1 if single-end fragment. This is temporarily used to help find the mate
+   * but is not used after.
    */
-  size_t left;
+  int32_t mate_l;
   /**
-   * A public size_t containing the position following the 0-based rightmost
-   * coordinate mapped to in the target.
+   * A public bool specifying if this read was sequenced first according to the
+   * SAM flag.
    */
-  size_t right;
+  bool first;
   /**
-   * The read sequence.
+   * A public bool specifying if this read was reverse complemented in its
+   * alignment according to the SAM flag. This would also imply that the read
+   * is the left end of the fragment.
    */
-  SequenceFwd seq;
+  bool reversed;
   /**
-   * A public vector of Indel objects storing all insertions to the reference in
-   * the read. Insertions are stored in read order.
+   * The read sequence, encoded with 2 bits per nucleotide.
    */
-  std::vector<Indel> inserts;
+  SequenceFwd seq;
   /**
-   * A public vector of Indel objects storing all insertions to the reference in
-   * the read. Deletions are stored in read order.
+   * A public IndelVector storing all insertions to the reference in the read.
+   * Insertions are stored in read order.
    */
-  std::vector<Indel> deletes;
+  IndelVector inserts;
   /**
-   * A public BamAlignment object storing the raw alignment information from
-   * BamTools for the read. Only valid if BAM file is input.
+   * A public IndelVector storing all deletions from the reference in the read.
+   * Deletions are stored in read order.
    */
-  BamTools::BamAlignment bam;
+  IndelVector deletes;
   /**
-   * A public string storing the raw alignment information from for the read.
-   * Only valid if SAM file is input.
+   * A public pointer to the raw alignment, or NULL if it has not been needed.
+   * Once allocated, it is kept for reuse when the ReadHit is recycled.
    */
-  std::string sam;
+  boost::scoped_ptr<RawAlignment> raw;
   /**
-   * A public int containing the left position for the mate of the read.
-   * -1 if single-end fragment. This is temporarily used to help find the mate
-   * but is not used after.
+   * A member function that returns the raw alignment, allocating it if
+   * necessary. Should only be called when alignments are being output.
+   * @return A reference to the raw alignment.
    */
-  int mate_l;
+  RawAlignment& make_raw() {
+    if (!raw) {
+      raw.reset(new RawAlignment());
+    }
+    return *raw;
+  }
 };
 
 /**
@@ -139,6 +251,7 @@ struct HitParams {
  *  @copyright Artistic License 2.0
  **/
 class FragHit {
+  friend class FragmentPool;
   /**
    * Private pointer to the target mapped to.
    */
@@ -147,43 +260,67 @@ class FragHit {
    * Private pointer to data for the upstream (left) read alignment (if it
    * exists). Pointer is deleted with this.
    */
-  boost::scoped_ptr<ReadHit> _read_l;
+  ReadHit* _read_l;
   /**
    * Private pointer to data for the downstream (right) read alignment (if it
    * exists). Pointer is deleted with this.
    */
-  boost::scoped_ptr<ReadHit> _read_r;
+  ReadHit* _read_r;
   /**
    * A private vector storing pointers to "neighboring" targets. This is being
    * used for an experimental feature and may be removed without notice.
    */
   std::vector<const Target*> _neighbors;
   HitParams _params;
-  
+
+  // FragHits own their ReadHits and are not copyable.
+  FragHit(const FragHit&);
+  FragHit& operator=(const FragHit&);
+  /**
+   * A private member function that sets the read alignments of the FragHit.
+   * The single read (if r is NULL) is stored as the left or right read based on
+   * its strand.
+   * @param l pointer to the ReadHit struct for the single-end or upstream
+   *        (left) read.
+   * @param r pointer to the ReadHit struct for the downstream (right) read, or
+   *        NULL if single-end.
+   */
+  void reset(ReadHit* l, ReadHit* r) {
+    _target = NULL;
+    _neighbors.clear();
+    if (!r) {
+      _read_l = (l->reversed) ? NULL : l;
+      _read_r = (l->reversed) ? l : NULL;
+      return;
+    }
+    assert(!l->reversed);
+    assert(r->reversed);
+    assert(l->name == r->name);
+    assert(l->targ_id == r->targ_id);
+    assert(l->left <= r->left);
+    assert(l->first != r->first);
+    _read_l = l;
+    _read_r = r;
+  }
+
 public:
   /**
    * FragHit constructor for single-end read.
    * @param h pointer to the ReadHit struct for the single-end read.
    */
-  FragHit(ReadHit* h) : _target(NULL) {
-    if (h->reversed) {
-      _read_r.reset(h);
-    } else {
-      _read_l.reset(h);
-    }
-  }
+  FragHit(ReadHit* h) { reset(h, NULL); }
   /**
    * Fraghit constructor for paired-end read.
    * @param l pointer to the ReadHit struct for the upstream (left) read.
    * @param r pointer to the ReadHit struct for the downstream (right) read.
    */
-  FragHit(ReadHit* l, ReadHit* r) : _target(NULL), _read_l(l), _read_r(r) {
-    assert(!l->reversed);
-    assert(r->reversed);
-    assert(l->name == r->name);
-    assert(l->targ_id == r->targ_id);
-    assert(l->left <= r->left);
-    assert(l->first != r->first);
+  FragHit(ReadHit* l, ReadHit* r) { reset(l, r); }
+  /**
+   * FragHit destructor deletes the ReadHits.
+   */
+  ~FragHit() {
+    delete _read_l;
+    delete _read_r;
   }
   /**
    * Accessor for the name of the fragment.
@@ -284,7 +421,7 @@ public:
    */
   const ReadHit* left_read() const {
     if (_read_l) {
-      return _read_l.get();
+      return _read_l;
     }
     return NULL;
   }
@@ -295,7 +432,7 @@ public:
    */
   const ReadHit* right_read() const {
     if (_read_r) {
-      return _read_r.get();
+      return _read_r;
     }
     return NULL;
   }
@@ -306,10 +443,10 @@ public:
    */
   const ReadHit* first_read() const {
     if (_read_l && _read_l->first) {
-      return _read_l.get();
+      return _read_l;
     }
     assert(_read_r);
-    return _read_r.get();
+    return _read_r;
   }
   /**
    * Const accessor for the alignment of the second read sequenced in
@@ -318,9 +455,9 @@ public:
    */
   const ReadHit* second_read() const {
     if (_read_l && !_read_l->first) {
-      return _read_l.get();
+      return _read_l;
     } else if (_read_r && !_read_r->first) {
-      return _read_r.get();
+      return _read_r;
     } else {
       return NULL;
     }
@@ -382,6 +519,7 @@ public:
  *  @copyright Artistic License 2.0
  **/
 class Fragment {
+  friend class FragmentPool;
   /**
    * A private vector of FragHit pointers containing all mappings of the
    * fragment.
@@ -402,6 +540,11 @@ class Fragment {
    * forgetting factor during processing.
    */
   double _mass;
+  /**
+   * A private double for the mass of the Fragment as determined by the
+   * forgetting factor of its library, used to update the auxiliary parameters.
+   */
+  double _aux_mass;
   /**
    * A private pointer to the global variables associated with the library
    * this fragment is from.
@@ -480,6 +623,18 @@ public:
    * @return The mass of the fragment.
    */
   double mass() const { return _mass; }
+  /**
+   * Mutator for the mass of the fragment according to the forgetting factor of
+   * its library.
+   * @param m a double representing the value to set the mass to.
+   */
+  void aux_mass(double m) { _aux_mass = m; }
+  /**
+   * An accessor for the mass of the fragment according to the forgetting
+   * factor of its library, used to update the auxiliary parameters.
+   * @return The library mass of the fragment.
+   */
+  double aux_mass() const { return _aux_mass; }
   /**
    * A member function that sorts the FragHits by the TargID of the targets they
    * are aligned to.
@@ -497,4 +652,125 @@ public:
   }
 };
 
+/**
+ * The FragmentPool class recycles Fragment, FragHit and ReadHit objects so that
+ * the parser does not allocate new objects (and their string, vector, and
+ * sequence buffers) for every alignment. Objects are drawn from the pool by the
+ * parser and returned to it once the processed Fragment has been written.
+ * Objects from the pool are allocated with new, so they may also be deleted
+ * directly. All member functions are thread-safe. Each thread keeps its own
+ * free lists and only locks the shared lists to exchange objects in batches.
+ * The number of unused objects retained by each thread and by the shared lists
+ * is capped, and the excess is deleted.
+ *  @copyright Artistic License 2.0
+ **/
+class FragmentPool {
+  /**
+   * The LocalCache struct stores the free lists of a single thread. When the
+   * thread exits, its objects are returned to the shared lists.
+   */
+  struct LocalCache {
+    /**
+     * A pointer to the FragmentPool the objects belong to.
+     */
+    FragmentPool* pool;
+    /**
+     * A vector of unused ReadHits.
+     */
+    std::vector<ReadHit*> reads;
+    /**
+     * A vector of unused FragHits, which do not own any ReadHits.
+     */
+    std::vector<FragHit*> hits;
+    /**
+     * A vector of unused, empty Fragments.
+     */
+    std::vector<Fragment*> frags;
+    LocalCache(FragmentPool* p) : pool(p) {}
+    /**
+     * LocalCache destructor returns all objects to the shared lists.
+     */
+    ~LocalCache();
+  };
+  /**
+   * A private vector of unused ReadHits shared by all threads.
+   */
+  std::vector<ReadHit*> _reads;
+  /**
+   * A private vector of unused FragHits shared by all threads, which do not own
+   * any ReadHits.
+   */
+  std::vector<FragHit*> _hits;
+  /**
+   * A private vector of unused, empty Fragments shared by all threads.
+   */
+  std::vector<Fragment*> _frags;
+  /**
+   * A private mutex protecting the shared free lists.
+   */
+  boost::mutex _mut;
+  /**
+   * A private pointer to the free lists of the calling thread.
+   */
+  boost::thread_specific_ptr<LocalCache> _local;
+  /**
+   * A private member function that returns the free lists of the calling
+   * thread, creating them if necessary.
+   * @return A reference to the LocalCache of the calling thread.
+   */
+  LocalCache& local();
+  /**
+   * A private member function that adds a ReadHit to the given free list.
+   * @param r the ReadHit to recycle.
+   * @param reads the free list to add it to.
+   */
+  void recycle(ReadHit* r, std::vector<ReadHit*>& reads);
+
+ public:
+  /**
+   * FragmentPool destructor deletes all unused objects, including those held
+   * by the calling thread.
+   */
+  ~FragmentPool();
+  /**
+   * A member function that returns an unused ReadHit. Its fields other than the
+   * (empty) indel vectors must be set by the caller.
+   * @return A pointer to the ReadHit, which is owned by the caller.
+   */
+  ReadHit* new_read();
+  /**
+   * A member function that returns a FragHit for the given read alignments.
+   * @param l pointer to the ReadHit struct for the single-end or upstream
+   *        (left) read.
+   * @param r pointer to the ReadHit struct for the downstream (right) read, or
+   *        NULL if single-end.
+   * @return A pointer to the FragHit, which owns the ReadHits and is owned by
+   *         the caller.
+   */
+  FragHit* new_hit(ReadHit* l, ReadHit* r=NULL);
+  /**
+   * A member function that returns an empty Fragment.
+   * @param lib a pointer to the Library the fragment is from.
+   * @return A pointer to the Fragment, which is owned by the caller.
+   */
+  Fragment* new_frag(Library* lib);
+  /**
+   * A member function that returns a ReadHit to the pool.
+   * @param r the ReadHit to recycle, which must not be used by the caller after.
+   */
+  void release(ReadHit* r);
+  /**
+   * A member function that returns a Fragment to the pool, along with all of its
+   * FragHits and ReadHits.
+   * @param f the Fragment to recycle, which must not be used by the caller
+   *        after.
+   */
+  void release(Fragment* f);
+};
+
+/**
+ * The global FragmentPool shared by all parsers.
+ */
+extern FragmentPool frag_pool;
+
 #endif
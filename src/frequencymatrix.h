@@ -9,16 +9,20 @@
  *  Copyright 2011 Adam Roberts. All rights reserved.
  **/
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include "main.h"
+#include "logmath.h"
 
 /**
  * The FrequencyMatrix class keeps track of the frequency parameters in order to
  * allow for constant-time probability look-ups and updates. The table is 2D
  * to allow multiple distributions to be stored in one FrequencyMatrix. The
  * first dimension (rows) are the different distributions. Values are stored in
- * log space by default.
+ * log space by default. Logged tables may instead be stored "scaled", in linear
+ * space relative to a (logged) scale for each row, so that increments do not
+ * require log_add. The values are still accessed and incremented in log space.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
@@ -35,6 +39,12 @@ class FrequencyMatrix {
    * normalizer for the distribution.
    */
   std::vector<T> _rowsums;
+  /**
+   * A private vector to store the (logged) scale of each row if the values are
+   * stored scaled. The logged value of a position is log(_array[k]) plus the
+   * scale of its row.
+   */
+  std::vector<T> _scales;
   /**
    * A private size_t for the number of rows (distributions).
    */
@@ -47,6 +57,11 @@ class FrequencyMatrix {
    * A private bool that specifies if the table values are logged.
    */
   bool _logged;
+  /**
+   * A private bool that specifies if the (logged) table values are stored
+   * scaled in linear space.
+   */
+  bool _scaled;
   /**
    * A private bool that specifies whether or not the values are fixed (locked)
    * and normalized.
@@ -66,8 +81,11 @@ public:
             (columns).
    * @param alpha the intial psuedo-counts (un-logged).
    * @param logged bool that specifies if the table is to be stored logged.
+   * @param scaled bool that specifies if the logged table is to be stored
+   *        scaled in linear space.
    */
-  FrequencyMatrix(size_t m, size_t n, T alpha, bool logged = true);
+  FrequencyMatrix(size_t m, size_t n, T alpha, bool logged = true,
+                  bool scaled = false);
   /**
    * An accessor for the frequency at a given position in the matrix (logged
    * if table is logged).
@@ -105,13 +123,30 @@ public:
    *        logged).
    */
   void increment(size_t k, T incr_amt);
+  /**
+   * A member function that adds the (unnormalized) values of another matrix
+   * with the same dimensions and space to this one. Does nothing if _fixed is
+   * true.
+   * @param other the FrequencyMatrix whose values to add.
+   */
+  void merge(const FrequencyMatrix<T>& other);
+  /**
+   * A member function that sets all values in the matrix to zero (logged if
+   * table is logged). Does nothing if _fixed is true.
+   */
+  void clear();
   /**
    * An accessor for the row sum (normalizer), (logged if table is logged).
    * @param i the distribution (row).
    * @return The sum (normalizer) for the given distribution (logged if table is
    *         (logged).
    */
-  T sum(size_t i) const { return _rowsums[i]; }
+  T sum(size_t i) const {
+    if (_scaled) {
+      return log(_rowsums[i]) + _scales[i];
+    }
+    return _rowsums[i];
+  }
   /**
    * A member function that finds and returns the argmax (index of mode) of the
    * given distribution.
@@ -137,21 +172,45 @@ public:
    * matrix has been fixed (irrevocable).
    */
   bool is_fixed() const { return _fixed; }
+
+private:
+  /**
+   * A member function that changes the scale of a row in a scaled table,
+   * adjusting the stored values to match.
+   * @param i the distribution (row).
+   * @param scale the new (logged) scale.
+   */
+  void rescale(size_t i, T scale);
 };
 
+/**
+ * The largest (logged) amount relative to the scale of a row that may be added
+ * to a scaled FrequencyMatrix before the row is rescaled.
+ */
+const double MAX_SCALED_INCR = 32;
+
 template <class T>
-FrequencyMatrix<T>::FrequencyMatrix(size_t m, size_t n, T alpha, bool logged)
-    : _array(m*n, logged ? log(alpha):alpha),
-      _rowsums(m, logged ? log(n*alpha):n*alpha),
+FrequencyMatrix<T>::FrequencyMatrix(size_t m, size_t n, T alpha, bool logged,
+                                    bool scaled)
+    : _array(m*n, (logged && !scaled) ? log(alpha):alpha),
+      _rowsums(m, (logged && !scaled) ? log(n*alpha):n*alpha),
+      _scales((logged && scaled) ? m : 0, 0),
       _M(m),
       _N(n),
       _logged(logged),
+      _scaled(logged && scaled),
       _fixed(false){
 }
 
 template <class T>
 T FrequencyMatrix<T>::operator()(size_t i, size_t j, bool normalized) const {
   assert(i*_N+j < _M*_N);
+  if (_scaled) {
+    if (!normalized) {
+      return log(_array[i*_N+j]) + _scales[i];
+    }
+    return log(_array[i*_N+j]/_rowsums[i]);
+  }
   if (_fixed || !normalized) {
       return _array[i*_N+j];
   }
@@ -164,6 +223,9 @@ T FrequencyMatrix<T>::operator()(size_t i, size_t j, bool normalized) const {
 
 template <class T>
 T FrequencyMatrix<T>::operator()(size_t k, bool normalized) const {
+  if (_scaled) {
+    return operator()(k / _N, k % _N, normalized);
+  }
   return operator()(0, k, normalized);
 }
 
@@ -175,7 +237,19 @@ void FrequencyMatrix<T>::increment(size_t i, size_t j, T incr_amt) {
 
   assert(i < _M && j < _N);
   size_t k = i*_N+j;
-  if (_logged) {
+  if (_scaled) {
+    if (islzero(incr_amt)) {
+      return;
+    }
+    if (_rowsums[i] == 0) {
+      _scales[i] = incr_amt;
+    } else if (incr_amt - _scales[i] > MAX_SCALED_INCR) {
+      rescale(i, incr_amt);
+    }
+    T val = exp(incr_amt - _scales[i]);
+    _array[k] += val;
+    _rowsums[i] += val;
+  } else if (_logged) {
     _array[k] = log_add(_array[k], incr_amt);
     _rowsums[i] = log_add(_rowsums[i], incr_amt);
   } else {
@@ -190,12 +264,78 @@ void FrequencyMatrix<T>::increment(size_t k, T incr_amt) {
   increment(0, k, incr_amt);
 }
 
+template <class T>
+void FrequencyMatrix<T>::merge(const FrequencyMatrix<T>& other) {
+  if (_fixed) {
+    return;
+  }
+
+  assert(_M == other._M && _N == other._N && _logged == other._logged &&
+         _scaled == other._scaled);
+  if (_scaled) {
+    for (size_t i = 0; i < _M; ++i) {
+      if (other._rowsums[i] == 0) {
+        continue;
+      }
+      if (_rowsums[i] == 0) {
+        _scales[i] = other._scales[i];
+      } else if (other._scales[i] > _scales[i]) {
+        rescale(i, other._scales[i]);
+      }
+      T factor = exp(other._scales[i] - _scales[i]);
+      for (size_t k = i*_N; k < (i+1)*_N; ++k) {
+        _array[k] += factor * other._array[k];
+      }
+      _rowsums[i] += factor * other._rowsums[i];
+    }
+    return;
+  }
+  if (_logged) {
+    log_add_arrays(&_array[0], &other._array[0], _M*_N);
+    log_add_arrays(&_rowsums[0], &other._rowsums[0], _M);
+    return;
+  }
+  for (size_t k = 0; k < _M*_N; ++k) {
+    _array[k] += other._array[k];
+  }
+  for (size_t i = 0; i < _M; ++i) {
+    _rowsums[i] += other._rowsums[i];
+  }
+}
+
+template <class T>
+void FrequencyMatrix<T>::clear() {
+  if (_fixed) {
+    return;
+  }
+  bool logged = _logged && !_scaled;
+  std::fill(_array.begin(), _array.end(), (logged) ? log(T(0)) : T(0));
+  std::fill(_rowsums.begin(), _rowsums.end(), (logged) ? log(T(0)) : T(0));
+  std::fill(_scales.begin(), _scales.end(), T(0));
+}
+
+template <class T>
+void FrequencyMatrix<T>::rescale(size_t i, T scale) {
+  T factor = exp(_scales[i] - scale);
+  for (size_t k = i*_N; k < (i+1)*_N; ++k) {
+    _array[k] *= factor;
+  }
+  _rowsums[i] *= factor;
+  _scales[i] = scale;
+}
+
 template <class T>
 void FrequencyMatrix<T>::set_logged(bool logged) {
   if (logged == _logged || _fixed) {
     return;
   }
-  if (logged) {
+  if (_scaled) {
+    for (size_t i = 0; i < _M; ++i) {
+      rescale(i, 0);
+    }
+    _scales.clear();
+    _scaled = false;
+  } else if (logged) {
     for (size_t i = 0; i < _M*_N; ++i) {
       _array[i] = log(_array[i]);
     }
@@ -239,6 +379,8 @@ void FrequencyMatrix<T>::fix() {
     }
     _rowsums[i] = (_logged) ? 0 : 1;
   }
+  _scales.clear();
+  _scaled = false;
   _fixed = true;
 }
 
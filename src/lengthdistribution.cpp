@@ -8,6 +8,7 @@
 
 #include "lengthdistribution.h"
 #include "main.h"
+#include "logmath.h"
 #include <numeric>
 #include <boost/assign.hpp>
 #include <iostream>
@@ -25,7 +26,8 @@ LengthDistribution::LengthDistribution(double alpha, size_t max_val,
       _tot_mass(LOG_0),
       _sum(LOG_0),
       _min(max_val/bin_size),
-      _bin_size(bin_size) {
+      _bin_size(bin_size),
+      _cmf_stale(true) {
   
   max_val = max_val/bin_size;
   kernel_n = kernel_n/bin_size;
@@ -66,7 +68,8 @@ LengthDistribution::LengthDistribution(double alpha, size_t max_val,
 
 LengthDistribution::LengthDistribution(string param_file_name,
                                        string length_type) :
-    _bin_size(1) {
+    _bin_size(1),
+    _cmf_stale(true) {
   ifstream infile (param_file_name.c_str());
   const size_t BUFF_SIZE = 99999;
   char line_buff[BUFF_SIZE];
@@ -100,6 +103,28 @@ LengthDistribution::LengthDistribution(string param_file_name,
   _min = max_val();;
 }
 
+LengthDistribution::LengthDistribution(const LengthDistribution& other)
+    : _kernel(other._kernel),
+      _hist(other._hist),
+      _tot_mass(other._tot_mass),
+      _sum(other._sum),
+      _min(other._min),
+      _bin_size(other._bin_size),
+      _cmf_stale(true) {
+}
+
+LengthDistribution& LengthDistribution::operator=(
+    const LengthDistribution& other) {
+  _kernel = other._kernel;
+  _hist = other._hist;
+  _tot_mass = other._tot_mass;
+  _sum = other._sum;
+  _min = other._min;
+  _bin_size = other._bin_size;
+  _cmf_stale = true;
+  return *this;
+}
+
 size_t LengthDistribution::max_val() const {
   return (_hist.size()-1) * _bin_size;
 }
@@ -125,6 +150,7 @@ void LengthDistribution::add_val(size_t len, double mass) {
   }
 
   size_t offset = len - _kernel.size()/2;
+  _cmf_stale = true;
 
   for (size_t i = 0; i < _kernel.size(); i++) {
     if (offset > 0 && offset < _hist.size()) {
@@ -137,34 +163,98 @@ void LengthDistribution::add_val(size_t len, double mass) {
   }
 }
 
+void LengthDistribution::merge(const LengthDistribution& other) {
+  assert(_hist.size() == other._hist.size());
+  if (fabs(other._tot_mass) == LOG_0) {
+    return;
+  }
+  log_add_arrays(&_hist[0], &other._hist[0], _hist.size());
+  _cmf_stale = true;
+  _sum = log_add(_sum, other._sum);
+  _tot_mass = log_add(_tot_mass, other._tot_mass);
+  _min = min(_min, other._min);
+}
+
+void LengthDistribution::clear() {
+  _hist.assign(_hist.size(), LOG_0);
+  _sum = LOG_0;
+  _tot_mass = LOG_0;
+  _min = _hist.size() - 1;
+  _cmf_stale = true;
+}
+
 double LengthDistribution::pmf(size_t len) const {
   len /= _bin_size;
-  if (len > max_val()) {
-    len = max_val();
+  if (len >= _hist.size()) {
+    len = _hist.size() - 1;
   }
   return _hist[len]-_tot_mass;
 }
 
-double LengthDistribution::cmf(size_t len) const {
+void LengthDistribution::update_cmf() const {
+  if (!_cmf_stale.load(boost::memory_order_acquire)) {
+    return;
+  }
+  boost::unique_lock<boost::mutex> lock(_cmf_mut);
+  if (!_cmf_stale.load(boost::memory_order_relaxed)) {
+    return;
+  }
   double cum = LOG_0;
-  vector<double> cdf(_hist.size());
+  _cmf.resize(_hist.size());
   for (size_t i = 0; i < _hist.size(); ++i) {
     cum = log_add(cum, _hist[i]);
-    
+    _cmf[i] = cum - _tot_mass;
+  }
+  assert(approx_eq(cum, _tot_mass));
+
+  size_t max_len = max_val();
+  _pmf_sums.resize(max_len + 1);
+  _len_pmf_sums.resize(max_len + 1);
+  double pmf_sum = 0;
+  double len_pmf_sum = 0;
+  for (size_t l = 0; l <= max_len; ++l) {
+    double p = sexp(pmf(l));
+    pmf_sum += p;
+    len_pmf_sum += l * p;
+    _pmf_sums[l] = pmf_sum;
+    _len_pmf_sums[l] = len_pmf_sum;
   }
-  return cum - _tot_mass;
+  _cmf_stale.store(false, boost::memory_order_release);
 }
 
-vector<double> LengthDistribution::cmf() const {
-  double cum = LOG_0;
-  vector<double> cdf(_hist.size());
-  for (size_t i = 0; i < _hist.size(); ++i) {
-    cum = log_add(cum, _hist[i]);
-    cdf[i] = cum - _tot_mass;
+double LengthDistribution::cmf(size_t len) const {
+  update_cmf();
+  len /= _bin_size;
+  if (len >= _cmf.size()) {
+    len = _cmf.size() - 1;
   }
-  assert(approx_eq(cum, _tot_mass));
+  return _cmf[len];
+}
+
+const vector<double>& LengthDistribution::cmf() const {
+  update_cmf();
+  return _cmf;
+}
 
-  return cdf;
+double LengthDistribution::effective_length(size_t len) const {
+  update_cmf();
+  size_t lo = min_val();
+  size_t hi = min(len, max_val());
+  if (lo > hi) {
+    return LOG_0;
+  }
+  // sum_{l=lo}^{hi} pmf(l)*(len-l+1) = (len+1)*sum(pmf(l)) - sum(l*pmf(l))
+  double pmf_sum = _pmf_sums[hi];
+  double len_pmf_sum = _len_pmf_sums[hi];
+  if (lo) {
+    pmf_sum -= _pmf_sums[lo-1];
+    len_pmf_sum -= _len_pmf_sums[lo-1];
+  }
+  double eff_len = (len + 1) * pmf_sum - len_pmf_sum;
+  if (eff_len <= 0) {
+    return LOG_0;
+  }
+  return log(eff_len);
 }
 
 double LengthDistribution::tot_mass() const {
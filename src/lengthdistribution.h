@@ -9,6 +9,8 @@
 #ifndef LengthDistribution_H
 #define LengthDistribution_H
 
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
 #include <vector>
 #include <string>
 
@@ -17,7 +19,10 @@
  * It is initialized with a Gaussian prior with parameters specified by the
  * arguments to the constructor. An argument-specified binomial kernel is then
  * added for each observation. All mass values and probabilities are stored and
- * returned in log space (except in to_string).
+ * returned in log space (except in to_string). The cumulative distribution and
+ * the prefix sums used for effective lengths are cached and rebuilt on the
+ * first lookup after the distribution changes, so lookups may be made
+ * concurrently as long as no updates are.
  */
 class LengthDistribution {
   /**
@@ -45,7 +50,36 @@ class LengthDistribution {
    * A size for internal binning of the lengths in the distribution.
    */
   size_t _bin_size;
-  
+  /**
+   * A private vector that caches the (logged) cumulative mass function of the
+   * bins. Only valid if _cmf_stale is false.
+   */
+  mutable std::vector<double> _cmf;
+  /**
+   * A private vector that caches the (non-logged) sums of the probabilities of
+   * the lengths from 0 to each length. Only valid if _cmf_stale is false.
+   */
+  mutable std::vector<double> _pmf_sums;
+  /**
+   * A private vector that caches the (non-logged) sums of the products of the
+   * lengths from 0 to each length and their probabilities. Only valid if
+   * _cmf_stale is false.
+   */
+  mutable std::vector<double> _len_pmf_sums;
+  /**
+   * A private atomic bool that is true iff the cached sums must be rebuilt
+   * because the distribution has changed since they were last built.
+   */
+  mutable boost::atomic<bool> _cmf_stale;
+  /**
+   * A private mutex held while rebuilding the cached sums.
+   */
+  mutable boost::mutex _cmf_mut;
+  /**
+   * A private member function that rebuilds the cached sums if they are stale.
+   */
+  void update_cmf() const;
+
 public:
   /**
    * LengthDistribution Constructor.
@@ -74,6 +108,17 @@ public:
    *        to be matched in the parameter file.
    */
   LengthDistribution(std::string param_file_name, std::string length_type);
+  /**
+   * LengthDistribution copy constructor.
+   * @param other the LengthDistribution to copy.
+   */
+  LengthDistribution(const LengthDistribution& other);
+  /**
+   * LengthDistribution assignment operator.
+   * @param other the LengthDistribution to copy.
+   * @return A reference to this.
+   */
+  LengthDistribution& operator=(const LengthDistribution& other);
   /**
    * An accessor for the maximum allowed length.
    * @return Max allowed length.
@@ -96,6 +141,17 @@ public:
    * @param mass a double for the mass (logged) to add.
    */
   void add_val(size_t len, double mass);
+  /**
+   * A member function that adds the observations accumulated in another
+   * LengthDistribution with the same size and kernel to this one.
+   * @param other the LengthDistribution whose observations to add.
+   */
+  void merge(const LengthDistribution& other);
+  /**
+   * A member function that removes all mass (including pseudo-counts) from the
+   * distribution so that it can be used to accumulate observations to merge.
+   */
+  void clear();
   /**
    * An accessor for the (logged) probability of a given length.
    * @param len an integer for the length to return the probability of.
@@ -111,10 +167,21 @@ public:
   double cmf(size_t len) const;
   /**
    * A member function that returns a vector containing the (logged) cumulative
-   * mass function *for the bins*.
+   * mass function *for the bins*. The returned reference is invalidated when
+   * the distribution changes.
    * @return (Logged) cmf of bins.
    */
-  std::vector<double> cmf() const;
+  const std::vector<double>& cmf() const;
+  /**
+   * A member function that returns the (logged) number of positions a fragment
+   * could start at in a target of the given length, weighted by the
+   * probability of the fragment length. Computed in constant time from the
+   * cached prefix sums.
+   * @param len the length of the target.
+   * @return The (logged) sum over fragment lengths l from min_val() to
+   *         min(len, max_val()) of pmf(l)*(len-l+1).
+   */
+  double effective_length(size_t len) const;
   /**
    * An accessor for the (logged) observation mass (including pseudo-counts).
    * @return Total observation mass.
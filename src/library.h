@@ -28,6 +28,11 @@ struct Library {
    * Path to the out file. Empty if alignments are not to be output.
    */
   std::string out_file_name;
+  /**
+   * Path to the binary cache of parsed fragments used for additional rounds.
+   * Empty if fragments are not to be cached.
+   */
+  std::string cache_file_name;
   /**
    * A pointer to the MapParser for parsing the input alignment file for this
    * library.
@@ -0,0 +1,407 @@
+//
+//  logmath.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "logmath.h"
+#include "main.h"
+#include <cfloat>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+  #define LOGMATH_X86
+  #include <immintrin.h>
+#endif
+
+using namespace std;
+
+double log1p_exp_table[LOG1P_EXP_MAX*LOG1P_EXP_RES + 2];
+
+namespace {
+
+/**
+ * Helper function that fills log1p_exp_table.
+ * @return True.
+ */
+bool fill_log1p_exp_table() {
+  for (size_t i = 0; i < LOG1P_EXP_MAX*LOG1P_EXP_RES + 2; ++i) {
+    log1p_exp_table[i] = log(1 + exp(-(double)i/LOG1P_EXP_RES));
+  }
+  return true;
+}
+
+const bool log1p_exp_table_filled = fill_log1p_exp_table();
+
+/**
+ * The smallest difference from the maximum for which exp is computed by the
+ * vectorized kernels. Smaller values do not change the sum.
+ */
+const double EXP_MIN = -708.0;
+
+#ifndef LOGMATH_X86
+
+double log_sum_scalar(const double* vals, size_t n) {
+  double max_val = -DBL_MAX;
+  for (size_t i = 0; i < n; ++i) {
+    if (!islzero(vals[i])) {
+      max_val = max(max_val, vals[i]);
+    }
+  }
+  if (max_val == -DBL_MAX) {
+    return LOG_0;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!islzero(vals[i])) {
+      sum += exp(vals[i] - max_val);
+    }
+  }
+  return max_val + log(sum);
+}
+
+double log_sum_scalar(const float* vals, size_t n) {
+  double max_val = -DBL_MAX;
+  for (size_t i = 0; i < n; ++i) {
+    if (!islzero(vals[i])) {
+      max_val = max(max_val, (double)vals[i]);
+    }
+  }
+  if (max_val == -DBL_MAX) {
+    return LOG_0;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (!islzero(vals[i])) {
+      sum += exp(vals[i] - max_val);
+    }
+  }
+  return max_val + log(sum);
+}
+
+#endif
+
+void log_add_arrays_scalar(double* dst, const double* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = log_add(dst[i], src[i]);
+  }
+}
+
+#ifdef LOGMATH_X86
+
+/**
+ * Constants for the range reduction of exp and log.
+ */
+const double LOG2E = 1.4426950408889634074;
+const double LN2 = 0.69314718055994530942;
+const double LN2_HI = 6.93147180369123816490e-01;
+const double LN2_LO = 1.90821492927058770002e-10;
+const double SQRT2 = 1.41421356237309504880;
+/**
+ * 1.5*2^52, which rounds a double to an integer when added to it and leaves
+ * the integer in the low bits of the mantissa.
+ */
+const double ROUND_MAGIC = 6755399441055744.0;
+/**
+ * The Taylor coefficients (1/k!) for exp on [-ln(2)/2, ln(2)/2].
+ */
+const size_t EXP_DEGREE = 12;
+const double EXP_COEFFS[EXP_DEGREE + 1] = {
+  1.0, 1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040, 1.0/40320,
+  1.0/362880, 1.0/3628800, 1.0/39916800, 1.0/479001600
+};
+/**
+ * The coefficients (2/(2k+1)) of the series for log(y) in s=(y-1)/(y+1) and
+ * z=s^2 on [sqrt(2)/2, sqrt(2)], which is log(y) = s*sum(LOG_COEFFS[k]*z^k).
+ */
+const size_t LOG_DEGREE = 10;
+const double LOG_COEFFS[LOG_DEGREE + 1] = {
+  2.0, 2.0/3, 2.0/5, 2.0/7, 2.0/9, 2.0/11, 2.0/13, 2.0/15, 2.0/17, 2.0/19,
+  2.0/21
+};
+
+inline __m128d load2(const double* p) { return _mm_loadu_pd(p); }
+
+inline __m128d load2(const float* p) {
+  return _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double*)p)));
+}
+
+/**
+ * Helper function that returns a mask of the lanes that are not log(0).
+ */
+inline __m128d nonzero_sse2(__m128d v) {
+  const __m128d abs_mask = _mm_castsi128_pd(
+      _mm_set1_epi64x(0x7fffffffffffffffLL));
+  return _mm_cmpneq_pd(_mm_and_pd(v, abs_mask), _mm_set1_pd(LOG_0));
+}
+
+/**
+ * Helper function that computes exp for values in [EXP_MIN, 0]. Other lanes
+ * must be masked out by the caller.
+ */
+inline __m128d exp_sse2(__m128d x) {
+  const __m128d magic = _mm_set1_pd(ROUND_MAGIC);
+  __m128d t = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(LOG2E)), magic);
+  __m128d k = _mm_sub_pd(t, magic);
+  __m128d r = _mm_sub_pd(x, _mm_mul_pd(k, _mm_set1_pd(LN2_HI)));
+  r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(LN2_LO)));
+  __m128d p = _mm_set1_pd(EXP_COEFFS[EXP_DEGREE]);
+  for (size_t j = EXP_DEGREE; j-- > 0; ) {
+    p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(EXP_COEFFS[j]));
+  }
+  __m128i e = _mm_sub_epi64(_mm_castpd_si128(t), _mm_castpd_si128(magic));
+  e = _mm_slli_epi64(_mm_add_epi64(e, _mm_set1_epi64x(1023)), 52);
+  return _mm_mul_pd(p, _mm_castsi128_pd(e));
+}
+
+/**
+ * Helper function that computes log(y) for values in [1, 2].
+ */
+inline __m128d log_sse2(__m128d y) {
+  __m128d big = _mm_cmpgt_pd(y, _mm_set1_pd(SQRT2));
+  y = _mm_or_pd(_mm_and_pd(big, _mm_mul_pd(y, _mm_set1_pd(0.5))),
+                _mm_andnot_pd(big, y));
+  __m128d one = _mm_set1_pd(1.0);
+  __m128d s = _mm_div_pd(_mm_sub_pd(y, one), _mm_add_pd(y, one));
+  __m128d z = _mm_mul_pd(s, s);
+  __m128d p = _mm_set1_pd(LOG_COEFFS[LOG_DEGREE]);
+  for (size_t j = LOG_DEGREE; j-- > 0; ) {
+    p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(LOG_COEFFS[j]));
+  }
+  return _mm_add_pd(_mm_mul_pd(p, s), _mm_and_pd(big, _mm_set1_pd(LN2)));
+}
+
+inline double hmax_sse2(__m128d v) {
+  return max(_mm_cvtsd_f64(v), _mm_cvtsd_f64(_mm_unpackhi_pd(v, v)));
+}
+
+inline double hsum_sse2(__m128d v) {
+  return _mm_cvtsd_f64(v) + _mm_cvtsd_f64(_mm_unpackhi_pd(v, v));
+}
+
+template <class T>
+double log_sum_sse2(const T* vals, size_t n) {
+  __m128d vmax = _mm_set1_pd(-DBL_MAX);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d v = load2(vals + i);
+    __m128d nz = nonzero_sse2(v);
+    vmax = _mm_max_pd(vmax, _mm_or_pd(_mm_and_pd(nz, v),
+                                      _mm_andnot_pd(nz, _mm_set1_pd(-DBL_MAX))));
+  }
+  double max_val = hmax_sse2(vmax);
+  for (size_t j = i; j < n; ++j) {
+    if (!islzero(vals[j])) {
+      max_val = max(max_val, (double)vals[j]);
+    }
+  }
+  if (max_val == -DBL_MAX) {
+    return LOG_0;
+  }
+
+  __m128d m = _mm_set1_pd(max_val);
+  __m128d vsum = _mm_setzero_pd();
+  for (i = 0; i + 2 <= n; i += 2) {
+    __m128d x = _mm_sub_pd(load2(vals + i), m);
+    __m128d valid = _mm_and_pd(_mm_cmpge_pd(x, _mm_set1_pd(EXP_MIN)),
+                               _mm_cmple_pd(x, _mm_setzero_pd()));
+    vsum = _mm_add_pd(vsum, _mm_and_pd(valid, exp_sse2(x)));
+  }
+  double sum = hsum_sse2(vsum);
+  for (size_t j = i; j < n; ++j) {
+    if (!islzero(vals[j])) {
+      sum += exp(vals[j] - max_val);
+    }
+  }
+  return max_val + log(sum);
+}
+
+void log_add_arrays_sse2(double* dst, const double* src, size_t n) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_loadu_pd(dst + i);
+    __m128d b = _mm_loadu_pd(src + i);
+    __m128d nz_a = nonzero_sse2(a);
+    __m128d nz_b = nonzero_sse2(b);
+    __m128d hi = _mm_max_pd(a, b);
+    __m128d x = _mm_sub_pd(_mm_min_pd(a, b), hi);
+    __m128d valid = _mm_cmpge_pd(x, _mm_set1_pd(EXP_MIN));
+    __m128d e = _mm_and_pd(valid, exp_sse2(x));
+    __m128d sum = _mm_add_pd(hi, log_sse2(_mm_add_pd(_mm_set1_pd(1.0), e)));
+    // log_add(a, b) is b if a is log(0), a if only b is log(0), else sum.
+    __m128d res = _mm_or_pd(_mm_and_pd(nz_b, sum), _mm_andnot_pd(nz_b, a));
+    res = _mm_or_pd(_mm_and_pd(nz_a, res), _mm_andnot_pd(nz_a, b));
+    _mm_storeu_pd(dst + i, res);
+  }
+  log_add_arrays_scalar(dst + i, src + i, n - i);
+}
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 inline __m256d load4(const double* p) { return _mm256_loadu_pd(p); }
+
+AVX2 inline __m256d load4(const float* p) {
+  return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+AVX2 inline __m256d nonzero_avx2(__m256d v) {
+  const __m256d abs_mask = _mm256_castsi256_pd(
+      _mm256_set1_epi64x(0x7fffffffffffffffLL));
+  return _mm256_cmp_pd(_mm256_and_pd(v, abs_mask), _mm256_set1_pd(LOG_0),
+                       _CMP_NEQ_UQ);
+}
+
+AVX2 inline __m256d exp_avx2(__m256d x) {
+  const __m256d magic = _mm256_set1_pd(ROUND_MAGIC);
+  __m256d t = _mm256_fmadd_pd(x, _mm256_set1_pd(LOG2E), magic);
+  __m256d k = _mm256_sub_pd(t, magic);
+  __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(LN2_HI), x);
+  r = _mm256_fnmadd_pd(k, _mm256_set1_pd(LN2_LO), r);
+  __m256d p = _mm256_set1_pd(EXP_COEFFS[EXP_DEGREE]);
+  for (size_t j = EXP_DEGREE; j-- > 0; ) {
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(EXP_COEFFS[j]));
+  }
+  __m256i e = _mm256_sub_epi64(_mm256_castpd_si256(t),
+                               _mm256_castpd_si256(magic));
+  e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+  return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+AVX2 inline __m256d log_avx2(__m256d y) {
+  __m256d big = _mm256_cmp_pd(y, _mm256_set1_pd(SQRT2), _CMP_GT_OQ);
+  y = _mm256_blendv_pd(y, _mm256_mul_pd(y, _mm256_set1_pd(0.5)), big);
+  __m256d one = _mm256_set1_pd(1.0);
+  __m256d s = _mm256_div_pd(_mm256_sub_pd(y, one), _mm256_add_pd(y, one));
+  __m256d z = _mm256_mul_pd(s, s);
+  __m256d p = _mm256_set1_pd(LOG_COEFFS[LOG_DEGREE]);
+  for (size_t j = LOG_DEGREE; j-- > 0; ) {
+    p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(LOG_COEFFS[j]));
+  }
+  return _mm256_fmadd_pd(p, s, _mm256_and_pd(big, _mm256_set1_pd(LN2)));
+}
+
+AVX2 inline double hmax_avx2(__m256d v) {
+  return hmax_sse2(_mm_max_pd(_mm256_castpd256_pd128(v),
+                              _mm256_extractf128_pd(v, 1)));
+}
+
+AVX2 inline double hsum_avx2(__m256d v) {
+  return hsum_sse2(_mm_add_pd(_mm256_castpd256_pd128(v),
+                              _mm256_extractf128_pd(v, 1)));
+}
+
+template <class T>
+AVX2 double log_sum_avx2(const T* vals, size_t n) {
+  __m256d vmax = _mm256_set1_pd(-DBL_MAX);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d v = load4(vals + i);
+    vmax = _mm256_max_pd(vmax, _mm256_blendv_pd(_mm256_set1_pd(-DBL_MAX), v,
+                                                nonzero_avx2(v)));
+  }
+  double max_val = hmax_avx2(vmax);
+  for (size_t j = i; j < n; ++j) {
+    if (!islzero(vals[j])) {
+      max_val = max(max_val, (double)vals[j]);
+    }
+  }
+  if (max_val == -DBL_MAX) {
+    return LOG_0;
+  }
+
+  __m256d m = _mm256_set1_pd(max_val);
+  __m256d vsum = _mm256_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_sub_pd(load4(vals + i), m);
+    __m256d valid = _mm256_and_pd(
+        _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN), _CMP_GE_OQ),
+        _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LE_OQ));
+    vsum = _mm256_add_pd(vsum, _mm256_and_pd(valid, exp_avx2(x)));
+  }
+  double sum = hsum_avx2(vsum);
+  for (size_t j = i; j < n; ++j) {
+    if (!islzero(vals[j])) {
+      sum += exp(vals[j] - max_val);
+    }
+  }
+  return max_val + log(sum);
+}
+
+AVX2 void log_add_arrays_avx2(double* dst, const double* src, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(dst + i);
+    __m256d b = _mm256_loadu_pd(src + i);
+    __m256d hi = _mm256_max_pd(a, b);
+    __m256d x = _mm256_sub_pd(_mm256_min_pd(a, b), hi);
+    __m256d valid = _mm256_cmp_pd(x, _mm256_set1_pd(EXP_MIN), _CMP_GE_OQ);
+    __m256d e = _mm256_and_pd(valid, exp_avx2(x));
+    __m256d sum = _mm256_add_pd(hi,
+                                log_avx2(_mm256_add_pd(_mm256_set1_pd(1.0), e)));
+    // log_add(a, b) is b if a is log(0), a if only b is log(0), else sum.
+    __m256d res = _mm256_blendv_pd(a, sum, nonzero_avx2(b));
+    res = _mm256_blendv_pd(b, res, nonzero_avx2(a));
+    _mm256_storeu_pd(dst + i, res);
+  }
+  log_add_arrays_scalar(dst + i, src + i, n - i);
+}
+
+#undef AVX2
+
+#endif
+
+/**
+ * The Kernels struct stores pointers to the implementations of the array
+ * functions chosen for the processor.
+ */
+struct Kernels {
+  double (*log_sum_double)(const double*, size_t);
+  double (*log_sum_float)(const float*, size_t);
+  void (*log_add_arrays)(double*, const double*, size_t);
+};
+
+Kernels select_kernels() {
+  Kernels k;
+#ifdef LOGMATH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    k.log_sum_double = &log_sum_avx2<double>;
+    k.log_sum_float = &log_sum_avx2<float>;
+    k.log_add_arrays = &log_add_arrays_avx2;
+  } else {
+    k.log_sum_double = &log_sum_sse2<double>;
+    k.log_sum_float = &log_sum_sse2<float>;
+    k.log_add_arrays = &log_add_arrays_sse2;
+  }
+#else
+  k.log_sum_double = &log_sum_scalar;
+  k.log_sum_float = &log_sum_scalar;
+  k.log_add_arrays = &log_add_arrays_scalar;
+#endif
+  return k;
+}
+
+const Kernels& kernels() {
+  static const Kernels k = select_kernels();
+  return k;
+}
+
+}
+
+double log_sum(const double* vals, size_t n) {
+  return kernels().log_sum_double(vals, n);
+}
+
+double log_sum(const float* vals, size_t n) {
+  return kernels().log_sum_float(vals, n);
+}
+
+void log_add_arrays(double* dst, const double* src, size_t n) {
+  kernels().log_add_arrays(dst, src, n);
+}
+
+void log_add_arrays(float* dst, const float* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = log_add(dst[i], src[i]);
+  }
+}
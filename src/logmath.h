@@ -0,0 +1,49 @@
+/**
+ *  logmath.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_logmath_h
+#define express_logmath_h
+
+#include <cstddef>
+
+/**
+ * Global function to calculate the log of the sum of an array of logged values.
+ * Values equal to log(0) (of either sign) are skipped. Uses AVX2 or SSE2
+ * instructions when supported by the processor.
+ * @param vals a pointer to the logged values to sum.
+ * @param n the number of values.
+ * @return The log of the sum of exp(vals[i]), or LOG_0 if there are no nonzero
+ *         values.
+ */
+double log_sum(const double* vals, size_t n);
+/**
+ * Global function to calculate the log of the sum of an array of logged floats.
+ * @param vals a pointer to the logged values to sum.
+ * @param n the number of values.
+ * @return The log of the sum of exp(vals[i]), or LOG_0 if there are no nonzero
+ *         values.
+ */
+double log_sum(const float* vals, size_t n);
+/**
+ * Global function that adds an array of logged values to another elementwise,
+ * with the same result as calling log_add on each pair. Uses AVX2 or SSE2
+ * instructions when supported by the processor.
+ * @param dst a pointer to the logged values to add to.
+ * @param src a pointer to the logged values to add.
+ * @param n the number of values.
+ */
+void log_add_arrays(double* dst, const double* src, size_t n);
+/**
+ * Global function that adds an array of logged floats to another elementwise,
+ * with the same result as calling log_add on each pair.
+ * @param dst a pointer to the logged values to add to.
+ * @param src a pointer to the logged values to add.
+ * @param n the number of values.
+ */
+void log_add_arrays(float* dst, const float* src, size_t n);
+
+#endif
@@ -14,12 +14,14 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include "main.h"
 #include "bundles.h"
 #include "targets.h"
+#include "targetindex.h"
 #include "lengthdistribution.h"
 #include "fragments.h"
 #include "biascorrection.h"
@@ -94,7 +96,15 @@ bool output_align_prob = false;
 bool output_align_samp = false;
 bool output_running_rounds = false;
 bool output_running_reads = false;
+bool cache_frags = false;
+bool lock_free_updates = false;
+bool fast_log_add = false;
+bool scaled_aux_tables = false;
 size_t num_threads = 2;
+size_t frag_batch_size = 64;
+size_t aux_param_threads = 1;
+size_t parse_threads = 0;
+size_t max_threads = 1;
 size_t num_neighbors = 0;
 size_t library_size = 0;
 
@@ -112,6 +122,7 @@ bool both = false;
 size_t remaining_rounds = 0;
 
 bool spark_pre = false;
+bool index_targets = false;
 
 typedef boost::unordered_map<string, double> AlphaMap;
 AlphaMap* expr_alpha_map = NULL;
@@ -151,6 +162,15 @@ AlphaMap* parse_priors(string in_file) {
  */
 bool parse_options(int ac, char ** av) {
 
+  // The index command takes the path of the index to write in place of the
+  // alignment file.
+  if (ac > 1 && string(av[1]) == "index") {
+    index_targets = true;
+    av[1] = av[0];
+    --ac;
+    ++av;
+  }
+
   size_t additional_online = 0;
   size_t additional_batch = 0;
   
@@ -216,6 +236,8 @@ bool parse_options(int ac, char ** av) {
   ("aux-param-file",
    po::value<string>(&param_file_name)->default_value(param_file_name),
    "path to file containing auxiliary parameters to use instead of learning")
+  ("cache-frags",
+   "cache parsed fragments in the output directory for additional rounds")
   ;
 
   string prior_file = "";
@@ -224,6 +246,21 @@ bool parse_options(int ac, char ** av) {
   hidden.add_options()
   ("num-threads,p", po::value<size_t>(&num_threads)->default_value(num_threads),
    "number of threads (>= 2)")
+  ("frag-batch-size",
+   po::value<size_t>(&frag_batch_size)->default_value(frag_batch_size),
+   "number of fragments passed between threads at a time")
+  ("parse-threads", po::value<size_t>(&parse_threads),
+   "number of the threads given by -p that decompress and parse the input "
+   "(default: half of those beyond the main parsing and processing threads)")
+  ("aux-param-threads",
+   po::value<size_t>(&aux_param_threads)->default_value(aux_param_threads),
+   "number of threads refreshing the target bias parameters (>= 1)")
+  ("lock-free-updates",
+   "update the targets atomically without holding their locks")
+  ("fast-log-add",
+   "approximate log(1+exp(x)) in log_add by table lookup (error < 2e-6)")
+  ("scaled-aux-tables",
+   "store the error and bias model tables in linear space while learning")
   ("edit-detect","")
   ("single-round", "")
   ("output-running-rounds", "")
@@ -268,14 +305,22 @@ bool parse_options(int ac, char ** av) {
     error = true;
   }
 
+  if (index_targets && in_map_file_names == "") {
+    logger.info("Command-Line Argument Error: index file required.");
+    error = true;
+  }
+
   if (error || vm.count("help")) {
     cerr << "express v" << PACKAGE_VERSION << endl
          << "-----------------------------\n"
          << "File Usage:  express [options] <target_seqs.fa> <hits.(sam/bam)>\n"
          << "Piped Usage: bowtie [options] -S <index> <reads.fq> | express "
-         << "[options] <target_seqs.fa>\n\n"
+         << "[options] <target_seqs.fa>\n"
+         << "Index Usage: express index [options] <target_seqs.fa> "
+         << "<target_seqs.idx>\n\n"
          << "Required arguments:\n"
-         << " <target_seqs.fa>     target sequence file in fasta format\n"
+         << " <target_seqs.fa>     target sequence file in fasta format, or an "
+         << "index of it\n"
          << " <hits.(sam/bam)>     read alignment file in SAM or BAM format\n\n"
          << standard
          << advanced;
@@ -321,6 +366,10 @@ bool parse_options(int ac, char ** av) {
   output_align_samp = vm.count("output-align-samp");
   output_running_rounds = vm.count("output-running-rounds");
   output_running_reads = vm.count("output-running-reads");
+  cache_frags = vm.count("cache-frags");
+  lock_free_updates = vm.count("lock-free-updates");
+  fast_log_add = vm.count("fast-log-add");
+  scaled_aux_tables = vm.count("scaled-aux-tables");
   batch_mode = vm.count("batch-mode");
   both = vm.count("both");
   remaining_rounds = max(additional_online, additional_batch);
@@ -348,13 +397,18 @@ bool parse_options(int ac, char ** av) {
   
   // We have 1 processing thread and 1 parsing thread always, so we should not
   // count these as additional threads.
-  if (num_threads < 2) {
-    num_threads = 0;
-  }
-  num_threads -= 2;
+  max_threads = max(num_threads, (size_t)1);
+  num_threads = (num_threads < 2) ? 0 : num_threads - 2;
   if (num_threads > 0) {
     num_threads -= edit_detect;
   }
+  // The additional threads are split between decompressing and parsing the
+  // input and processing the fragments, so that -p bounds the busy threads.
+  if (!vm.count("parse-threads")) {
+    parse_threads = num_threads / 2;
+  }
+  parse_threads = min(parse_threads, num_threads);
+  num_threads -= parse_threads;
   if (remaining_rounds && in_map_file_names == "") {
     logger.severe("Cannot process multiple rounds from streaming input.");
   }
@@ -417,21 +471,140 @@ void output_results(Librarian& libs, size_t tot_counts, int n=-1) {
   }
 }
 
+/**
+ * The number of fragments a processing thread handles before burn-out between
+ * merges of its auxiliary parameter updates into the shared tables.
+ */
+const size_t AUX_MERGE_INTERVAL = 1024;
+
+/**
+ * The AuxDeltas struct accumulates the updates to the auxiliary parameter
+ * tables of a library made by a single processing thread before burn-out. The
+ * shared tables are only read while fragments are processed, and the updates
+ * are periodically merged into them while holding the exclusive lock.
+ *  @copyright Artistic License 2.0
+ **/
+struct AuxDeltas {
+  /**
+   * A public pointer to the accumulated fragment length observations.
+   */
+  boost::scoped_ptr<LengthDistribution> fld;
+  /**
+   * A public pointer to the accumulated error model updates, or NULL if the
+   * library has no MismatchTable.
+   */
+  boost::scoped_ptr<MismatchTable> mismatch_table;
+  /**
+   * A public pointer to the accumulated bias observations, or NULL if the
+   * library has no BiasBoss.
+   */
+  boost::scoped_ptr<BiasBoss> bias_table;
+  /**
+   * A public size_t for the number of fragments processed since the last merge.
+   */
+  size_t num_frags;
+  /**
+   * AuxDeltas constructor creates empty tables matching those of the library.
+   * The shared tables must not be modified during construction.
+   * @param lib the Library whose auxiliary parameters will be updated.
+   */
+  AuxDeltas(const Library& lib) : num_frags(0) {
+    fld.reset(new LengthDistribution(*lib.fld));
+    fld->clear();
+    if (lib.mismatch_table) {
+      mismatch_table.reset(new MismatchTable(0));
+    }
+    if (lib.bias_table) {
+      bias_table.reset(new BiasBoss(lib.bias_table->order(), 0));
+    }
+  }
+  /**
+   * A member function that adds the accumulated updates to the tables of the
+   * library and clears them. The shared tables must be locked exclusively.
+   * @param lib the Library whose auxiliary parameters should be updated.
+   */
+  void merge(Library& lib) {
+    lib.fld->merge(*fld);
+    fld->clear();
+    if (mismatch_table) {
+      lib.mismatch_table->merge(*mismatch_table);
+      mismatch_table->clear();
+    }
+    if (bias_table) {
+      lib.bias_table->merge_observations(*bias_table);
+      bias_table->clear_observations();
+    }
+    num_frags = 0;
+  }
+};
+
+/**
+ * This function calculates the marginal likelihoods of the alignments of a
+ * multi-mapped fragment, storing them in the alignment parameters, along with
+ * the (logged) masses and variances of the targets they align to.
+ * @param frag the fragment whose alignment likelihoods to calculate.
+ * @param masses a vector to fill with the masses of the aligned targets.
+ * @param variances a vector to fill with the mass variances of the aligned
+ *        targets.
+ * @param total_likelihood set to the (logged) sum of the likelihoods.
+ * @param total_mass set to the (logged) sum of the masses.
+ * @param total_variance set to the (logged) sum of the variances.
+ * @param mm_cache a cache of the error model likelihoods of the alignments.
+ */
+void calc_likelihoods(Fragment& frag, vector<double>& masses,
+                      vector<double>& variances, double& total_likelihood,
+                      double& total_mass, double& total_variance,
+                      MismatchCache& mm_cache) {
+  mm_cache.clear();
+  total_likelihood = LOG_0;
+  total_mass = LOG_0;
+  total_variance = LOG_0;
+  for (size_t i = 0; i < frag.num_hits(); ++i) {
+    FragHit& m = *frag.hits()[i];
+    const Target* t = m.target();
+    m.params()->align_likelihood = t->align_likelihood(m, &mm_cache);
+    m.params()->full_likelihood = m.params()->align_likelihood +
+                                  t->sample_likelihood(first_round,
+                                                       m.neighbors());
+    masses[i] = t->mass();
+    variances[i] = t->mass_var();
+    total_likelihood = log_add(total_likelihood, m.params()->full_likelihood);
+    total_mass = log_add(total_mass, masses[i]);
+    total_variance = log_add(total_variance, variances[i]);
+    assert(!isnan(total_likelihood));
+  }
+}
+
 /**
  * This function handles the probabilistic assignment of multi-mapped reads. The
  * marginal likelihoods are calculated for each mapping, and the mass of the
  * fragment is divided based on the normalized marginals to update the model
- * parameters.
+ * parameters. If lock_free_updates is set, the target locks are not taken
+ * (unless the target sequences are updated for edit detection) and the target
+ * parameters are updated atomically, so the marginals may be based on masses
+ * that other threads are concurrently updating.
  * @param frag_p pointer to the fragment to probabilistically assign.
+ * @param deltas pointer to the struct in which to accumulate auxiliary
+ *        parameter updates, or NULL if they should be applied directly to the
+ *        library's tables.
+ * @param covar_buf pointer to the buffer in which to accumulate covariance
+ *        updates, or NULL if they should be applied directly to the table.
  */
-void process_fragment(Fragment* frag_p) {
+void process_fragment(Fragment* frag_p, AuxDeltas* deltas=NULL,
+                      CovarBuffer* covar_buf=NULL) {
   Fragment& frag = *frag_p;
   const Library& lib = *frag.lib();
+  double aux_mass = frag.aux_mass();
 
   // sort hits to avoid deadlock
   frag.sort_hits();
   double mass_n = frag.mass();
 
+  // With edit detection, the error model updates the probabilistic target
+  // sequences, which are not atomic and must still be locked.
+  bool lock_targets = !lock_free_updates ||
+                      (edit_detect && lib.mismatch_table);
+
   assert(frag.num_hits());
 
   vector<double> masses(frag.num_hits(), 0);
@@ -449,7 +622,8 @@ void process_fragment(Fragment* frag_p) {
   Bundle* bundle = frag.hits()[0]->target()->bundle();
   
   if (frag.num_hits() > 1) {
-    // Calculate marginal likelihoods and lock targets.
+    // Merge bundles and find the targets (and neighbors) to lock in order.
+    vector<const Target*> lock_order;
     for (size_t i = 0; i < frag.num_hits(); ++i) {
       FragHit& m = *frag.hits()[i];
       Target* t = m.target();
@@ -457,42 +631,43 @@ void process_fragment(Fragment* frag_p) {
       bundle = lib.targ_table->merge_bundles(bundle, t->bundle());
       t->bundle(bundle);
       
-      if (locked_set.count(t) == 0) {
-        t->lock();
-        locked_set.insert(t);
+      if (locked_set.insert(t).second) {
+        lock_order.push_back(t);
       }
       targ_set = locked_set;
-      // lock neighbors
       foreach (const Target* neighbor, *m.neighbors()) {
-        if (locked_set.count(neighbor) == 0) {
-          neighbor->lock();
-          locked_set.insert(neighbor);
+        if (locked_set.insert(neighbor).second) {
+          lock_order.push_back(neighbor);
         }
       }
-      m.params()->align_likelihood = t->align_likelihood(m);
-      m.params()->full_likelihood = m.params()->align_likelihood +
-                                    t->sample_likelihood(first_round,
-                                                         m.neighbors());
-      masses[i] = t->mass();
-      variances[i] = t->mass_var();
-      total_likelihood = log_add(total_likelihood, m.params()->full_likelihood);
-      total_mass = log_add(total_mass, masses[i]);
-      total_variance = log_add(total_variance, variances[i]);
-      num_solvable += t->solvable();
-      assert(!isnan(total_likelihood));
+    }
+
+    if (lock_targets) {
+      foreach (const Target* t, lock_order) {
+        t->lock();
+      }
+    }
+
+    MismatchCache mm_cache;
+    calc_likelihoods(frag, masses, variances, total_likelihood, total_mass,
+                     total_variance, mm_cache);
+
+    for (size_t i = 0; i < frag.num_hits(); ++i) {
+      num_solvable += frag.hits()[i]->target()->solvable();
     }
   } else {
     FragHit& m = *frag.hits()[0];
     Target* t = m.target();
-    t->lock();
+    if (lock_targets) {
+      t->lock();
+    }
     locked_set.insert(t);
     total_likelihood = 0;
     m.params()->align_likelihood = 0;
     m.params()->full_likelihood = 0;
     foreach (const Target* neighbor, *frag.hits()[0]->neighbors()) {
-      if (targ_set.count(neighbor) == 0) {
+      if (locked_set.insert(neighbor).second && lock_targets) {
         neighbor->lock();
-        locked_set.insert(neighbor);
       }
     }
   }
@@ -501,8 +676,10 @@ void process_fragment(Fragment* frag_p) {
     assert(expr_alpha_map);
     logger.warn("Fragment '%s' has 0 likelihood of originating from the "
                 "transcriptome. Skipping...", frag.name().c_str());
-    foreach (const Target* t, locked_set) {
-      t->unlock();
+    if (lock_targets) {
+      foreach (const Target* t, locked_set) {
+        t->unlock();
+      }
     }
     return;
   }
@@ -513,6 +690,14 @@ void process_fragment(Fragment* frag_p) {
   if (first_round || online_additional) {
     bundle->incr_mass(mass_n);
   }
+
+  // Sampled error model updates for alignments with the same read and
+  // reference context are combined into a single update of their summed mass.
+  MismatchTable* mismatch_out = (deltas) ? deltas->mismatch_table.get() :
+                                           lib.mismatch_table.get();
+  vector<size_t> mm_keys;
+  vector<size_t> mm_hits;
+  vector<double> mm_masses;
   
   // normalize marginal likelihoods
   for (size_t i = 0; i < frag.num_hits(); ++i) {
@@ -540,23 +725,38 @@ void process_fragment(Fragment* frag_p) {
         t->solvable(true);
       }
       if (edit_detect && lib.mismatch_table) {
-        (lib.mismatch_table)->update(m, p, lib.mass_n);
+        (lib.mismatch_table)->update(m, p, aux_mass, *mismatch_out);
       }
       if (!burned_out && r < sexp(p)) {
-        if (lib.mismatch_table && !edit_detect) {
-          (lib.mismatch_table)->update(m, LOG_1, lib.mass_n);
+        size_t key = 0;
+        if (lib.mismatch_table && !edit_detect && frag.num_hits() > 1 &&
+            (lib.mismatch_table)->context_key(m, key)) {
+          size_t k = find(mm_keys.begin(), mm_keys.end(), key) -
+                     mm_keys.begin();
+          if (k < mm_keys.size()) {
+            mm_masses[k] = log_add(mm_masses[k], aux_mass);
+          } else {
+            mm_keys.push_back(key);
+            mm_hits.push_back(i);
+            mm_masses.push_back(aux_mass);
+          }
+        } else if (lib.mismatch_table && !edit_detect) {
+          (lib.mismatch_table)->update(m, LOG_1, aux_mass, *mismatch_out);
         }
         if (m.pair_status() == PAIRED) {
-          (lib.fld)->add_val(m.length(), lib.mass_n);
+          LengthDistribution& fld_out = (deltas) ? *deltas->fld : *lib.fld;
+          fld_out.add_val(m.length(), aux_mass);
         }
         if (lib.bias_table) {
-          (lib.bias_table)->update_observed(m, lib.mass_n);
+          BiasBoss& bias_out = (deltas) ? *deltas->bias_table : *lib.bias_table;
+          bias_out.update_observed(m, aux_mass);
         }
       }
     }
     if (calc_covar && (last_round || online_additional)) {
       double var = 2*mass_n + p + log_sub(LOG_1, p);
-      lib.targ_table->update_covar(m.target_id(), m.target_id(), var);
+      lib.targ_table->update_covar(m.target_id(), m.target_id(), var,
+                                   covar_buf);
       for (size_t j = i+1; j < frag.num_hits(); ++j) {
         const FragHit& m2 = *frag.hits()[j];
         double p2 = m2.params()->full_likelihood-total_likelihood;
@@ -564,31 +764,101 @@ void process_fragment(Fragment* frag_p) {
           continue;
         }
         double covar = 2*mass_n + p + p2;
-        lib.targ_table->update_covar(m.target_id(), m2.target_id(), covar);
+        lib.targ_table->update_covar(m.target_id(), m2.target_id(), covar,
+                                     covar_buf);
       }
     }
   }
 
-  foreach (const Target* t, locked_set) {
-    t->unlock();
+  for (size_t k = 0; k < mm_keys.size(); ++k) {
+    (lib.mismatch_table)->update(*frag[mm_hits[k]], LOG_1, mm_masses[k],
+                                 *mismatch_out);
+  }
+
+  if (lock_targets) {
+    foreach (const Target* t, locked_set) {
+      t->unlock();
+    }
   }
 }
 
 /**
  * This function processes Fragments asynchronously. Fragments are popped from
  * a threadsafe input queue, processed, and then pushed onto a threadsafe output
- * queue.
+ * queue. Before burn-out, the auxiliary parameter updates are accumulated in
+ * thread-local tables that are periodically merged into those of the library.
  * @param pts pointer to a struct with the input and output Fragment queues.
+ * @param lib pointer to the Library whose auxiliary parameters are updated, or
+ *        NULL if they are burned out.
+ * @param bu_mut pointer to the mutex protecting the auxiliary parameters,
+ *        which is held shared while processing and exclusively while merging.
  */
-void proc_thread(ParseThreadSafety* pts) {
+void proc_thread(ParseThreadSafety* pts, Library* lib,
+                 boost::shared_mutex* bu_mut) {
+  FragBatchReader<MPMCBatchQueue> proc_on(pts->proc_on);
+  FragBatchWriter<MPMCBatchQueue> proc_out(pts->proc_out, frag_batch_size);
+  boost::scoped_ptr<AuxDeltas> deltas;
+  CovarBuffer covar_buf;
+  if (lib) {
+    boost::shared_lock<boost::shared_mutex> lock(*bu_mut);
+    deltas.reset(new AuxDeltas(*lib));
+  }
   while (true) {
-    Fragment* frag = pts->proc_on.pop();
+    Fragment* frag = proc_on.pop();
     if (!frag) {
       break;
     }
-    process_fragment(frag);
-    pts->proc_out.push(frag);
+    if (deltas) {
+      bool merge = false;
+      {
+        boost::shared_lock<boost::shared_mutex> lock(*bu_mut);
+        process_fragment(frag, deltas.get(), &covar_buf);
+        merge = burned_out || ++deltas->num_frags == AUX_MERGE_INTERVAL;
+      }
+      if (merge) {
+        boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+        deltas->merge(*lib);
+        // No more updates are made once burned out.
+        if (burned_out) {
+          deltas.reset(NULL);
+        }
+      }
+    } else {
+      // The bias update thread may still be swapping in target parameters.
+      boost::shared_lock<boost::shared_mutex> lock(*bu_mut);
+      process_fragment(frag, NULL, &covar_buf);
+    }
+    proc_out.push(frag);
+  }
+  if (deltas) {
+    boost::unique_lock<boost::shared_mutex> lock(*bu_mut);
+    deltas->merge(*lib);
   }
+  // Covariances must be in the table before the thread is joined.
+  covar_buf.flush();
+  proc_out.flush();
+}
+
+/**
+ * This function stops the processing threads by sending them the stop signal
+ * (NULL) after any fragments still to be dispatched, and waits for them to
+ * finish.
+ * @param thread_pool the processing threads, which are deleted and removed.
+ * @param pts the struct containing the Fragment queues.
+ * @param proc_on the writer for the queue of fragments to be processed.
+ */
+void stop_proc_threads(vector<boost::thread*>& thread_pool,
+                       ParseThreadSafety& pts,
+                       FragBatchWriter<MPMCBatchQueue>& proc_on) {
+  proc_on.flush();
+  for (size_t k = 0; k < thread_pool.size(); ++k) {
+    pts.proc_on.push(NULL);
+  }
+  foreach(boost::thread* t, thread_pool) {
+    t->join();
+    delete t;
+  }
+  thread_pool.clear();
 }
 
 /**
@@ -621,12 +891,15 @@ size_t threaded_calc_abundances(Librarian& libs) {
       Library& lib = libs[l];
       libs.set_curr(l);
       MapParser& map_parser = *lib.map_parser;
-      boost::mutex bu_mut;
+      boost::shared_mutex bu_mut;
       // Used to signal bias update thread
       running = true;
       ParseThreadSafety pts(max((int)num_threads,10));
       boost::thread parse(&MapParser::threaded_parse, &map_parser, &pts,
                           stop_at, num_neighbors);
+      FragBatchReader<SPSCBatchQueue> proc_in(pts.proc_in);
+      FragBatchWriter<MPMCBatchQueue> proc_on(pts.proc_on, frag_batch_size);
+      FragBatchWriter<MPMCBatchQueue> proc_out(pts.proc_out, frag_batch_size);
       vector<boost::thread*> thread_pool;
       RobertsFilter frags_seen;
 
@@ -636,28 +909,36 @@ size_t threaded_calc_abundances(Librarian& libs) {
           bias_update.reset(new boost::thread(&TargetTable::asynch_bias_update,
                                               lib.targ_table, &bu_mut));
           if (lib.mismatch_table) {
+            boost::unique_lock<boost::shared_mutex> lock(bu_mut);
             (lib.mismatch_table)->activate();
           }
         }
         if (lib.n == burn_out) {
+          // Processing threads merge their remaining updates and stop
+          // accumulating them once they see that we are burned out.
+          boost::unique_lock<boost::shared_mutex> lock(bu_mut);
           if (lib.mismatch_table) {
             (lib.mismatch_table)->fix();
           };
           burned_out = true;
         }
-        // Start threads once aux parameters are burned out
-        if (burned_out && num_threads && thread_pool.size() == 0) {
+        // Start threads, which accumulate their own aux parameter updates
+        // until burn-out
+        if (num_threads && thread_pool.size() == 0) {
           lib.targ_table->enable_bundle_threadsafety();
+          Library* aux_lib = (burned_out) ? NULL : &lib;
           thread_pool = vector<boost::thread*>(num_threads);
           for (size_t k = 0; k < thread_pool.size(); k++) {
-            thread_pool[k] = new boost::thread(proc_thread, &pts);
+            thread_pool[k] = new boost::thread(proc_thread, &pts, aux_lib,
+                                               &bu_mut);
           }
         }
 
         // Pop next parsed fragment and set mass
-        frag = pts.proc_in.pop();
+        frag = proc_in.pop();
         if (frag) {
           frag->mass(mass_n);
+          frag->aux_mass(lib.mass_n);
           dir_detector.add_fragment(frag);
         }
 
@@ -668,34 +949,32 @@ size_t threaded_calc_abundances(Librarian& libs) {
                         frag->name().c_str());
         }
 
-        // If multi-threaded and burned out, push to the processing queue
-        if (num_threads && burned_out) {
+        // If multi-threaded, push to the processing queue
+        if (num_threads) {
           // If no more fragments, send stop signal (NULL) to processing threads
           if (!frag) {
-            for (size_t k = 0; k < thread_pool.size(); ++k) {
-              pts.proc_on.push(NULL);
-            }
+            proc_out.flush();
+            stop_proc_threads(thread_pool, pts, proc_on);
             break;
           }
-          pts.proc_on.push(frag);
+          proc_on.push(frag);
         } else {
           if (!frag) {
+            proc_out.flush();
             break;
           }
           {
             // Block the bias update thread from updating the paramater tables
-            // during processing. We don't need to do this during multi-threaded
-            // processing since the parameters are burned out before we start
-            // the threads.
-            boost::unique_lock<boost::mutex> lock(bu_mut);
+            // during processing.
+            boost::unique_lock<boost::shared_mutex> lock(bu_mut);
             process_fragment(frag);
-            pts.proc_out.push(frag);
+            proc_out.push(frag);
           }
         }
 
         // Output intermediate results, if necessary
         if (output_running_reads && n == i*pow(10.,(double)j)) {
-          boost::unique_lock<boost::mutex> lock(bu_mut);
+          boost::unique_lock<boost::shared_mutex> lock(bu_mut);
           output_results(libs, n, (int)n);
           if (i++ == 9) {
             i = 1;
@@ -723,9 +1002,6 @@ size_t threaded_calc_abundances(Librarian& libs) {
       running = false;
 
       parse.join();
-      foreach(boost::thread* t, thread_pool) {
-        t->join();
-      }
 
       lib.targ_table->disable_bundle_threadsafety();
       lib.targ_table->collapse_bundles();
@@ -761,6 +1037,19 @@ size_t threaded_calc_abundances(Librarian& libs) {
   return num_frags;
 }
 
+/**
+ * This function writes an index of the target sequences that can be given in
+ * place of the MultiFASTA file in later runs.
+ */
+int index_main() {
+  logger.info("Indexing target sequences and measuring bias background...");
+  // The background is measured in both directions so that the index can be
+  // used with any library type.
+  direction = BOTH;
+  TargetIndex::write(fasta_file_name, in_map_file_names, bias_model_order);
+  return 0;
+}
+
 /**
  * The main function instantiates the library parameter tables and parsers,
  * calls the processing function, and outputs the results. Also handles
@@ -806,7 +1095,12 @@ int estimation_main() {
     
     libs[i].in_file_name = file_names[i];
     libs[i].out_file_name = out_map_file_name;
-    libs[i].map_parser.reset(new MapParser(&libs[i], last_round));
+    if (cache_frags && remaining_rounds) {
+      sprintf(buff, "%s/frags.%d.cache", output_dir.c_str(), (int)i+1);
+      libs[i].cache_file_name = buff;
+    }
+    libs[i].map_parser.reset(new MapParser(&libs[i], last_round,
+                                           parse_threads));
 
     if (param_file_name.size()) {
       libs[i].fld.reset(new LengthDistribution(param_file_name, "Fragment"));
@@ -855,10 +1149,9 @@ int estimation_main() {
   }
   double num_targ = (double)targ_table->size();
   
-  if (calc_covar && (double)SSIZE_MAX < num_targ*(num_targ+1)) {
-    logger.warn("Your system is unable to represent large enough values for "
-                "efficiently hashing target pairs. Covariance calculation will "
-                "be disabled.");
+  if (calc_covar && num_targ > (double)UINT32_MAX + 1) {
+    logger.warn("Covariances can only be calculated for up to 2^32 targets. "
+                "Covariance calculation will be disabled.");
     calc_covar = false;
   }
   
@@ -978,13 +1271,15 @@ int preprocess_main() {
   ParseThreadSafety pts(10);
   boost::thread parse(&MapParser::threaded_parse, lib.map_parser.get(), &pts,
                       stop_at, 0);
+  FragBatchReader<SPSCBatchQueue> proc_in(pts.proc_in);
+  FragBatchWriter<MPMCBatchQueue> proc_out(pts.proc_out, frag_batch_size);
   RobertsFilter frags_seen;
   proto::Fragment frag_proto;
   while(true) {
     frag_proto.Clear();
     
     // Pop next parsed fragment and set mass
-    frag = pts.proc_in.pop();
+    frag = proc_in.pop();
     
     if (!frag) {
       break;
@@ -1070,7 +1365,7 @@ int preprocess_main() {
     frag_proto.SerializeToString(&out_buff);
     frag_out << base64_encode(out_buff) << endl;
     
-    pts.proc_out.push(frag);
+    proc_out.push(frag);
     
     num_frags++;
     
@@ -1079,6 +1374,7 @@ int preprocess_main() {
       logger.info("Fragments Processed: %d", num_frags);
     }
   }
+  proc_out.flush();
   
   parse.join();
   
@@ -1096,6 +1392,10 @@ int main (int argc, char ** argv)
     return parse_ret;
   }
   
+  if (index_targets) {
+    return index_main();
+  }
+
 #ifdef PROTO
   if (spark_pre) {
     return preprocess_main();
@@ -42,6 +42,16 @@ extern bool burned_out;
  * A global bool that is true when edit detection is enabled
  */
 extern bool edit_detect;
+/**
+ * A global bool that is true when log_add should use the table-based
+ * approximation of log(1+exp(-d)) instead of calling exp and log.
+ */
+extern bool fast_log_add;
+/**
+ * A global bool that is true when the error and bias model tables should be
+ * stored scaled in linear space while they are being learned.
+ */
+extern bool scaled_aux_tables;
 /**
  * A global size_t for the maximum allowed indel size.
  */
@@ -66,6 +76,21 @@ extern Direction direction;
  * A global size_t specifying the maximum read length supported.
  */
 extern size_t max_read_len;
+/**
+ * A global size_t specifying the number of fragments passed between threads at
+ * a time.
+ */
+extern size_t frag_batch_size;
+/**
+ * A global size_t specifying the number of threads used to refresh the target
+ * bias parameters and background bias expectations.
+ */
+extern size_t aux_param_threads;
+/**
+ * A global size_t specifying the total number of threads requested with -p
+ * (at least 1), which bounds the threads used while loading the targets.
+ */
+extern size_t max_threads;
 /**
  * A global size_t specifying the number of possible nucleotides.
  */
@@ -106,9 +131,41 @@ inline bool approx_eq(double a, double b, double eps=EPSILON) {
   return fabs(a-b) <= eps;
 }
 
+/**
+ * A global size_t specifying the number of entries per unit in the table used
+ * to approximate log(1+exp(-d)).
+ */
+const size_t LOG1P_EXP_RES = 128;
+/**
+ * A global size_t specifying the difference between two logged values beyond
+ * which the smaller is ignored by the approximate log_add.
+ */
+const size_t LOG1P_EXP_MAX = 32;
+/**
+ * A global table of log(1+exp(-d)) for d = i/LOG1P_EXP_RES, filled before main
+ * is entered.
+ */
+extern double log1p_exp_table[LOG1P_EXP_MAX*LOG1P_EXP_RES + 2];
+
+/**
+ * Global function to approximate log(1+exp(-d)) by linear interpolation in
+ * log1p_exp_table. The absolute error is less than 2e-6.
+ * @param d a non-negative double.
+ * @return a double for the approximate value of log(1+exp(-d)).
+ */
+inline double fast_log1p_exp(double d) {
+  if (!(d < LOG1P_EXP_MAX)) {
+    return 0;
+  }
+  double pos = d * LOG1P_EXP_RES;
+  size_t i = (size_t)pos;
+  return log1p_exp_table[i] +
+         (pos - i) * (log1p_exp_table[i+1] - log1p_exp_table[i]);
+}
+
 /**
  * Global function to calculate the log of the sum of 2 logged values
- * efficiently.
+ * efficiently. Approximated using fast_log1p_exp if fast_log_add is true.
  * @param x a double for the first logged value in the sum.
  * @param y a double for the second logged value in the sum.
  * @return a double for the log of exp(x)+exp(y).
@@ -125,6 +182,10 @@ inline double log_add(double x, double y) {
     std::swap(x,y);
   }
 
+  if (fast_log_add) {
+    return x + fast_log1p_exp(x-y);
+  }
+
   double sum = x+log(1+exp(y-x));
   return sum;
 }
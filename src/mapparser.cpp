@@ -12,27 +12,122 @@
 #include "targets.h"
 #include "threadsafety.h"
 #include "library.h"
+#include "bgzfreader.h"
+#include "fragcache.h"
+#include "mappedfile.h"
+#include "parsepool.h"
 #include <boost/algorithm/string/predicate.hpp>
 
 using namespace std;
 
-const size_t BUFF_SIZE = 9999;
+// The initial size of the buffer used for reading SAM from a stream.
+const size_t BUFF_SIZE = 1 << 20;
+// The approximate number of bytes of input parsed at a time by each ParsePool
+// worker.
+const size_t CHUNK_SIZE = 1 << 20;
+
+// The fixed-length portion of a BAM alignment record following block_size.
+const size_t BAM_CORE_SIZE = 32;
+const char BAM_CIGAR_OPS[] = "MIDNSHP=X";
+const char BAM_NUCS[] = "=ACMGRSVTWYHKDBN";
+
+/**
+ * A helper function that reads a little-endian 32-bit integer from a BAM
+ * record.
+ * @param p a pointer to the first byte of the integer.
+ * @return The value of the integer.
+ */
+inline uint32_t bam_uint32(const char* p) {
+  const unsigned char* u = (const unsigned char*)p;
+  return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) |
+         ((uint32_t)u[3] << 24);
+}
+
+/**
+ * A helper function that fills a BamAlignment from the raw bytes of a BAM
+ * alignment record (following its block_size field). All public fields used by
+ * the parser and BamTools::BamWriter are filled.
+ * @param data a pointer to the raw record.
+ * @param len the length of the raw record in bytes.
+ * @param a the BamAlignment to fill.
+ * @return True iff the record is well-formed.
+ */
+bool decode_bam_record(const char* data, size_t len,
+                       BamTools::BamAlignment& a) {
+  if (len < BAM_CORE_SIZE) {
+    return false;
+  }
+  a.RefID = (int32_t)bam_uint32(data);
+  a.Position = (int32_t)bam_uint32(data + 4);
+  uint32_t bin_mq_nl = bam_uint32(data + 8);
+  uint32_t flag_nc = bam_uint32(data + 12);
+  a.Length = (int32_t)bam_uint32(data + 16);
+  a.MateRefID = (int32_t)bam_uint32(data + 20);
+  a.MatePosition = (int32_t)bam_uint32(data + 24);
+  a.InsertSize = (int32_t)bam_uint32(data + 28);
+  a.Bin = (uint16_t)(bin_mq_nl >> 16);
+  a.MapQuality = (uint16_t)((bin_mq_nl >> 8) & 0xff);
+  a.AlignmentFlag = flag_nc >> 16;
+
+  size_t name_len = bin_mq_nl & 0xff;
+  size_t num_ops = flag_nc & 0xffff;
+  size_t seq_len = (size_t)max(a.Length, 0);
+  const char* p = data + BAM_CORE_SIZE;
+  const char* end = data + len;
+  if (name_len == 0 ||
+      (size_t)(end - p) < name_len + 4*num_ops + (seq_len+1)/2 + seq_len) {
+    return false;
+  }
+
+  a.Name.assign(p, name_len - 1);
+  p += name_len;
+
+  a.CigarData.clear();
+  for (size_t i = 0; i < num_ops; ++i, p += 4) {
+    uint32_t op = bam_uint32(p);
+    a.CigarData.push_back(BamTools::CigarOp(BAM_CIGAR_OPS[min(op & 0xf,
+                                                             (uint32_t)8)],
+                                            op >> 4));
+  }
+
+  a.QueryBases.resize(seq_len);
+  for (size_t i = 0; i < seq_len; ++i) {
+    unsigned char c = (unsigned char)p[i/2];
+    a.QueryBases[i] = BAM_NUCS[(i & 1) ? (c & 0xf) : (c >> 4)];
+  }
+  p += (seq_len+1)/2;
+
+  a.Qualities.clear();
+  if (seq_len && (unsigned char)p[0] != 0xff) {
+    a.Qualities.resize(seq_len);
+    for (size_t i = 0; i < seq_len; ++i) {
+      a.Qualities[i] = (char)(p[i] + 33);
+    }
+  }
+  p += seq_len;
+
+  a.TagData.assign(p, end);
+  a.AlignedBases.clear();
+  return true;
+}
 
 /**
  * A helper functon that calculates the length of the reference spanned by the
  * read and populates the indel vectors (for SAM input).
  * @param cigar_str a pointer to the char array containing the cigar string.
- * @param inserts an empty Indel vector into which to add inserts.
- * @param deletes an empty Indel vector into which to add deletions.
+ * @param cigar_len the length of the cigar string.
+ * @param inserts an empty IndelVector into which to add inserts.
+ * @param deletes an empty IndelVector into which to add deletions.
  */
-size_t cigar_length(const char* cigar_str, vector<Indel>& inserts,
-                    vector<Indel>& deletes) {
+size_t cigar_length(const char* cigar_str, size_t cigar_len,
+                    IndelVector& inserts, IndelVector& deletes) {
   inserts.clear();
   deletes.clear();
   const char* p_cig = cigar_str;
+  const char* end = cigar_str + cigar_len;
   size_t i = 0; // read index
   size_t j = 0; // genomic index
-  while (*p_cig) {
+  while (p_cig < end) {
     char* t;
     size_t op_len = (size_t)strtol(p_cig, &t, 10);
     char op_char = toupper(*t);
@@ -61,11 +156,11 @@ size_t cigar_length(const char* cigar_str, vector<Indel>& inserts,
  * A helper functon that calculates the length of the reference spanned by the
  * read and populates the indel vectors (for BAM input).
  * @param cigar_vec a vector containing the split cigar string.
- * @param inserts an empty Indel vector into which to add inserts.
- * @param deletes an empty Indel vector into which to add deletions.
+ * @param inserts an empty IndelVector into which to add inserts.
+ * @param deletes an empty IndelVector into which to add deletions.
  */
 size_t cigar_length(vector<BamTools::CigarOp>& cigar_vec,
-                    vector<Indel>& inserts, vector<Indel>& deletes) {
+                    IndelVector& inserts, IndelVector& deletes) {
   inserts.clear();
   deletes.clear();
   size_t i = 0; // read index
@@ -93,8 +188,9 @@ size_t cigar_length(vector<BamTools::CigarOp>& cigar_vec,
   return j;
 }
 
-MapParser::MapParser(Library* lib, bool write_active)
-    : _lib(lib), _write_active(write_active) {
+MapParser::MapParser(Library* lib, bool write_active, size_t num_threads)
+    : _lib(lib), _write_active(write_active),
+      _cache_file_name(lib->cache_file_name) {
 
   string in_file = lib->in_file_name;
   string out_file = lib->out_file_name;
@@ -109,7 +205,7 @@ MapParser::MapParser(Library* lib, bool write_active)
     BamTools::BamReader* reader = new BamTools::BamReader();
     if (reader->Open(in_file)) {
       logger.info("Parsing BAM header...");
-      _parser.reset(new BAMParser(reader));
+      _parser.reset(new BAMParser(reader, in_file, num_threads));
       if (out_file.size()) {
         out_file += ".bam";
         BamTools::BamWriter* writer = new BamTools::BamWriter();
@@ -125,11 +221,17 @@ MapParser::MapParser(Library* lib, bool write_active)
     } else {
       delete reader;
       logger.info("Input is not in BAM format. Trying SAM...");
-      ifstream* ifs = new ifstream(in_file.c_str());
-      if (!ifs->is_open()) {
-        logger.severe("Unable to open input SAM file '%s'.", in_file.c_str());
+      MappedFile* map = new MappedFile();
+      if (map->open(in_file)) {
+        _parser.reset(new SAMParser(map, num_threads));
+      } else {
+        delete map;
+        ifstream* ifs = new ifstream(in_file.c_str());
+        if (!ifs->is_open()) {
+          logger.severe("Unable to open input SAM file '%s'.", in_file.c_str());
+        }
+        _parser.reset(new SAMParser(ifs));
       }
-      _parser.reset(new SAMParser(ifs));
       is_sam = true;
     }
   }
@@ -144,27 +246,94 @@ MapParser::MapParser(Library* lib, bool write_active)
     bool sample = out_file.substr(out_file.length()-8,4) == "samp";
     _writer.reset(new SAMWriter(ofs, sample));
   }
+
+  this->write_active(write_active);
+
+  if (_cache_file_name.size()) {
+    _cache_writer.reset(new FragCacheWriter(_cache_file_name));
+  }
+}
+
+MapParser::~MapParser() {
+  if (_cache_file_name.size()) {
+    _cache_writer.reset();
+    _cache_parser.reset();
+    remove(_cache_file_name.c_str());
+  }
+}
+
+void MapParser::reset_reader() {
+  if (_cache_parser) {
+    _cache_parser->reset();
+  }
+  // The input is only rewound if the next round reads from it rather than
+  // replaying the cached fragments.
+  if (_cache_parser && !(_writer && _write_active)) {
+    _parser->stop();
+  } else {
+    _parser->reset();
+  }
+}
+
+void MapParser::write_active(bool b) {
+  _write_active = b;
+  _parser->keep_raw(_writer && _write_active);
+}
+
+Parser::Parser() : _read_buff(NULL), _keep_raw(true) {}
+
+Parser::~Parser() {}
+
+void Parser::stop() {
+  if (_pool) {
+    _pool->rewind();
+  }
+}
+
+bool Parser::next_pooled_fragment(Fragment& nf, ParseThreadSafety& pts) {
+  if (!_read_buff && !_pool->next(_read_buff, NULL)) {
+    logger.severe("Input alignment file contains no valid alignments.");
+  }
+  nf.add_map_end(_read_buff);
+
+  while (_pool->next(_read_buff, &pts)) {
+    if (!nf.add_map_end(_read_buff)) {
+      return true;
+    }
+  }
+
+  _read_buff = NULL;
+  return false;
 }
 
 void MapParser::threaded_parse(ParseThreadSafety* thread_safety_p,
                                size_t stop_at,
                                size_t num_neighbors) {
   ParseThreadSafety& pts = *thread_safety_p;
+  FragBatchWriter<SPSCBatchQueue> proc_in(pts.proc_in, frag_batch_size);
+  FragBatchReader<MPMCBatchQueue> proc_out(pts.proc_out);
   bool fragments_remain = true;
   size_t n = 0;
   size_t still_out = 0;
 
+  // Replay the cached fragments if available, unless the raw alignments are
+  // needed for output.
+  Parser* parser = _parser.get();
+  if (_cache_parser && !(_writer && _write_active)) {
+    parser = _cache_parser.get();
+  }
+
   TargetTable& targ_table = *(_lib->targ_table);
 
   while (!stop_at || n < stop_at) {
     Fragment* frag = NULL;
     while (fragments_remain) {
-      frag = new Fragment(_lib);
-      fragments_remain = _parser->next_fragment(*frag, pts);
+      frag = frag_pool.new_frag(_lib);
+      fragments_remain = parser->next_fragment(*frag, pts);
       if (frag->num_hits()) {
         break;
       }
-      delete frag;
+      frag_pool.release(frag);
       frag = NULL;
     }
     for (size_t i = 0; frag && i < frag->hits().size(); ++i) {
@@ -209,47 +378,79 @@ void MapParser::threaded_parse(ParseThreadSafety* thread_safety_p,
     }
 
     // Write out processed fragments
-    boost::scoped_ptr<Fragment> done_frag(pts.proc_out.pop(false));
+    Fragment* done_frag = proc_out.pop(false);
     while (done_frag) {
       if (_writer && _write_active) {
         _writer->write_fragment(*done_frag);
       }
+      frag_pool.release(done_frag);
       still_out--;
-      done_frag.reset(pts.proc_out.pop(false));
+      done_frag = proc_out.pop(false);
+    }
+
+    // Write out invalid alignments so the queue does not fill
+    ReadHit* invalid = pts.proc_invalid.pop(false);
+    while (invalid) {
+      if (_writer && _write_active) {
+        _writer->write_alignment(*invalid);
+      }
+      frag_pool.release(invalid);
+      invalid = pts.proc_invalid.pop(false);
     }
 
     if (!frag) {
       break;
     }
 
-    pts.proc_in.push(frag);
+    if (_cache_writer) {
+      _cache_writer->write_fragment(*frag);
+    }
+    proc_in.push(frag);
     n++;
     still_out++;
   }
 
+  proc_in.flush();
   pts.proc_in.push(NULL);
 
+  if (_cache_writer) {
+    _cache_writer.reset();
+    _cache_parser.reset(new FragCacheParser(_cache_file_name));
+  }
+
   while (still_out) {
-    boost::scoped_ptr<Fragment> done_frag(pts.proc_out.pop(true));
+    Fragment* done_frag = proc_out.pop(true);
     if (_writer && _write_active) {
       _writer->write_fragment(*done_frag);
     }
+    frag_pool.release(done_frag);
     still_out--;
   }
 
   // write out invalid alignments
-  boost::scoped_ptr<ReadHit> invalid(pts.proc_invalid.pop(false));
+  ReadHit* invalid = pts.proc_invalid.pop(false);
   while (invalid) {
     if (_writer && _write_active) {
       _writer->write_alignment(*invalid);
     }
-    invalid.reset(pts.proc_invalid.pop(false));
+    frag_pool.release(invalid);
+    invalid = pts.proc_invalid.pop(false);
   }
 }
 
-BAMParser::BAMParser(BamTools::BamReader* reader) : _reader(reader) {
+BAMParser::BAMParser(BamTools::BamReader* reader, const string& file_name,
+                     size_t num_threads)
+    : _reader(reader) {
   BamTools::BamAlignment a;
 
+  // The threads are split between inflating and parsing, which each need at
+  // least one.
+  if (num_threads >= 2) {
+    _bgzf.reset(new BGZFReader(file_name, num_threads / 2));
+    skip_header();
+    _pool.reset(new ParsePool(this, num_threads - num_threads / 2));
+  }
+
   size_t index = 0;
   foreach(const BamTools::RefData& ref, _reader->GetReferenceData()) {
     if (_targ_index.count(ref.RefName)) {
@@ -260,40 +461,49 @@ BAMParser::BAMParser(BamTools::BamReader* reader) : _reader(reader) {
     _targ_lengths[ref.RefName] = ref.RefLength;
   }
 
-  // Get first valid ReadHit
-  _read_buff = new ReadHit();
+  // Get first valid ReadHit, unless it will be loaded from the pool
+  if (_pool) {
+    return;
+  }
+  _read_buff = frag_pool.new_read();
   do {
-    if (!_reader->GetNextAlignment(a)) {
+    if (!next_alignment(a)) {
       logger.severe("Input BAM file contains no valid alignments.");
     }
-  } while(!map_end_from_alignment(a));
+  } while(!map_end_from_alignment(a, *_read_buff));
 }
 
 bool BAMParser::next_fragment(Fragment& nf, ParseThreadSafety& pts) {
+  if (_pool) {
+    return next_pooled_fragment(nf, pts);
+  }
+
   nf.add_map_end(_read_buff);
 
   BamTools::BamAlignment a;
-  _read_buff = new ReadHit();
+  _read_buff = frag_pool.new_read();
 
   while(true) {
-    if (!_reader->GetNextAlignment(a)) {
+    if (!next_alignment(a)) {
       // no more alignments
       return false;
-    } else if (!map_end_from_alignment(a)) {
-      // mapping is not valid
-      ReadHit r;
-      r.bam = a;
-      pts.proc_invalid.push(&r);
+    } else if (!map_end_from_alignment(a, *_read_buff)) {
+      // mapping is not valid, just write out the alignment
+      if (_keep_raw) {
+        ReadHit* r = frag_pool.new_read();
+        r->make_raw().bam = a;
+        pts.proc_invalid.push(r);
+      }
       continue;
     } else if (!nf.add_map_end(_read_buff)) {
       return true;
     }
-    _read_buff = new ReadHit();
+    _read_buff = frag_pool.new_read();
   }
 }
 
-bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
-  ReadHit& r = *_read_buff;
+bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a,
+                                       ReadHit& r) const {
 
   if (!a.IsMapped()) {
     return false;
@@ -339,7 +549,9 @@ bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
   r.left = a.Position;
   r.mate_l = a.MatePosition;
   r.seq.set(a.QueryBases, is_reversed);
-  r.bam = a;
+  if (_keep_raw) {
+    r.make_raw().bam = a;
+  }
   r.right = r.left + cigar_length(a.CigarData, r.inserts, r.deletes);
 
   foreach (Indel& indel, r.inserts) {
@@ -356,36 +568,224 @@ bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
   return true;
 }
 
+BAMParser::~BAMParser() {
+  _pool.reset();
+}
+
+bool BAMParser::next_alignment(BamTools::BamAlignment& a) {
+  if (!_bgzf) {
+    return _reader->GetNextAlignment(a);
+  }
+
+  char size_buff[4];
+  size_t n = _bgzf->read(size_buff, 4);
+  if (n == 0) {
+    return false;
+  }
+  size_t len = (n == 4) ? bam_uint32(size_buff) : 0;
+  _record_buff.resize(max(len, (size_t)1));
+  if (n != 4 || _bgzf->read(&_record_buff[0], len) != len ||
+      !decode_bam_record(&_record_buff[0], len, a)) {
+    logger.severe("Input BAM file contains a malformed alignment record.");
+  }
+  return true;
+}
+
+void BAMParser::skip_header() {
+  char buff[4];
+  if (_bgzf->read(buff, 4) != 4 || strncmp(buff, "BAM\1", 4)) {
+    logger.severe("Input BAM file has an invalid header.");
+  }
+  // Skip the header text.
+  _bgzf->read(buff, 4);
+  _record_buff.resize(bam_uint32(buff) + 1);
+  _bgzf->read(&_record_buff[0], _record_buff.size() - 1);
+  // Skip the reference sequence dictionary.
+  _bgzf->read(buff, 4);
+  size_t num_refs = bam_uint32(buff);
+  for (size_t i = 0; i < num_refs; ++i) {
+    _bgzf->read(buff, 4);
+    _record_buff.resize(bam_uint32(buff) + 4);
+    if (_bgzf->read(&_record_buff[0], _record_buff.size()) !=
+        _record_buff.size()) {
+      logger.severe("Input BAM file has an invalid header.");
+    }
+  }
+}
+
+bool BAMParser::read_chunk(ParseChunk& chunk) {
+  char size_buff[4];
+  while (chunk.data.size() < CHUNK_SIZE) {
+    size_t n = _bgzf->read(size_buff, 4);
+    if (n == 0) {
+      break;
+    }
+    size_t len = (n == 4) ? bam_uint32(size_buff) : 0;
+    size_t offset = chunk.data.size();
+    chunk.data.resize(offset + 4 + len);
+    memcpy(&chunk.data[offset], size_buff, 4);
+    if (n != 4 || _bgzf->read(&chunk.data[offset + 4], len) != len) {
+      logger.severe("Input BAM file contains a malformed alignment record.");
+    }
+  }
+  if (chunk.data.empty()) {
+    return false;
+  }
+  chunk.begin = &chunk.data[0];
+  chunk.end = chunk.begin + chunk.data.size();
+  return true;
+}
+
+void BAMParser::parse_chunk(ParseChunk& chunk) {
+  BamTools::BamAlignment a;
+  ReadHit* r = NULL;
+  const char* p = chunk.begin;
+  while (p < chunk.end) {
+    size_t len = bam_uint32(p);
+    p += 4;
+    if (!decode_bam_record(p, len, a)) {
+      logger.severe("Input BAM file contains a malformed alignment record.");
+    }
+    p += len;
+
+    if (!r) {
+      r = frag_pool.new_read();
+    }
+    if (map_end_from_alignment(a, *r)) {
+      chunk.hits.push_back(r);
+      chunk.valid.push_back(true);
+      r = NULL;
+    } else if (_keep_raw) {
+      // mapping is not valid, just write out the alignment
+      ReadHit* invalid = frag_pool.new_read();
+      invalid->make_raw().bam = a;
+      chunk.hits.push_back(invalid);
+      chunk.valid.push_back(false);
+    }
+  }
+  if (r) {
+    frag_pool.release(r);
+  }
+}
+
 void BAMParser::reset() {
-  _reader->Rewind();
+  if (_bgzf) {
+    if (_pool) {
+      _pool->rewind();
+    }
+    _bgzf->rewind();
+    skip_header();
+  } else {
+    _reader->Rewind();
+  }
+
+  delete _read_buff;
+  _read_buff = NULL;
+  if (_pool) {
+    return;
+  }
 
   // Get first valid FragHit
   BamTools::BamAlignment a;
-  delete _read_buff;
-  _read_buff = new ReadHit();
+  _read_buff = frag_pool.new_read();
   do {
-    _reader->GetNextAlignment(a);
-  } while(!map_end_from_alignment(a));
+    next_alignment(a);
+  } while(!map_end_from_alignment(a, *_read_buff));
+}
+
+void BAMParser::stop() {
+  Parser::stop();
+  if (_bgzf) {
+    _bgzf->stop();
+  }
 }
 
-SAMParser::SAMParser(istream* in) {
-  _in = in;
+SAMParser::SAMParser(istream* in)
+    : _in(in), _body(NULL), _pos(NULL), _buff(BUFF_SIZE), _buff_pos(0),
+      _buff_end(0) {
+  init();
+}
+
+SAMParser::SAMParser(MappedFile* map, size_t num_threads)
+    : _in(NULL), _map(map), _body(map->data()), _pos(map->data()),
+      _buff_pos(0), _buff_end(0) {
+  if (num_threads) {
+    _pool.reset(new ParsePool(this, num_threads));
+  }
+  init();
+}
+
+SAMParser::~SAMParser() {
+  _pool.reset();
+}
+
+bool SAMParser::next_line(const char*& line, size_t& len) {
+  if (_map) {
+    const char* end = _map->data() + _map->size();
+    if (_pos >= end) {
+      return false;
+    }
+    const char* nl = (const char*)memchr(_pos, '\n', end - _pos);
+    if (!nl) {
+      // Copy the unterminated last line so that parsing stays in bounds.
+      _last_line.assign(_pos, end);
+      _pos = end;
+      line = _last_line.c_str();
+      len = _last_line.size();
+      return true;
+    }
+    line = _pos;
+    len = nl - _pos;
+    _pos = nl + 1;
+    return true;
+  }
+
+  while (true) {
+    char* start = &_buff[_buff_pos];
+    char* nl = (char*)memchr(start, '\n', _buff_end - _buff_pos);
+    if (nl) {
+      line = start;
+      len = nl - start;
+      _buff_pos += len + 1;
+      return true;
+    }
+    if (!_in->good()) {
+      if (_buff_pos == _buff_end) {
+        return false;
+      }
+      // Terminate the last line, for which there is always room in _buff.
+      _buff[_buff_end] = '\n';
+      line = start;
+      len = _buff_end - _buff_pos;
+      _buff_pos = _buff_end;
+      return true;
+    }
+    // Move the partial line to the front and fill the rest of the buffer,
+    // leaving room for a terminator.
+    _buff_end -= _buff_pos;
+    memmove(&_buff[0], start, _buff_end);
+    _buff_pos = 0;
+    if (_buff_end + 1 >= _buff.size()) {
+      _buff.resize(2 * _buff.size());
+    }
+    _in->read(&_buff[_buff_end], _buff.size() - _buff_end - 1);
+    _buff_end += _in->gcount();
+  }
+}
 
-  char line_buff[BUFF_SIZE];
-  _read_buff = new ReadHit();
+void SAMParser::init() {
   _header = "";
 
   // Parse header
+  const char* line = NULL;
+  size_t len = 0;
   size_t index = 0;
-  while(_in->good()) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
-    if (line_buff[0] != '@') {
-      break;
-    }
-    _header += line_buff;
+  bool has_line = next_line(line, len);
+  while (has_line && len && line[0] == '@') {
+    string str(line, len);
+    _header += str;
     _header += "\n";
 
-    string str(line_buff);
     size_t idx = str.find("SN:");
     if (idx!=string::npos) {
       string name = str.substr(idx+3);
@@ -402,56 +802,76 @@ SAMParser::SAMParser(istream* in) {
         _targ_lengths[name] = atoi(len.c_str());
       }
     }
+    if (_map) {
+      _body = _pos;
+    }
+    has_line = next_line(line, len);
   }
+  _name_index.build(_targ_index);
 
-  // Load first aligned read
-  while(!map_end_from_line(line_buff)) {
-    if (!_in->good()) {
+  // Load first aligned read, unless it will be loaded from the pool
+  if (_pool) {
+    _pos = _body;
+    return;
+  }
+  _read_buff = frag_pool.new_read();
+  while(!has_line || !map_end_from_line(line, len, *_read_buff)) {
+    if (!has_line) {
       logger.severe("Input SAM file contains no valid alignments.");
     }
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
+    has_line = next_line(line, len);
   }
 }
 
 bool SAMParser::next_fragment(Fragment& nf, ParseThreadSafety& pts) {
+  if (_pool) {
+    return next_pooled_fragment(nf, pts);
+  }
+
   nf.add_map_end(_read_buff);
 
-  _read_buff = new ReadHit();
-  char line_buff[BUFF_SIZE];
+  _read_buff = frag_pool.new_read();
+  const char* line;
+  size_t len;
 
-  while(_in->good()) {
-    _in->getline (line_buff, BUFF_SIZE-1, '\n');
-    if (!map_end_from_line(line_buff)) {
+  while(next_line(line, len)) {
+    if (!map_end_from_line(line, len, *_read_buff)) {
       // mapping is not valid, just write out the alignment
-      string sam_line(line_buff);
-      ReadHit r;
-      r.sam = sam_line;
-      pts.proc_invalid.push(&r);
+      if (_keep_raw) {
+        ReadHit* r = frag_pool.new_read();
+        r->make_raw().sam.assign(line, len);
+        pts.proc_invalid.push(r);
+      }
       continue;
     }
     if (!nf.add_map_end(_read_buff)) {
-      break;
+      return true;
     }
-    _read_buff = new ReadHit();
+    _read_buff = frag_pool.new_read();
   }
 
-  return _in->good();
+  return false;
 }
 
-bool SAMParser::map_end_from_line(char* line) {
-  ReadHit& r = *_read_buff;
-  string sam_line(line);
-  char *p = strtok(line, "\t");
+bool SAMParser::map_end_from_line(const char* line, size_t len,
+                                  ReadHit& r) const {
+  const char* end = line + len;
+  const char* p = line;
   int sam_flag = 0;
   bool paired = 0;
   bool left_first = 0;
   bool other_reversed = 0;
 
   int i = 0;
-  while (p && i <= 9) {
+  while (p < end && i <= 9) {
+    const char* field_end = (const char*)memchr(p, '\t', end - p);
+    if (!field_end) {
+      field_end = end;
+    }
+    size_t field_len = field_end - p;
     switch(i++) {
       case 0: {
-        r.name = p;
+        r.name.assign(p, field_len);
         if (boost::algorithm::ends_with(r.name, "\1") ||
             boost::algorithm::ends_with(r.name, "\2")) {
           r.name = r.name.substr(r.name.size()-2);
@@ -488,11 +908,13 @@ bool SAMParser::map_end_from_line(char* line) {
         if(p[0] == '*') {
           goto stop;
         }
-        if (!_targ_index.count(p)) {
+        size_t targ_id = _name_index.find(p, field_len);
+        if (targ_id == NameIndex::NOT_FOUND) {
           logger.severe("Target sequence '%s' not found. Verify that it is in "
-                        "the SAM/BAM header and FASTA file.", p);
+                        "the SAM/BAM header and FASTA file.",
+                        string(p, field_len).c_str());
         }
-        r.targ_id = _targ_index[p];
+        r.targ_id = targ_id;
         break;
       }
       case 3: {
@@ -503,7 +925,7 @@ bool SAMParser::map_end_from_line(char* line) {
         break;
       }
       case 5: {
-        r.right = r.left + cigar_length(p, r.inserts, r.deletes);
+        r.right = r.left + cigar_length(p, field_len, r.inserts, r.deletes);
         foreach (Indel& indel, r.inserts) {
           if (indel.len > max_indel_size) {
             goto stop;
@@ -535,36 +957,106 @@ bool SAMParser::map_end_from_line(char* line) {
         break;
       }
       case 9: {
-        r.seq.set(p, r.reversed);
-        r.sam = sam_line;
+        r.seq.set(p, field_len, r.reversed);
+        if (_keep_raw) {
+          r.make_raw().sam.assign(line, len);
+        }
         goto stop;
       }
     }
-    p = strtok(NULL, "\t");
+    p = field_end + 1;
   }
  stop:
   return i == 10;
 }
 
+bool SAMParser::read_chunk(ParseChunk& chunk) {
+  const char* end = _map->data() + _map->size();
+  if (_pos >= end) {
+    return false;
+  }
+  chunk.begin = _pos;
+  chunk.end = _pos + min(CHUNK_SIZE, (size_t)(end - _pos));
+  if (chunk.end < end) {
+    const char* nl = (const char*)memchr(chunk.end, '\n', end - chunk.end);
+    chunk.end = (nl) ? nl + 1 : end;
+  }
+  _pos = chunk.end;
+  return true;
+}
+
+void SAMParser::parse_chunk(ParseChunk& chunk) {
+  string last_line;
+  ReadHit* r = NULL;
+  const char* line = chunk.begin;
+  while (line < chunk.end) {
+    const char* nl = (const char*)memchr(line, '\n', chunk.end - line);
+    size_t len;
+    const char* next;
+    if (nl) {
+      len = nl - line;
+      next = nl + 1;
+    } else {
+      // Copy the unterminated last line so that parsing stays in bounds.
+      last_line.assign(line, chunk.end);
+      len = last_line.size();
+      line = last_line.c_str();
+      next = chunk.end;
+    }
+
+    if (!r) {
+      r = frag_pool.new_read();
+    }
+    if (map_end_from_line(line, len, *r)) {
+      chunk.hits.push_back(r);
+      chunk.valid.push_back(true);
+      r = NULL;
+    } else if (_keep_raw) {
+      // mapping is not valid, just write out the alignment
+      ReadHit* invalid = frag_pool.new_read();
+      invalid->make_raw().sam.assign(line, len);
+      chunk.hits.push_back(invalid);
+      chunk.valid.push_back(false);
+    }
+    line = next;
+  }
+  if (r) {
+    frag_pool.release(r);
+  }
+}
+
 void SAMParser::reset() {
-  // Rewind input file
-  _in->clear();
-  _in->seekg(0, ios::beg);
+  // Rewind input
+  if (_pool) {
+    _pool->rewind();
+  }
+  if (_map) {
+    _pos = _body;
+  } else {
+    _in->clear();
+    _in->seekg(0, ios::beg);
+    _buff_pos = 0;
+    _buff_end = 0;
+  }
 
-  // Load first alignment
-  char line_buff[BUFF_SIZE];
   delete _read_buff;
-  _read_buff = new ReadHit();
+  _read_buff = NULL;
+  if (_pool) {
+    return;
+  }
 
-  while(_in->good()) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
-    if (line_buff[0] != '@') {
-      break;
-    }
+  // Load first alignment
+  _read_buff = frag_pool.new_read();
+
+  const char* line = NULL;
+  size_t len = 0;
+  bool has_line = next_line(line, len);
+  while (has_line && len && line[0] == '@') {
+    has_line = next_line(line, len);
   }
 
-  while(!map_end_from_line(line_buff)) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
+  while(has_line && !map_end_from_line(line, len, *_read_buff)) {
+    has_line = next_line(line, len);
   }
 }
 
@@ -582,10 +1074,10 @@ void BAMWriter::write_fragment(Fragment& f) {
     const FragHit* hit = f.sample_hit();
     PairStatus ps = hit->pair_status();
     if (ps != RIGHT_ONLY) {
-      _writer->SaveAlignment(hit->left_read()->bam);
+      _writer->SaveAlignment(hit->left_read()->raw->bam);
     }
     if (ps != LEFT_ONLY) {
-      _writer->SaveAlignment(hit->right_read()->bam);
+      _writer->SaveAlignment(hit->right_read()->raw->bam);
     }
   } else {
     double total = 0;
@@ -593,12 +1085,12 @@ void BAMWriter::write_fragment(Fragment& f) {
       total += sexp(hit->params()->posterior);
       PairStatus ps = hit->pair_status();
       if (ps != RIGHT_ONLY) {
-        hit->left_read()->bam.AddTag("XP","f",(float)sexp(hit->params()->posterior));
-        _writer->SaveAlignment(hit->left_read()->bam);
+        hit->left_read()->raw->bam.AddTag("XP","f",(float)sexp(hit->params()->posterior));
+        _writer->SaveAlignment(hit->left_read()->raw->bam);
       }
       if (ps != LEFT_ONLY) {
-        hit->right_read()->bam.AddTag("XP","f",(float)sexp(hit->params()->posterior));
-        _writer->SaveAlignment(hit->right_read()->bam);
+        hit->right_read()->raw->bam.AddTag("XP","f",(float)sexp(hit->params()->posterior));
+        _writer->SaveAlignment(hit->right_read()->raw->bam);
       }
     }
     assert(approx_eq(total, 1.0));
@@ -607,9 +1099,9 @@ void BAMWriter::write_fragment(Fragment& f) {
 
 void BAMWriter::write_alignment(ReadHit& a) {
   if (!_sample) {
-    a.bam.AddTag("XP","f",0.0);
+    a.raw->bam.AddTag("XP","f",0.0);
   }
-  _writer->SaveAlignment(a.bam);
+  _writer->SaveAlignment(a.raw->bam);
 }
 
 
@@ -627,10 +1119,10 @@ void SAMWriter::write_fragment(Fragment& f) {
     PairStatus ps = hit->pair_status();
 
     if (ps != RIGHT_ONLY) {
-      *_out << hit->left_read()->sam << endl;
+      *_out << hit->left_read()->raw->sam << endl;
     }
     if (ps != LEFT_ONLY) {
-      *_out << hit->right_read()->sam << endl;
+      *_out << hit->right_read()->raw->sam << endl;
     }
   } else {
     double total = 0;
@@ -638,11 +1130,11 @@ void SAMWriter::write_fragment(Fragment& f) {
       total += sexp(hit->params()->posterior);
       PairStatus ps = hit->pair_status();
       if (ps != RIGHT_ONLY) {
-        *_out << hit->left_read()->sam << " XP:f:"
+        *_out << hit->left_read()->raw->sam << " XP:f:"
               << (float)sexp(hit->params()->posterior) << endl;
       }
       if (ps != LEFT_ONLY) {
-        *_out << hit->right_read()->sam << " XP:f:"
+        *_out << hit->right_read()->raw->sam << " XP:f:"
               << (float)sexp(hit->params()->posterior) << endl;
       }
     }
@@ -652,8 +1144,8 @@ void SAMWriter::write_fragment(Fragment& f) {
 
 void SAMWriter::write_alignment(ReadHit& a) {
   if (_sample) {
-    *_out << a.sam << endl;
+    *_out << a.raw->sam << endl;
   } else {
-    *_out << a.sam << " XP:f:" << 0.0 << endl;
+    *_out << a.raw->sam << " XP:f:" << 0.0 << endl;
   }
 }
@@ -19,15 +19,21 @@
 
 #include <iostream>
 
+#include "nameindex.h"
+
+class BGZFReader;
+class FragCacheParser;
+class FragCacheWriter;
 class Fragment;
+class MappedFile;
+class ParsePool;
 class TargetTable;
 class FragHit;
+struct ParseChunk;
 struct ParseThreadSafety;
 struct ReadHit;
 struct Library;
 
-typedef boost::unordered_map<std::string, size_t> TransIndex;
-
 /**
  * The Writer class is an abstract class for implementing a SAMWriter or
  * BAMWriter. It writes Fragment objects back to file (in SAM/BAM format) with
@@ -69,6 +75,7 @@ class Writer {
  *  @copyright Artistic License 2.0
  **/
 class Parser {
+  friend class ParsePool;
  protected:
   /**
    * The private target-to-index map.
@@ -82,12 +89,59 @@ class Parser {
    * A private pointer to the current/last read mapping being parsed.
    */
   ReadHit* _read_buff;
+  /**
+   * A private bool specifying whether the raw alignment (SAM line or
+   * BamAlignment) should be stored with each ReadHit and invalid alignments
+   * passed on for output.
+   */
+  bool _keep_raw;
+  /**
+   * A private pointer to the ParsePool used to parse the input on multiple
+   * threads, or NULL if the input is parsed serially. Must be reset by the
+   * destructor of the derived class so that the workers are stopped before its
+   * input is closed.
+   */
+  boost::scoped_ptr<ParsePool> _pool;
+  /**
+   * A private member function called by a ParsePool worker (while holding the
+   * pool lock) to read the next range of whole records from the input. Parsers
+   * that do not use a ParsePool need not override it.
+   * @param chunk the empty ParseChunk to set the range of.
+   * @return True iff any records were read. False at the end of the input.
+   */
+  virtual bool read_chunk(ParseChunk& chunk) { return false; }
+  /**
+   * A private member function called concurrently by ParsePool workers to
+   * parse the records of a chunk into ReadHits. Invalid alignments are only
+   * added to the chunk if the raw alignments are being kept. Parsers that do
+   * not use a ParsePool need not override it.
+   * @param chunk the ParseChunk to parse.
+   */
+  virtual void parse_chunk(ParseChunk& chunk) {}
+  /**
+   * A private member function that loads all mappings of the next fragment
+   * into the given Fragment object from _pool. _read_buff is NULL following
+   * construction or reset, in which case the first valid mapping is loaded.
+   * @param nf the empty Fragment to add mappings to.
+   * @param pts the struct containing the queue for invalid alignments.
+   * @return True iff more reads remain in the input.
+   */
+  bool next_pooled_fragment(Fragment& nf, ParseThreadSafety& pts);
 
  public:
   /**
-   * Dummy destructor.
+   * Parser constructor.
+   */
+  Parser();
+  /**
+   * Parser destructor.
    */
-  virtual ~Parser(){};
+  virtual ~Parser();
+  /**
+   * A mutator for whether the raw alignments should be kept for output.
+   * @param b true iff the raw alignments should be kept.
+   */
+  void keep_raw(bool b) { _keep_raw = b; }
   /**
    * An accessor for the SAM header string.
    * @return The SAM header string.
@@ -117,6 +171,11 @@ class Parser {
    * the input.
    */
   virtual void reset() = 0;
+  /**
+   * A member function that stops any threads reading ahead in the input until
+   * the next reset.
+   */
+  virtual void stop();
 };
 
 
@@ -133,21 +192,68 @@ class BAMParser : public Parser {
    * file. Automatically deleted with BAMParser object.
    */
   boost::scoped_ptr<BamTools::BamReader> _reader;
+  /**
+   * A private pointer to the BGZFReader that inflates the BAM file on a pool of
+   * threads ahead of the parser. NULL if alignments are read through _reader.
+   * Automatically deleted with BAMParser object.
+   */
+  boost::scoped_ptr<BGZFReader> _bgzf;
+  /**
+   * A private buffer holding the raw bytes of the last alignment record read
+   * from _bgzf.
+   */
+  std::vector<char> _record_buff;
   /**
    * A private member function to parse a single read alignment and store the
-   * data in _read_buff.
+   * data in the given ReadHit.
    * @param alignment a BamAlignment containing the data parsed by BamTools.
+   * @param r the ReadHit to fill.
    * @return True if the mapping is valid and false otherwise
    */
-  bool map_end_from_alignment(BamTools::BamAlignment& alignment);
+  bool map_end_from_alignment(BamTools::BamAlignment& alignment,
+                              ReadHit& r) const;
+  /**
+   * A private member function that reads the next alignment in the BAM file,
+   * either from _bgzf or through BamTools.
+   * @param alignment the BamAlignment to fill.
+   * @return True iff an alignment was read. False at the end of the file.
+   */
+  bool next_alignment(BamTools::BamAlignment& alignment);
+  /**
+   * A private member function that reads past the BAM header in _bgzf so that
+   * it is positioned at the first alignment record.
+   */
+  void skip_header();
+  /**
+   * A private member function that copies the next records (including their
+   * block_size fields) from _bgzf into the chunk.
+   * @param chunk the empty ParseChunk to fill.
+   * @return True iff any records were read. False at the end of the file.
+   */
+  bool read_chunk(ParseChunk& chunk);
+  /**
+   * A private member function that decodes the records of a chunk into
+   * ReadHits.
+   * @param chunk the ParseChunk to parse.
+   */
+  void parse_chunk(ParseChunk& chunk);
 
  public:
   /**
    * BAMParser constructor sets the reader.
    * @param reader a pointer to the BamReader object that will directly parse
-   *        the BAM file.
+   *        the BAM header (and alignments, if num_threads is less than 2).
+   * @param file_name the path to the BAM file.
+   * @param num_threads the total number of threads to use for inflating and
+   *        for parsing the BAM file ahead of the consumer, split evenly between
+   *        the two. If less than 2, BamTools reads the alignments serially.
+   */
+  BAMParser(BamTools::BamReader* reader, const std::string& file_name,
+            size_t num_threads);
+  /**
+   * BAMParser destructor.
    */
-  BAMParser(BamTools::BamReader* reader);
+  ~BAMParser();
   /**
    * An accessor for the header string.
    * @return The header string.
@@ -165,6 +271,11 @@ class BAMParser : public Parser {
    * the BAM file.
    */
   void reset();
+  /**
+   * A member function that stops the parsing and inflater threads until the
+   * next reset.
+   */
+  void stop();
 };
 
 /**
@@ -178,19 +289,86 @@ class SAMParser : public Parser
 {
   /**
    * A private pointer to the input stream (either stdin or file) in SAM format.
+   * NULL if the input file is memory-mapped.
    */
   std::istream* _in;
+  /**
+   * A private pointer to the memory-mapped input file. NULL if reading from a
+   * stream. Automatically deleted with SAMParser.
+   */
+  boost::scoped_ptr<MappedFile> _map;
+  /**
+   * A private pointer to the start of the first line following the header in
+   * the memory-mapped file.
+   */
+  const char* _body;
+  /**
+   * A private pointer to the start of the next unread line in the
+   * memory-mapped file.
+   */
+  const char* _pos;
+  /**
+   * A private buffer of unread input when reading from a stream.
+   */
+  std::vector<char> _buff;
+  /**
+   * A private size_t for the position of the next unread byte in _buff.
+   */
+  size_t _buff_pos;
+  /**
+   * A private size_t for the position following the last valid byte in _buff.
+   */
+  size_t _buff_end;
+  /**
+   * A private string holding the last line of a memory-mapped file if it is
+   * not newline-terminated, so that its fields are safely terminated.
+   */
+  std::string _last_line;
   /**
    * A private string storing the SAM header.
    */
   std::string _header;
+  /**
+   * A private index of the target names in the header, used to look up the
+   * target of each alignment without constructing a string.
+   */
+  NameIndex _name_index;
+  /**
+   * A private member function that returns the next line of the input without
+   * copying it. The line is followed by at least one character that is not part
+   * of a SAM field, and remains valid until the next call.
+   * @param line a pointer set to the first character of the line.
+   * @param len a size_t set to the length of the line, excluding the newline.
+   * @return True iff a line was available. False at the end of the input.
+   */
+  bool next_line(const char*& line, size_t& len);
+  /**
+   * A private member function that parses the header and loads the first valid
+   * alignment into _read_buff.
+   */
+  void init();
   /**
    * A private member function to parse a single read alignment and store the
-   * data in _read_buff.
-   * @param alignment a BamAlignment containing the data parsed by BamTools.
+   * data in the given ReadHit. Fields are parsed in place and only those
+   * retained by the ReadHit are copied.
+   * @param line a pointer to the first character of the SAM line.
+   * @param len the length of the SAM line.
+   * @param r the ReadHit to fill.
    * @return True if the mapping is valid and false otherwise
    */
-  bool map_end_from_line(char* line);
+  bool map_end_from_line(const char* line, size_t len, ReadHit& r) const;
+  /**
+   * A private member function that sets the chunk to the next range of whole
+   * lines in the memory-mapped file.
+   * @param chunk the empty ParseChunk to set the range of.
+   * @return True iff any lines remain. False at the end of the file.
+   */
+  bool read_chunk(ParseChunk& chunk);
+  /**
+   * A private member function that parses the lines of a chunk into ReadHits.
+   * @param chunk the ParseChunk to parse.
+   */
+  void parse_chunk(ParseChunk& chunk);
 
 public:
   /**
@@ -199,6 +377,19 @@ public:
    * @param in the input stream in SAM format, which may be a file or stdin.
    */
   SAMParser(std::istream* in);
+  /**
+   * SAMParser constructor removes the header and parses the first line to
+   * start the first Fragment.
+   * @param map a pointer to the memory-mapped input file in SAM format. Deleted
+   *        with this.
+   * @param num_threads the number of threads to use for parsing the file ahead
+   *        of the consumer. If 0, the file is parsed serially.
+   */
+  SAMParser(MappedFile* map, size_t num_threads);
+  /**
+   * SAMParser destructor.
+   */
+  ~SAMParser();
   /**
    * An accessor for the header string.
    * @return The header string.
@@ -337,16 +528,39 @@ class MapParser
    * processing.
    */
   bool _write_active;
+  /**
+   * A private string storing the path to the fragment cache file, or empty if
+   * fragments are not cached.
+   */
+  std::string _cache_file_name;
+  /**
+   * A private pointer to the FragCacheWriter that caches the parsed Fragments
+   * during the first pass through the input. NULL once the pass is complete.
+   * Automatically deleted with MapParser.
+   */
+  boost::scoped_ptr<FragCacheWriter> _cache_writer;
+  /**
+   * A private pointer to the FragCacheParser used to replay the cached
+   * Fragments in later passes when alignments are not being output. NULL until
+   * the first pass is complete. Automatically deleted with MapParser.
+   */
+  boost::scoped_ptr<FragCacheParser> _cache_parser;
 
  public:
   /**
    * MapParser constructor determines what format the input is in and
    * initializes the correct parser and writer (if appropriate).
    * @param lib pointer to variables associated with the input, including file
-   *        path.
+   *        path and fragment cache path.
    * @param write_active bool to initialize _write_active.
+   * @param num_threads the number of additional threads available to the
+   *        parser for decompressing and parsing input files (default 0).
+   */
+  MapParser(Library* lib, bool write_active, size_t num_threads=0);
+  /**
+   * MapParser destructor removes the fragment cache file, if any.
    */
-  MapParser(Library* lib, bool write_active);
+  ~MapParser();
   /**
    * A member function that drives the parse thread. When all valid mappings of
    * a fragment have been parsed, its mapped targets are found and the
@@ -379,11 +593,11 @@ class MapParser
    * or not the alignments (sampled or with probs) should be ouptut.
    * @param b updated write-active status
    */
-  void write_active(bool b) { _write_active = b; }
+  void write_active(bool b);
   /**
    * A member function that resets the input parser.
    */
-  void reset_reader() { _parser->reset(); }
+  void reset_reader();
 };
 
 #endif
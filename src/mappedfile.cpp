@@ -0,0 +1,54 @@
+//
+//  mappedfile.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "mappedfile.h"
+#include "main.h"
+
+#ifndef WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+using namespace std;
+
+bool MappedFile::open(const string& file_name) {
+  close();
+#ifdef WIN32
+  return false;
+#else
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  _data = (const char*)data;
+  _size = (size_t)st.st_size;
+  return true;
+#endif
+}
+
+void MappedFile::close() {
+#ifndef WIN32
+  if (_data) {
+    munmap((void*)_data, _size);
+  }
+#endif
+  _data = NULL;
+  _size = 0;
+}
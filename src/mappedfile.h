@@ -0,0 +1,72 @@
+/**
+ *  mappedfile.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_mappedfile_h
+#define express_mappedfile_h
+
+#include <string>
+
+/**
+ * The MappedFile class provides read-only access to the contents of a regular
+ * file by mapping it into memory. Mapping fails (and the caller is expected to
+ * fall back to stream input) for pipes, special files, empty files, and on
+ * platforms without mmap.
+ *  @copyright Artistic License 2.0
+ **/
+class MappedFile {
+  /**
+   * A private pointer to the first byte of the mapped file, or NULL if no file
+   * is mapped.
+   */
+  const char* _data;
+  /**
+   * A private size_t for the size of the mapped file in bytes.
+   */
+  size_t _size;
+
+  // Mappings are not copyable.
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+ public:
+  /**
+   * MappedFile constructor.
+   */
+  MappedFile() : _data(NULL), _size(0) {}
+  /**
+   * MappedFile destructor unmaps the file.
+   */
+  ~MappedFile() { close(); }
+  /**
+   * A member function that maps the given file into memory.
+   * @param file_name the path to the file to map.
+   * @return True iff the file is a regular, non-empty file and was mapped.
+   */
+  bool open(const std::string& file_name);
+  /**
+   * A member function that unmaps the file, if one is mapped.
+   */
+  void close();
+  /**
+   * An accessor for whether a file is currently mapped.
+   * @return True iff a file is mapped.
+   */
+  bool is_open() const { return _data != NULL; }
+  /**
+   * An accessor for the mapped file contents. Returned pointer does not
+   * outlive this.
+   * @return A pointer to the first byte of the mapped file.
+   */
+  const char* data() const { return _data; }
+  /**
+   * An accessor for the size of the mapped file.
+   * @return The size of the mapped file in bytes.
+   */
+  size_t size() const { return _size; }
+};
+
+#endif
@@ -10,6 +10,7 @@
 #include "frequencymatrix.h"
 #include "sequence.h"
 #include "main.h"
+#include <cstring>
 
 using namespace std;
 
@@ -20,8 +21,29 @@ MarkovModel::MarkovModel(size_t order, size_t window_size,
       _num_pos((int)num_pos),
       _params(num_pos, FrequencyMatrix<double>((size_t)pow((double)NUM_NUCS,
                                                            (double)order),
-                                               NUM_NUCS, alpha)),
-      _bitclear((1<<(2*order))-1) {
+                                               NUM_NUCS, alpha, true,
+                                               scaled_aux_tables)),
+      _bitclear((1<<(2*order))-1),
+      _window_table_stale(true) {
+}
+
+MarkovModel::MarkovModel(const MarkovModel& other)
+    : _order(other._order),
+      _window_size(other._window_size),
+      _num_pos(other._num_pos),
+      _params(other._params),
+      _bitclear(other._bitclear),
+      _window_table_stale(true) {
+}
+
+MarkovModel& MarkovModel::operator=(const MarkovModel& other) {
+  _order = other._order;
+  _window_size = other._window_size;
+  _num_pos = other._num_pos;
+  _params = other._params;
+  _bitclear = other._bitclear;
+  _window_table_stale = true;
+  return *this;
 }
 
 size_t MarkovModel::get_indices(const Sequence& seq, int left, vector<char>& indices) {
@@ -55,6 +77,7 @@ size_t MarkovModel::get_indices(const Sequence& seq, int left, vector<char>& ind
 }
 
 void MarkovModel::update(const Sequence& seq, int left, double mass) {
+  _window_table_stale = true;
   int i = 0;
   int j = left;
   int seq_len = (int)seq.length();
@@ -86,9 +109,59 @@ void MarkovModel::update(const Sequence& seq, int left, double mass) {
 }
 
 void MarkovModel::update(size_t p, size_t i, size_t j, double mass) {
+  _window_table_stale = true;
   _params[p].increment(i, j, mass);
 }
 
+void MarkovModel::merge(const MarkovModel& other) {
+  assert(_params.size() == other._params.size());
+  _window_table_stale = true;
+  for (size_t p = 0; p < _params.size(); ++p) {
+    _params[p].merge(other._params[p]);
+  }
+}
+
+void MarkovModel::clear() {
+  _window_table_stale = true;
+  for (size_t p = 0; p < _params.size(); ++p) {
+    _params[p].clear();
+  }
+}
+
+string MarkovModel::serialize() const {
+  size_t num_conds = _bitclear + 1;
+  string out;
+  out.reserve(_params.size() * num_conds * NUM_NUCS * sizeof(double));
+  for (size_t p = 0; p < _params.size(); ++p) {
+    for (size_t i = 0; i < num_conds; ++i) {
+      for (size_t j = 0; j < NUM_NUCS; ++j) {
+        double val = _params[p](i, j, false);
+        out.append((const char*)&val, sizeof(double));
+      }
+    }
+  }
+  return out;
+}
+
+bool MarkovModel::deserialize(const char* data, size_t size) {
+  size_t num_conds = _bitclear + 1;
+  if (size != _params.size() * num_conds * NUM_NUCS * sizeof(double)) {
+    return false;
+  }
+  clear();
+  for (size_t p = 0; p < _params.size(); ++p) {
+    for (size_t i = 0; i < num_conds; ++i) {
+      for (size_t j = 0; j < NUM_NUCS; ++j) {
+        double val;
+        memcpy(&val, data, sizeof(double));
+        data += sizeof(double);
+        _params[p].increment(i, j, val);
+      }
+    }
+  }
+  return true;
+}
+
 vector<char> MarkovModel::get_indices(const Sequence& seq) {
   vector<char> indices(seq.length() - _order, -1);
   
@@ -113,6 +186,7 @@ vector<char> MarkovModel::get_indices(const Sequence& seq) {
 void MarkovModel::fast_learn(const Sequence& seq, double mass,
                              const vector<double>& fl_cmf) {
   assert(_num_pos==_order+1);
+  _window_table_stale = true;
   if (seq.length() < (size_t)_order) {
     return;
   }
@@ -144,6 +218,7 @@ void MarkovModel::fast_learn(const Sequence& seq, double mass,
 
 void MarkovModel::calc_marginals() {
   assert(_num_pos==_order+1);
+  _window_table_stale = true;
   for (int i = 0; i < _order; ++i) {
     for (size_t cond = 0; cond < pow((double)NUM_NUCS,
                                      (double)(_order)); cond++) {
@@ -201,6 +276,90 @@ double MarkovModel::seq_prob(const Sequence& seq, int left) const {
   return v;
 }
 
+void MarkovModel::update_window_table() const {
+  if (!_window_table_stale.load(boost::memory_order_acquire)) {
+    return;
+  }
+  boost::unique_lock<boost::mutex> lock(_window_table_mut);
+  if (!_window_table_stale.load(boost::memory_order_relaxed)) {
+    return;
+  }
+  size_t num_conds = (size_t)1 << (2*_order);
+  size_t row_size = num_conds * NUM_NUCS;
+  _window_table.resize(_num_pos * row_size);
+  for (int p = 0; p < _num_pos; ++p) {
+    for (size_t cond = 0; cond < num_conds; ++cond) {
+      for (size_t nuc = 0; nuc < NUM_NUCS; ++nuc) {
+        _window_table[p*row_size + (cond << 2) + nuc] = _params[p](cond, nuc);
+      }
+    }
+  }
+  _window_table_stale.store(false, boost::memory_order_release);
+}
+
+void MarkovModel::seq_probs(const Sequence& seq, int offset,
+                            vector<double>& probs) const {
+  int seq_len = (int)seq.length();
+  probs.resize(seq_len);
+
+  // Windows that start before _order (where seq_prob pads with uniform
+  // probabilities) or run off the end of the sequence, and all windows of
+  // probabilistic sequences, take the general path.
+  int first = max(_order - offset, 0);
+  int last = seq_len - _window_size - offset;
+  int tail_node = min(_num_pos, _window_size) - 1;
+  if (seq.prob() || tail_node < _order) {
+    first = seq_len;
+  }
+  for (int i = 0; i < min(first, seq_len); ++i) {
+    probs[i] = seq_prob(seq, i + offset);
+  }
+  for (int i = max(first, last + 1); i < seq_len; ++i) {
+    probs[i] = seq_prob(seq, i + offset);
+  }
+  if (first > last) {
+    return;
+  }
+
+  update_window_table();
+  const size_t row_size = (size_t)1 << (2*(_order+1));
+
+  // The index of each position's nucleotide given the _order preceding ones.
+  vector<size_t> kmers(seq_len);
+  size_t kmer = 0;
+  for (int j = 0; j < seq_len; ++j) {
+    kmer = ((kmer << 2) + seq[j]) & (row_size - 1);
+    kmers[j] = kmer;
+  }
+
+  // Nodes from tail_node on share a table and see the full preceding context,
+  // so their sum is updated as the window slides.
+  const double* tail_table = &_window_table[tail_node * row_size];
+  double tail_sum = 0;
+
+  for (int i = first; i <= last; ++i) {
+    int left = i + offset;
+    double added = tail_table[kmers[left + _window_size - 1]];
+    double removed = (i > first) ? tail_table[kmers[left + tail_node - 1]]
+                                 : LOG_0;
+    if (isfinite(tail_sum) && isfinite(added) && isfinite(removed)) {
+      tail_sum += added - removed;
+    } else {
+      tail_sum = 0;
+      for (int j = left + tail_node; j < left + _window_size; ++j) {
+        tail_sum += tail_table[kmers[j]];
+      }
+    }
+    double v = tail_sum;
+    for (int w = 0; w < tail_node; ++w) {
+      // Nodes before _order only condition on the nucleotides in the window.
+      size_t mask = (w < _order) ? ((size_t)1 << (2*(w+1))) - 1 : row_size - 1;
+      v += _window_table[w * row_size + (kmers[left + w] & mask)];
+    }
+    probs[i] = v;
+  }
+}
+
 double MarkovModel::marginal_prob(size_t w, size_t nuc) const {
   assert(w < _params.size());
   double marg = LOG_0;
@@ -9,6 +9,8 @@
 #ifndef express_markovmodel_h
 #define express_markovmodel_h
 
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
 #include <vector>
 #include <string>
 #include "frequencymatrix.h"
@@ -47,6 +49,26 @@ class MarkovModel {
    * probabilities indices.
    */
   size_t _bitclear;
+  /**
+   * A private vector that caches the (logged, normalized) transition
+   * probabilities of every node in a flat array, indexed by the node times
+   * 4^(_order+1) plus (cond << 2) + curr. Only valid if _window_table_stale is
+   * false.
+   */
+  mutable std::vector<double> _window_table;
+  /**
+   * A private atomic bool that is true iff _window_table must be rebuilt
+   * because the parameters have changed since it was last built.
+   */
+  mutable boost::atomic<bool> _window_table_stale;
+  /**
+   * A private mutex held while rebuilding _window_table.
+   */
+  mutable boost::mutex _window_table_mut;
+  /**
+   * A private member function that rebuilds _window_table if it is stale.
+   */
+  void update_window_table() const;
 
  public:
   /**
@@ -58,6 +80,17 @@ class MarkovModel {
    * @param alpha the initial pseudo-counts (non-logged).
    */
   MarkovModel(size_t order, size_t window_size, size_t num_pos, double alpha);
+  /**
+   * MarkovModel copy constructor.
+   * @param other the MarkovModel to copy.
+   */
+  MarkovModel(const MarkovModel& other);
+  /**
+   * MarkovModel assignment operator.
+   * @param other the MarkovModel to copy.
+   * @return A reference to this.
+   */
+  MarkovModel& operator=(const MarkovModel& other);
   /**
    * Accessor for the probability of transitioning from cond to curr at node
    * p.
@@ -75,6 +108,18 @@ class MarkovModel {
    * @return The probability of the sequence based on the model parameters.
    */
   double seq_prob(const Sequence& seq, int left) const;
+  /**
+   * Computes seq_prob(seq, i + offset) for every position i in the sequence.
+   * The k-mer indices of the sequence are computed once, and windows that lie
+   * within the sequence are evaluated by lookups into a flat table, with the
+   * nodes that share the highest-order table summed by a rolling update.
+   * @param seq the sequence to compute the window probabilities for.
+   * @param offset the offset of the leftmost point of each window from the
+   *        position it is computed for.
+   * @param probs a vector to fill with the window probabilities (logged).
+   */
+  void seq_probs(const Sequence& seq, int offset,
+                 std::vector<double>& probs) const;
   /**
    * Increments the parameters associated with the sequence beginning at left of
    * size _window_size by the (logged) mass.
@@ -91,6 +136,32 @@ class MarkovModel {
    * @param mass the amount to increment by (logged).
    */
   void update(size_t p, size_t i, size_t j, double mass);
+  /**
+   * A member function that adds the (logged) parameter counts of another
+   * MarkovModel with the same order and size to this one.
+   * @param other the MarkovModel whose counts to add.
+   */
+  void merge(const MarkovModel& other);
+  /**
+   * A member function that sets all parameter counts to 0.
+   */
+  void clear();
+  /**
+   * A member function that serializes the (logged, unnormalized) parameter
+   * counts into an array of bytes.
+   * @return A string containing the serialized parameter counts.
+   */
+  std::string serialize() const;
+  /**
+   * A member function that overwrites the parameter counts with those in an
+   * array of bytes produced by serialize on a MarkovModel with the same order
+   * and size.
+   * @param data a pointer to the serialized parameter counts.
+   * @param size the size of the serialized parameter counts in bytes.
+   * @return True iff the size matched that of this MarkovModel and the counts
+   *         were loaded.
+   */
+  bool deserialize(const char* data, size_t size);
   /**
    * A member function that computes and returns the parameter table indices
    * used to compute and update the likelihood for the given sequence at the
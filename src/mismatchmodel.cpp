@@ -13,14 +13,18 @@
 #include "sequence.h"
 #include <iostream>
 #include <fstream>
+#include <boost/functional/hash.hpp>
 
 using namespace std;
 
 MismatchTable::MismatchTable(double alpha)
-    : _first_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, alpha)),
-      _second_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, alpha)),
-      _insert_params(1, max_indel_size + 1, 0),
-      _delete_params(1, max_indel_size + 1, 0),
+    : _first_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, alpha, true,
+                                                           scaled_aux_tables)),
+      _second_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, alpha, true,
+                                                            scaled_aux_tables)),
+      _insert_params(1, max_indel_size + 1, 0, true, scaled_aux_tables),
+      _delete_params(1, max_indel_size + 1, 0, true, scaled_aux_tables),
+      _no_indel_ll(0),
       _max_len(0),
       _active(false){
   // Set indel priors
@@ -40,6 +44,7 @@ MismatchTable::MismatchTable(string param_file_name)
       _second_read_mm(max_read_len, FrequencyMatrix<double>(16, 4, 0)),
       _insert_params(1, max_indel_size + 1, 0),
       _delete_params(1, max_indel_size + 1, 0),
+      _no_indel_ll(0),
       _max_len(0),
       _active(true){
   ifstream infile (param_file_name.c_str());
@@ -177,8 +182,8 @@ void MismatchTable::get_indices(const FragHit& f,
     size_t i = 0;  // read index
     size_t j = read_l.left;  // genomic index
     
-    vector<Indel>::const_iterator ins = read_l.inserts.begin();
-    vector<Indel>::const_iterator del = read_l.deletes.begin();
+    IndelVector::const_iterator ins = read_l.inserts.begin();
+    IndelVector::const_iterator del = read_l.deletes.begin();
     
     if (read_l.inserts.size() || read_l.deletes.size()) {
       logger.severe("Indels are not currently supported for eXpress-D.");
@@ -223,8 +228,8 @@ void MismatchTable::get_indices(const FragHit& f,
     size_t i = 0;
     size_t j = targ.length() - read_r.right;
         
-    vector<Indel>::const_iterator ins = read_r.inserts.end()-1;
-    vector<Indel>::const_iterator del = read_r.deletes.end()-1;
+    IndelVector::const_iterator ins = read_r.inserts.end()-1;
+    IndelVector::const_iterator del = read_r.deletes.end()-1;
 
     if (read_r.inserts.size() || read_r.deletes.size()) {
       logger.severe("Indels are not currently supported for eXpress-D.");
@@ -261,10 +266,80 @@ void MismatchTable::get_indices(const FragHit& f,
   }
 }
 
-double MismatchTable::log_likelihood(const FragHit& f) const {
+double MismatchTable::fixed_log_likelihood(const vector<float>& lookup,
+                                           const SequenceFwd& read_seq,
+                                           const Sequence& ref_seq,
+                                           size_t start) const {
+  const float* table = &lookup[0];
+  size_t len = read_seq.length();
+  double ll = len * _no_indel_ll;
+  size_t prev = 0;
+  // Neither sequence is probabilistic, so the packed bases are read directly.
+  for (size_t i = 0; i < len; ++i, table += 64) {
+    size_t cur = read_seq.get_ref(i);
+    ll += table[((prev + ref_seq.get_ref(start + i)) << 2) + cur];
+    prev = cur << 2;
+  }
+  return ll;
+}
+
+bool MismatchTable::context_key(const FragHit& f, size_t& key) const {
+  const Sequence& t_seq = f.target()->seq(0);
+  if (t_seq.prob()) {
+    return false;
+  }
+
+  key = 0;
+  const ReadHit* reads[2] = { f.left_read(), f.right_read() };
+  for (size_t r = 0; r < 2; ++r) {
+    if (!reads[r]) {
+      continue;
+    }
+    const ReadHit& read = *reads[r];
+    boost::hash_combine(key, (r << 1) + read.first);
+    boost::hash_combine(key, read.seq.length());
+    for (IndelVector::const_iterator ins = read.inserts.begin();
+         ins != read.inserts.end(); ++ins) {
+      boost::hash_combine(key, ins->pos);
+      boost::hash_combine(key, ins->len);
+    }
+    boost::hash_combine(key, 0);
+    for (IndelVector::const_iterator del = read.deletes.begin();
+         del != read.deletes.end(); ++del) {
+      boost::hash_combine(key, del->pos);
+      boost::hash_combine(key, del->len);
+    }
+    // Hash the aligned reference in words of 32 nucleotides.
+    size_t word = 0;
+    for (size_t j = read.left; j < read.right; ++j) {
+      word = (word << 2) + t_seq.get_ref(j);
+      if ((j - read.left) % 32 == 31) {
+        boost::hash_combine(key, word);
+        word = 0;
+      }
+    }
+    boost::hash_combine(key, word);
+  }
+  return true;
+}
+
+double MismatchTable::log_likelihood(const FragHit& f,
+                                     MismatchCache* cache) const {
   if (!_active) {
     return 0;
   }
+
+  // Once the parameters are fixed, a lookup per base is as cheap as computing
+  // the key.
+  size_t key;
+  if (cache && _first_read_lookup.empty() && context_key(f, key)) {
+    double ll;
+    if (!cache->find(key, ll)) {
+      ll = log_likelihood(f);
+      cache->insert(key, ll);
+    }
+    return ll;
+  }
   
   const Target& targ = *f.target();
   const Sequence& t_seq_fwd = targ.seq(0);
@@ -272,7 +347,13 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
 
   double ll = 0;
 
-  if (f.left_read()) {
+  if (f.left_read() && !_first_read_lookup.empty() && !t_seq_fwd.prob() &&
+      f.left_read()->inserts.empty() && f.left_read()->deletes.empty()) {
+    const ReadHit& read_l = *f.left_read();
+    ll += fixed_log_likelihood((read_l.first) ? _first_read_lookup :
+                                                _second_read_lookup,
+                               read_l.seq, t_seq_fwd, read_l.left);
+  } else if (f.left_read()) {
     const ReadHit& read_l = *f.left_read();
     const vector<FrequencyMatrix<double> >& left_mm = (read_l.first) ?
                                                       _first_read_mm :
@@ -283,8 +364,8 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
     bool insertion = false;
     bool deletion = false;
     
-    vector<Indel>::const_iterator ins = read_l.inserts.begin();
-    vector<Indel>::const_iterator del = read_l.deletes.begin();
+    IndelVector::const_iterator ins = read_l.inserts.begin();
+    IndelVector::const_iterator del = read_l.deletes.begin();
     
     while (i < read_l.seq.length()) {
 
@@ -329,7 +410,14 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
     }
   }
   
-  if (f.right_read()) {
+  if (f.right_read() && !_first_read_lookup.empty() && !t_seq_rev.prob() &&
+      f.right_read()->inserts.empty() && f.right_read()->deletes.empty()) {
+    const ReadHit& read_r = *f.right_read();
+    ll += fixed_log_likelihood((read_r.first) ? _first_read_lookup :
+                                                _second_read_lookup,
+                               read_r.seq, t_seq_rev,
+                               targ.length() - read_r.right);
+  } else if (f.right_read()) {
     const ReadHit& read_r = *f.right_read();
     
     const vector<FrequencyMatrix<double> >& right_mm = (read_r.first) ?
@@ -343,8 +431,8 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
     bool insertion = false;
     bool deletion = false;
     
-    vector<Indel>::const_iterator ins = read_r.inserts.end()-1;
-    vector<Indel>::const_iterator del = read_r.deletes.end()-1;
+    IndelVector::const_iterator ins = read_r.inserts.end()-1;
+    IndelVector::const_iterator del = read_r.deletes.end()-1;
 
     while (i < r_len) {
       if (del != read_r.deletes.begin() - 1 && del->pos == r_len - i) {
@@ -390,7 +478,8 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
   return ll;
 }
 
-void MismatchTable::update(const FragHit& f, double p, double mass) {
+void MismatchTable::update(const FragHit& f, double p, double mass,
+                           MismatchTable& delta) const {
   if (mass == LOG_0) {
     return;
   }
@@ -401,38 +490,41 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
 
   if (f.left_read()) {
     const ReadHit& read_l = *f.left_read();
-    vector<FrequencyMatrix<double> >& left_mm = (read_l.first) ?
-                                                _first_read_mm :
-                                                _second_read_mm;
+    const vector<FrequencyMatrix<double> >& left_mm = (read_l.first) ?
+                                                      _first_read_mm :
+                                                      _second_read_mm;
+    vector<FrequencyMatrix<double> >& left_delta = (read_l.first) ?
+                                                   delta._first_read_mm :
+                                                   delta._second_read_mm;
     size_t i = 0;  // read index
     size_t j = read_l.left;  // genomic index
 
     bool insertion = false;
     bool deletion = false;
     
-    vector<Indel>::const_iterator ins = read_l.inserts.begin();
-    vector<Indel>::const_iterator del = read_l.deletes.begin();
+    IndelVector::const_iterator ins = read_l.inserts.begin();
+    IndelVector::const_iterator del = read_l.deletes.begin();
 
     vector<double> joint_probs(NUM_NUCS);
 
     assert(targ.length() >= f.right());
     while (i < read_l.seq.length()) {
       if (del != read_l.deletes.end() && del->pos == i) {
-        _delete_params.increment(del->len, mass);
+        delta._delete_params.increment(del->len, mass);
         j += del->len;
         del++;
         deletion = true;
       } else if (ins != read_l.inserts.end() && ins->pos == i) {
-        _insert_params.increment(ins->len, mass);
+        delta._insert_params.increment(ins->len, mass);
         i += ins->len;
         ins++;
         insertion = true;
       } else {
         if (!insertion) {
-          _insert_params.increment(0, mass);
+          delta._insert_params.increment(0, mass);
         }
         if (!deletion) {
-          _delete_params.increment(0, mass);
+          delta._delete_params.increment(0, mass);
         }
         insertion = false;
         deletion = false;
@@ -461,7 +553,7 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
 
           for (size_t nuc = 0; !left_mm[i].is_fixed() && nuc < NUM_NUCS; nuc++) {
             size_t index = prev + nuc;
-            left_mm[i].increment(index, cur,
+            left_delta[i].increment(index, cur,
                                  mass + p + t_seq_fwd.get_prob(j, nuc));
           }
 
@@ -471,21 +563,24 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
         } else {
           size_t ref = t_seq_fwd[j];
           size_t index = prev + ref;
-          left_mm[i].increment(index, cur, mass + p);
+          left_delta[i].increment(index, cur, mass + p);
         }
 
         i++;
         j++;
       }
     }
-    _max_len = max(_max_len, read_l.seq.length());
+    delta._max_len = max(delta._max_len, read_l.seq.length());
   }
   
   if (f.right_read()) {
     const ReadHit& read_r = *f.right_read();
-    vector<FrequencyMatrix<double> >& right_mm = (read_r.first) ?
-                                                  _first_read_mm :
-                                                  _second_read_mm;
+    const vector<FrequencyMatrix<double> >& right_mm = (read_r.first) ?
+                                                       _first_read_mm :
+                                                       _second_read_mm;
+    vector<FrequencyMatrix<double> >& right_delta = (read_r.first) ?
+                                                    delta._first_read_mm :
+                                                    delta._second_read_mm;
     
     size_t r_len = read_r.seq.length();
     size_t i = 0;
@@ -494,29 +589,29 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
     bool insertion = false;
     bool deletion = false;
     
-    vector<Indel>::const_iterator ins = read_r.inserts.end() - 1;
-    vector<Indel>::const_iterator del = read_r.deletes.end() - 1;
+    IndelVector::const_iterator ins = read_r.inserts.end() - 1;
+    IndelVector::const_iterator del = read_r.deletes.end() - 1;
 
     vector<double> joint_probs(NUM_NUCS);
 
     while (i < r_len) {
       if (del != read_r.deletes.begin()-1 && del->pos == r_len-i ) {
-        _delete_params.increment(del->len, mass);
+        delta._delete_params.increment(del->len, mass);
         j += del->len;
         del--;
         deletion = true;
       } else if (ins != read_r.inserts.begin() - 1 &&
                  ins->pos + ins->len == r_len-i) {
-        _insert_params.increment(ins->len, mass);
+        delta._insert_params.increment(ins->len, mass);
         i += ins->len;
         ins--;
         insertion = true;
       } else {
         if (!insertion) {
-          _delete_params.increment(0, mass);
+          delta._delete_params.increment(0, mass);
         }
         if (!deletion) {
-          _insert_params.increment(0, mass);
+          delta._insert_params.increment(0, mass);
         }
         insertion = false;
         deletion = false;
@@ -544,7 +639,7 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
 
           for (size_t nuc = 0; !right_mm[i].is_fixed() && nuc < NUM_NUCS; nuc++) {
             size_t index = prev + nuc;
-            right_mm[i].increment(index, cur, mass+p+t_seq_rev.get_prob(j, nuc));
+            right_delta[i].increment(index, cur, mass+p+t_seq_rev.get_prob(j, nuc));
           }
 
           for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
@@ -553,17 +648,37 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
         } else {
           size_t ref = t_seq_rev[j];
           size_t index = prev + ref;
-          right_mm[i].increment(index, cur, mass+p);
+          right_delta[i].increment(index, cur, mass+p);
         }
 
         i++;
         j++;
       }
-      _max_len = max(_max_len, read_r.seq.length());
+      delta._max_len = max(delta._max_len, read_r.seq.length());
     }
   }
 }
 
+void MismatchTable::merge(const MismatchTable& delta) {
+  for (size_t i = 0; i < delta._max_len; ++i) {
+    _first_read_mm[i].merge(delta._first_read_mm[i]);
+    _second_read_mm[i].merge(delta._second_read_mm[i]);
+  }
+  _insert_params.merge(delta._insert_params);
+  _delete_params.merge(delta._delete_params);
+  _max_len = max(_max_len, delta._max_len);
+}
+
+void MismatchTable::clear() {
+  for (size_t i = 0; i < _max_len; ++i) {
+    _first_read_mm[i].clear();
+    _second_read_mm[i].clear();
+  }
+  _insert_params.clear();
+  _delete_params.clear();
+  _max_len = 0;
+}
+
 void MismatchTable::fix() {
   for (size_t i = 0; i < max_read_len; i++) {
     _first_read_mm[i].fix();
@@ -571,6 +686,16 @@ void MismatchTable::fix() {
   }
   _insert_params.fix();
   _delete_params.fix();
+
+  _first_read_lookup.resize(max_read_len * 64);
+  _second_read_lookup.resize(max_read_len * 64);
+  for (size_t i = 0; i < max_read_len; i++) {
+    for (size_t k = 0; k < 64; k++) {
+      _first_read_lookup[i * 64 + k] = _first_read_mm[i](k >> 2, k & 3);
+      _second_read_lookup[i * 64 + k] = _second_read_mm[i](k >> 2, k & 3);
+    }
+  }
+  _no_indel_ll = _insert_params(0) + _delete_params(0);
 }
 
 void MismatchTable::append_output(ofstream& outfile) const {
@@ -13,6 +13,56 @@
 
 class FragHit;
 class Target;
+class Sequence;
+class SequenceFwd;
+
+/**
+ * The MismatchCache class stores error model log-likelihoods computed for the
+ * alignments of a single fragment, keyed by a hash of their read and reference
+ * context (see MismatchTable::context_key). Alignments of the same reads to
+ * identical reference sequence, as is common for isoforms sharing exons, then
+ * only need to be evaluated once. A fragment has few alignments, so the entries
+ * are searched linearly.
+ *  @author    Adam Roberts
+ *  @date      2014
+ *  @copyright Artistic License 2.0
+ **/
+class MismatchCache {
+  /**
+   * A private vector of (context key, log-likelihood) pairs.
+   */
+  std::vector<std::pair<size_t, double> > _entries;
+
+ public:
+  /**
+   * A member function that looks up the log-likelihood for a context key.
+   * @param key the context key of the alignment.
+   * @param ll set to the cached log-likelihood if found.
+   * @return True if the key was found in the cache.
+   */
+  bool find(size_t key, double& ll) const {
+    for (size_t i = 0; i < _entries.size(); ++i) {
+      if (_entries[i].first == key) {
+        ll = _entries[i].second;
+        return true;
+      }
+    }
+    return false;
+  }
+  /**
+   * A member function that adds the log-likelihood for a context key.
+   * @param key the context key of the alignment.
+   * @param ll the log-likelihood of the alignment.
+   */
+  void insert(size_t key, double ll) {
+    _entries.push_back(std::make_pair(key, ll));
+  }
+  /**
+   * A member function that removes all entries so the cache can be reused for
+   * another fragment.
+   */
+  void clear() { _entries.clear(); }
+};
 
 /**
 
@@ -45,6 +95,23 @@ class MismatchTable {
    * A FrequencyMatrix storing the observations of deletions of given lengths.
    */
   FrequencyMatrix<double> _delete_params;
+  /**
+   * A flat vector of the fixed (normalized) first read mismatch parameters,
+   * indexed as [pos][prev][ref][obs]. Filled when the parameters are fixed so
+   * that likelihoods of indel-free mappings can be computed with a single
+   * lookup per base.
+   */
+  std::vector<float> _first_read_lookup;
+  /**
+   * A flat vector of the fixed second read mismatch parameters, indexed as
+   * in _first_read_lookup.
+   */
+  std::vector<float> _second_read_lookup;
+  /**
+   * A double storing the fixed log-likelihood of having neither an insertion
+   * nor a deletion at a read position.
+   */
+  double _no_indel_ll;
   /**
    * A size_t storing the maximum observed read length.
    */
@@ -55,6 +122,19 @@ class MismatchTable {
    * probabalistic target sequences are not updated.
    */
   bool _active;
+  /**
+   * A private member function that computes the log-likelihood of an
+   * indel-free read mapping with a deterministic reference sequence from the
+   * fixed lookup tables.
+   * @param lookup the flat lookup table for the read (first or second).
+   * @param read_seq the sequence of the read.
+   * @param ref_seq the target sequence in the direction of the read.
+   * @param start the position in ref_seq aligned to the first base of the read.
+   * @return The log likelihood of the read's mismatches.
+   */
+  double fixed_log_likelihood(const std::vector<float>& lookup,
+                              const SequenceFwd& read_seq,
+                              const Sequence& ref_seq, size_t start) const;
 
  public:
   /**
@@ -100,14 +180,29 @@ class MismatchTable {
                    std::vector<char>& right_indices,
                    std::vector<char>& right_seq,
                    std::vector<char>& right_ref) const;
+  /**
+   * A member function that computes a key identifying the read and reference
+   * context of a fragment mapping, which determines its error model
+   * likelihood and updates. Mappings of the same fragment with equal keys
+   * align the same reads with the same indels to identical reference
+   * sequence. Mappings to probabilistic target sequences have no key, since
+   * their likelihoods depend on the target-specific distributions.
+   * @param f the fragment mapping to compute the key for.
+   * @param key set to the key of the mapping, if it has one.
+   * @return True if the mapping has a key.
+   */
+  bool context_key(const FragHit& f, size_t& key) const;
   /**
    * A member function that returns the log likelihood of mismatches and indels
    * in the mapping given the current error model parematers. Returns 0 if
    * _active is false.
    * @param f the fragment mapping to calculate the log likelihood for.
+   * @param cache optional pointer to a cache of the likelihoods of other
+   *        mappings of the same fragment, which is consulted and filled while
+   *        the parameters are not yet fixed.
    * @return The log likelihood of the mapping based on mismatches and indels.
    */
-  double log_likelihood(const FragHit& f) const;
+  double log_likelihood(const FragHit& f, MismatchCache* cache=NULL) const;
   /**
    * A member function that updates the error model parameters based on a
    * mapping and its (logged) mass. Also updates the sequence parameters if
@@ -116,10 +211,36 @@ class MismatchTable {
    * @param p the logged posterior probablity of the alignment.
    * @param mass the logged mass of the fragment.
    */
-  void update(const FragHit&, double p, double mass);
+  void update(const FragHit& f, double p, double mass) {
+    update(f, p, mass, *this);
+  }
+  /**
+   * A member function that computes the updates to the error model parameters
+   * based on a mapping and its (logged) mass using the current parameters, but
+   * applies them to the given table instead of this one. Sequence parameters
+   * are updated as in update.
+   * @param f the fragment mapping.
+   * @param p the logged posterior probablity of the alignment.
+   * @param mass the logged mass of the fragment.
+   * @param delta the MismatchTable to apply the updates to, which may be this.
+   */
+  void update(const FragHit& f, double p, double mass,
+              MismatchTable& delta) const;
+  /**
+   * A member function that adds the parameter updates accumulated in another
+   * MismatchTable (usually constructed with 0 pseudo-counts) to this one.
+   * Does nothing once the parameters are fixed.
+   * @param delta the MismatchTable containing the updates to add.
+   */
+  void merge(const MismatchTable& delta);
+  /**
+   * A member function that sets all parameters to 0 so that the table can be
+   * used to accumulate updates again after being merged.
+   */
+  void clear();
   /**
-   * Freezes the parameters to allow for faster computation after burn out.
-   * Cannot be undone.
+   * Freezes the parameters to allow for faster computation after burn out and
+   * fills the flat lookup tables used by log_likelihood. Cannot be undone.
    */
   void fix();
   /**
@@ -0,0 +1,39 @@
+//
+//  nameindex.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "nameindex.h"
+
+using namespace std;
+
+void NameIndex::build(const TransIndex& targ_index) {
+  size_t num_slots = 1;
+  while (num_slots < 2 * targ_index.size()) {
+    num_slots <<= 1;
+  }
+  _mask = num_slots - 1;
+  Slot empty;
+  empty.index = NOT_FOUND;
+  _slots.assign(num_slots, empty);
+  _names.clear();
+
+  for (TransIndex::const_iterator it = targ_index.begin();
+       it != targ_index.end(); ++it) {
+    const string& name = it->first;
+    Slot slot;
+    slot.hash = hash_name(name.data(), name.size());
+    slot.index = it->second;
+    slot.name_offset = (uint32_t)_names.size();
+    slot.name_length = (uint32_t)name.size();
+    _names += name;
+
+    size_t i = slot.hash & _mask;
+    while (_slots[i].index != NOT_FOUND) {
+      i = (i + 1) & _mask;
+    }
+    _slots[i] = slot;
+  }
+}
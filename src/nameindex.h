@@ -0,0 +1,114 @@
+/**
+ *  nameindex.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_nameindex_h
+#define express_nameindex_h
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+typedef boost::unordered_map<std::string, size_t> TransIndex;
+
+/**
+ * The NameIndex class is a read-only hash table mapping target names to their
+ * indices, built once from the target-to-index map of an alignment file header.
+ * Names are looked up by a pointer and length, so that no string need be
+ * constructed for each alignment. The table uses open addressing over a flat
+ * array, and each slot stores the hash of its name so that nearly all
+ * mismatches are rejected without comparing the names, which are stored
+ * contiguously.
+ *  @copyright Artistic License 2.0
+ **/
+class NameIndex {
+  /**
+   * The Slot struct stores a single entry of the hash table.
+   */
+  struct Slot {
+    /**
+     * A public size_t storing the hash of the name.
+     */
+    size_t hash;
+    /**
+     * A public size_t storing the index of the target, or NOT_FOUND if the
+     * slot is empty.
+     */
+    size_t index;
+    /**
+     * A public uint32_t storing the offset of the name in _names.
+     */
+    uint32_t name_offset;
+    /**
+     * A public uint32_t storing the length of the name.
+     */
+    uint32_t name_length;
+  };
+  /**
+   * A private vector of slots, whose size is a power of 2 at least twice the
+   * number of names.
+   */
+  std::vector<Slot> _slots;
+  /**
+   * A private size_t storing one less than the number of slots, to mask hashes
+   * into slot positions.
+   */
+  size_t _mask;
+  /**
+   * A private string storing the concatenated names.
+   */
+  std::string _names;
+
+  /**
+   * A private static member function that hashes a name.
+   * @param name a pointer to the first character of the name.
+   * @param len the length of the name.
+   * @return The hash of the name.
+   */
+  static size_t hash_name(const char* name, size_t len) {
+    return boost::hash_range(name, name + len);
+  }
+
+ public:
+  /**
+   * A public static size_t returned by find when a name is not in the index.
+   */
+  static const size_t NOT_FOUND = (size_t)-1;
+  /**
+   * NameIndex constructor creates an empty index.
+   */
+  NameIndex() : _slots(1), _mask(0) { _slots[0].index = NOT_FOUND; }
+  /**
+   * A member function that replaces the contents of the index with those of
+   * the given map.
+   * @param targ_index the target-to-index map to copy.
+   */
+  void build(const TransIndex& targ_index);
+  /**
+   * A member function that looks up the index of a name, which need not be
+   * NUL-terminated.
+   * @param name a pointer to the first character of the name.
+   * @param len the length of the name.
+   * @return The index of the name, or NOT_FOUND if it is not in the index.
+   */
+  size_t find(const char* name, size_t len) const {
+    size_t hash = hash_name(name, len);
+    for (size_t i = hash & _mask; _slots[i].index != NOT_FOUND;
+         i = (i + 1) & _mask) {
+      const Slot& slot = _slots[i];
+      if (slot.hash == hash && slot.name_length == len &&
+          !memcmp(_names.data() + slot.name_offset, name, len)) {
+        return slot.index;
+      }
+    }
+    return NOT_FOUND;
+  }
+};
+
+#endif
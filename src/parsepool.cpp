@@ -0,0 +1,152 @@
+//
+//  parsepool.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "parsepool.h"
+#include "main.h"
+#include "fragments.h"
+#include "mapparser.h"
+#include "threadsafety.h"
+#include <boost/bind.hpp>
+
+using namespace std;
+
+// The number of chunks each worker thread may parse ahead of the consumer.
+const size_t CHUNKS_PER_THREAD = 4;
+
+void ParseChunk::clear() {
+  foreach (ReadHit* r, hits) {
+    delete r;
+  }
+  hits.clear();
+  valid.clear();
+  data.clear();
+  begin = NULL;
+  end = NULL;
+  ready = false;
+}
+
+ParsePool::ParsePool(Parser* parser, size_t num_threads)
+    : _parser(parser),
+      _num_threads(max(num_threads, (size_t)1)),
+      _window(_num_threads * CHUNKS_PER_THREAD),
+      _next_read(0),
+      _next_out(0),
+      _eof(false),
+      _stop(false),
+      _started(false),
+      _curr_pos(0) {
+}
+
+ParsePool::~ParsePool() {
+  stop();
+}
+
+void ParsePool::start() {
+  _next_read = 0;
+  _next_out = 0;
+  _eof = false;
+  _stop = false;
+  _started = true;
+  for (size_t i = 0; i < _num_threads; ++i) {
+    _workers.create_thread(boost::bind(&ParsePool::parse_chunks, this));
+  }
+}
+
+void ParsePool::stop() {
+  {
+    boost::unique_lock<boost::mutex> lock(_mut);
+    _stop = true;
+    _slot_free.notify_all();
+  }
+  _workers.join_all();
+  foreach (ParseChunk& c, _window) {
+    c.clear();
+  }
+  _curr.clear();
+  _curr_pos = 0;
+  _started = false;
+}
+
+void ParsePool::rewind() {
+  stop();
+}
+
+void ParsePool::parse_chunks() {
+  while (true) {
+    size_t seq;
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      while (!_stop && !_eof && _next_read - _next_out >= _window.size()) {
+        _slot_free.wait(lock);
+      }
+      if (_stop || _eof) {
+        break;
+      }
+      seq = _next_read;
+      if (!_parser->read_chunk(_window[seq % _window.size()])) {
+        _eof = true;
+        _chunk_ready.notify_all();
+        break;
+      }
+      _next_read++;
+    }
+
+    // The slot is not touched by the consumer or other workers until ready.
+    ParseChunk& c = _window[seq % _window.size()];
+    _parser->parse_chunk(c);
+
+    boost::unique_lock<boost::mutex> lock(_mut);
+    c.ready = true;
+    _chunk_ready.notify_all();
+  }
+}
+
+bool ParsePool::next_chunk() {
+  _curr.clear();
+  _curr_pos = 0;
+
+  boost::unique_lock<boost::mutex> lock(_mut);
+  ParseChunk& c = _window[_next_out % _window.size()];
+  while (!c.ready) {
+    if (_eof && _next_out == _next_read) {
+      return false;
+    }
+    _chunk_ready.wait(lock);
+  }
+  _curr.hits.swap(c.hits);
+  _curr.valid.swap(c.valid);
+  c.clear();
+  _next_out++;
+  _slot_free.notify_all();
+  return true;
+}
+
+bool ParsePool::next(ReadHit*& hit, ParseThreadSafety* pts) {
+  if (!_started) {
+    start();
+  }
+  while (true) {
+    if (_curr_pos == _curr.hits.size()) {
+      if (!next_chunk()) {
+        return false;
+      }
+      continue;
+    }
+    ReadHit* r = _curr.hits[_curr_pos];
+    bool valid = _curr.valid[_curr_pos];
+    _curr.hits[_curr_pos++] = NULL;
+    if (valid) {
+      hit = r;
+      return true;
+    }
+    if (pts) {
+      pts->proc_invalid.push(r);
+    } else {
+      frag_pool.release(r);
+    }
+  }
+}
@@ -0,0 +1,183 @@
+/**
+ *  parsepool.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_parsepool_h
+#define express_parsepool_h
+
+#include <boost/thread.hpp>
+#include <vector>
+
+class Parser;
+struct ParseThreadSafety;
+struct ReadHit;
+
+/**
+ * The ParseChunk struct holds a contiguous range of raw alignment records read
+ * from the input, and the ReadHits parsed from them in input order.
+ *  @copyright Artistic License 2.0
+ **/
+struct ParseChunk {
+  /**
+   * A public vector holding the raw records when they must be copied out of the
+   * input. Unused if the records are accessed in place.
+   */
+  std::vector<char> data;
+  /**
+   * A public pointer to the first byte of the raw records.
+   */
+  const char* begin;
+  /**
+   * A public pointer following the last byte of the raw records.
+   */
+  const char* end;
+  /**
+   * A public vector of the ReadHits parsed from the records, in input order.
+   * Owned by the chunk until handed to the consumer.
+   */
+  std::vector<ReadHit*> hits;
+  /**
+   * A public vector specifying for each ReadHit in hits whether it is a valid
+   * mapping (true) or an invalid alignment kept only for output (false).
+   */
+  std::vector<bool> valid;
+  /**
+   * A public bool that is true iff the chunk has been parsed and not yet handed
+   * to the consumer.
+   */
+  bool ready;
+  ParseChunk() : begin(NULL), end(NULL), ready(false) {}
+  /**
+   * A member function that deletes any ReadHits still owned by the chunk and
+   * empties it.
+   */
+  void clear();
+};
+
+/**
+ * The ParsePool class parses the input of a Parser on a pool of worker
+ * threads. Each worker reads the next chunk of whole records from the input
+ * under a lock and parses it into ReadHits outside of it. Chunks are handed to
+ * the consumer strictly in input order, so that Fragments assembled from the
+ * ReadHits are identical to those from a serial parse, including those whose
+ * alignments straddle chunk boundaries.
+ *  @copyright Artistic License 2.0
+ **/
+class ParsePool {
+  /**
+   * A private pointer to the Parser whose read_chunk and parse_chunk member
+   * functions are called by the workers.
+   */
+  Parser* _parser;
+  /**
+   * A private size_t for the number of worker threads to use.
+   */
+  size_t _num_threads;
+  /**
+   * A private ring buffer of chunks that have been read from the input,
+   * indexed by their sequence number modulo its size.
+   */
+  std::vector<ParseChunk> _window;
+  /**
+   * A private size_t for the sequence number of the next chunk to read from the
+   * input.
+   */
+  size_t _next_read;
+  /**
+   * A private size_t for the sequence number of the next chunk to hand to the
+   * consumer.
+   */
+  size_t _next_out;
+  /**
+   * A private bool that is true once the end of the input has been reached.
+   */
+  bool _eof;
+  /**
+   * A private bool used to signal the worker threads to stop.
+   */
+  bool _stop;
+  /**
+   * A private bool that is true iff the worker threads have been started since
+   * construction or the last rewind.
+   */
+  bool _started;
+  /**
+   * A private mutex protecting the input and the read-ahead window.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable signalled when a chunk has been parsed.
+   */
+  boost::condition_variable _chunk_ready;
+  /**
+   * A private condition variable signalled when a slot in the window is freed.
+   */
+  boost::condition_variable _slot_free;
+  /**
+   * A private group of the worker threads.
+   */
+  boost::thread_group _workers;
+  /**
+   * A private chunk holding the ReadHits currently being consumed.
+   */
+  ParseChunk _curr;
+  /**
+   * A private size_t for the index of the next unconsumed ReadHit in _curr.
+   */
+  size_t _curr_pos;
+  /**
+   * A private member function that drives each worker thread.
+   */
+  void parse_chunks();
+  /**
+   * A private member function that waits for the next chunk in input order and
+   * swaps it into _curr.
+   * @return True iff a chunk was available. False at the end of the input.
+   */
+  bool next_chunk();
+  /**
+   * A private member function that starts the worker threads.
+   */
+  void start();
+  /**
+   * A private member function that signals the worker threads to stop, waits
+   * for them to finish, and deletes any unconsumed ReadHits.
+   */
+  void stop();
+
+ public:
+  /**
+   * ParsePool constructor. The worker threads are not started until the first
+   * ReadHit is requested.
+   * @param parser a pointer to the Parser whose input should be parsed.
+   * @param num_threads the number of worker threads to use (at least 1).
+   */
+  ParsePool(Parser* parser, size_t num_threads);
+  /**
+   * ParsePool destructor stops the worker threads.
+   */
+  ~ParsePool();
+  /**
+   * A member function that returns the next valid ReadHit in input order.
+   * Invalid alignments preceding it are pushed onto the invalid queue if one is
+   * given, and deleted otherwise.
+   * @param hit a pointer set to the next valid ReadHit, which is owned by the
+   *        caller.
+   * @param pts a pointer to the struct containing the queue for invalid
+   *        alignments, or NULL if they should be discarded.
+   * @return True iff a valid ReadHit was available. False at the end of the
+   *         input.
+   */
+  bool next(ReadHit*& hit, ParseThreadSafety* pts);
+  /**
+   * A member function that stops the worker threads and discards any parsed
+   * ReadHits so that the Parser can rewind its input. Parsing resumes from the
+   * new input position when the next ReadHit is requested.
+   */
+  void rewind();
+};
+
+#endif
@@ -8,12 +8,16 @@
 
 #include "sequence.h"
 #include <cassert>
+#include <cstring>
 #include <boost/math/distributions/binomial.hpp>
 
 using namespace std;
 using namespace boost::math;
 
 string Sequence::serialize() {
+  if (!_is_prob) {
+    return string(_ref_seq.get(), _ref_seq.get() + (_len + 3) / 4);
+  }
   vector<char> seq;
   for (size_t i = 0; i < length(); i++) {
     if (i/4 == seq.size()) {
@@ -25,101 +29,130 @@ string Sequence::serialize() {
   return string(seq.begin(), seq.end());
 }
 
-SequenceFwd::SequenceFwd():  _ref_seq(NULL), _prob(0), _len(0) {}
+char* Sequence::resize(size_t len) {
+  size_t num_bytes = (len + 3) / 4;
+  if (!_ref_seq || _capacity < num_bytes) {
+    _ref_seq.reset(new char[max(num_bytes, (size_t)1)]);
+    _capacity = num_bytes;
+  }
+  _len = len;
+  memset(_ref_seq.get(), 0, num_bytes);
+  return _ref_seq.get();
+}
+
+SequenceFwd::SequenceFwd() {}
 
-SequenceFwd::SequenceFwd(const std::string& seq, bool rev, bool prob)
-    : _prob(prob), _len(seq.length()) {
+SequenceFwd::SequenceFwd(const std::string& seq, bool rev, bool prob) {
   if (prob) {
-    _est_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, 0.001);
-    _obs_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, LOG_0);
-    _exp_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, LOG_0);
+    init_prob(seq.length());
   }
   set(seq, rev);
 }
 
-SequenceFwd::SequenceFwd(const SequenceFwd& other)
-    : _obs_seq(other._obs_seq), _exp_seq(other._exp_seq),
-      _prob(other._prob), _len(other.length()) {
-  if (other._ref_seq) {
-    char* ref_seq = new char[_len];
-    std::copy(other._ref_seq.get(), other._ref_seq.get() + _len, ref_seq);
-    _ref_seq.reset(ref_seq);
+SequenceFwd::SequenceFwd(const char* data, size_t len, bool prob) {
+  if (prob) {
+    init_prob(len);
   }
+  deserialize(data, len);
+}
+
+SequenceFwd::SequenceFwd(const SequenceFwd& other) : Sequence() {
+  copy(other);
 }
 
 SequenceFwd& SequenceFwd::operator=(const SequenceFwd& other) {
   if (other._ref_seq) {
-    _len = other.length();
-    char* ref_seq = new char[_len];
-    std::copy(other._ref_seq.get(), other._ref_seq.get() + _len, ref_seq);
-    _ref_seq.reset(ref_seq);
-    _obs_seq = other._obs_seq;
-    _exp_seq = other._exp_seq;
-    _prob = other._prob;
+    copy(other);
   }
   return *this;
 }
 
+void SequenceFwd::copy(const SequenceFwd& other) {
+  if (other._ref_seq) {
+    char* ref_seq = resize(other.length());
+    std::copy(other._ref_seq.get(), other._ref_seq.get() + (_len + 3) / 4,
+              ref_seq);
+  }
+  if (other._prob) {
+    _prob.reset(new ProbSeq(*other._prob));
+  } else {
+    _prob.reset();
+  }
+  _is_prob = other._is_prob;
+}
+
+void SequenceFwd::init_prob(size_t len) {
+  _prob.reset(new ProbSeq());
+  _prob->est = FrequencyMatrix<float>(len, NUM_NUCS, 0.001);
+  _prob->obs = FrequencyMatrix<float>(len, NUM_NUCS, LOG_0);
+  _prob->exp = FrequencyMatrix<float>(len, NUM_NUCS, LOG_0);
+  _is_prob = true;
+}
+
 void SequenceFwd::set(const std::string& seq, bool rev) {
-  char* ref_seq = new char[seq.length()];
-  for (size_t i = 0; i < seq.length(); i++) {
-    ref_seq[i] = (rev) ? complement(ctoi(seq[seq.length()-1-i])) : ctoi(seq[i]);
+  set(seq.c_str(), seq.length(), rev);
+}
+
+void SequenceFwd::set(const char* seq, size_t len, bool rev) {
+  char* ref_seq = resize(len);
+  for (size_t i = 0; i < len; i++) {
+    char c = (rev) ? complement(ctoi(seq[len-1-i])) : ctoi(seq[i]);
+    ref_seq[i >> 2] |= c << ((i & 3) << 1);
     if (_prob) {
-      _est_seq.increment(i, ref_seq[i], log((float)2));
+      _prob->est.increment(i, c, log((float)2));
     }
   }
-  _ref_seq.reset(ref_seq);
-  _len = seq.length();
 }
 
-size_t SequenceFwd::operator[](const size_t index) const {
-  assert(index < _len);
+void SequenceFwd::deserialize(const char* data, size_t len) {
+  char* ref_seq = resize(len);
+  std::copy(data, data + (len + 3) / 4, ref_seq);
   if (_prob) {
-    return _est_seq.argmax(index);
+    for (size_t i = 0; i < len; i++) {
+      _prob->est.increment(i, get_ref(i), log((float)2));
+    }
   }
-  return _ref_seq[index];
 }
 
-size_t SequenceFwd::get_ref(const size_t index) const {
-  assert(index < _len);
-  //assert(_ref_seq[index] == operator[](index));
-  return _ref_seq[index];
+size_t SequenceFwd::get_mode(const size_t index) const {
+  assert(_prob);
+  return _prob->est.argmax(index);
 }
 
 float SequenceFwd::get_prob(const size_t index, const size_t nuc) const {
   assert(_prob);
-  return _est_seq(index, nuc);
+  return _prob->est(index, nuc);
 }
 
 float SequenceFwd::get_obs(const size_t index, const size_t nuc) const {
   assert(index < _len);
-  return _obs_seq(index,nuc, false);
+  return _prob->obs(index,nuc, false);
 }
 
 float SequenceFwd::get_exp(const size_t index, const size_t nuc) const {
   assert(index < _len);
-  return _exp_seq(index,nuc, false);
+  return _prob->exp(index,nuc, false);
 }
 
 void SequenceFwd::update_est(const size_t index, const size_t nuc, float mass) {
   assert(_prob);
-  _est_seq.increment(index, nuc, mass);
+  _prob->est.increment(index, nuc, mass);
 }
 
 void SequenceFwd::update_obs(const size_t index, const size_t nuc, float mass) {
   assert(_prob);
-  _obs_seq.increment(index, nuc, mass);
+  _prob->obs.increment(index, nuc, mass);
 }
 
 void SequenceFwd::update_exp(const size_t index, const size_t nuc, float mass) {
   assert(_prob);
-  _exp_seq.increment(index, nuc, mass);
+  _prob->exp.increment(index, nuc, mass);
 }
 
 void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
   p_vals = vector<double>(_len, 1.0);
   for (size_t i = 0; i < _len; ++i) {
-    double N = round(sexp(_obs_seq.sum(i)));
+    double N = round(sexp(_prob->obs.sum(i)));
     if (N<5) {
       continue;
     }
@@ -130,7 +163,7 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
         continue;
       }
 
-      double obs_n = round(sexp(_obs_seq(i,nuc,false)));
+      double obs_n = round(sexp(_prob->obs(i,nuc,false)));
       max_obs = max(max_obs, obs_n);
     }
     
@@ -141,7 +174,7 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
         continue;
       }
 
-      double exp_p = sexp(_exp_seq(i, nuc));
+      double exp_p = sexp(_prob->exp(i, nuc));
       binomial binom(N, exp_p);
       p_val += log(cdf(binom, max_obs));
     }
@@ -149,6 +182,14 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const {
   }
 }
 
+SequenceRev::SequenceRev(SequenceFwd& seq) : _seq(&seq) {
+  char* ref_seq = resize(seq.length());
+  for (size_t i = 0; i < _len; ++i) {
+    ref_seq[i >> 2] |= complement(seq.get_ref(_len-i-1)) << ((i & 3) << 1);
+  }
+  _is_prob = seq.prob();
+}
+
 void SequenceRev::calc_p_vals(vector<double>& p_vals) const
 {
   vector<double> temp;
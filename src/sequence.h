@@ -10,6 +10,9 @@
 #define express_sequence_h
 
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <cassert>
+#include <cstdlib>
 #include <string>
 #include "frequencymatrix.h"
 
@@ -48,19 +51,56 @@ inline char complement(const char c) {
 
 /**
  * The Sequence class is an abstract class whose implmentations are used to
- * store and access encoded nucleotide sequences. They also supports
+ * store and access encoded nucleotide sequences. The reference sequence is
+ * stored in this base class with 2 bits per nucleotide so that the accessors
+ * for it can be inlined without a virtual call. They also supports
  * probabilistic sequences, meaning that each position stores a distribution
- * over nucleotides.
+ * over nucleotides. These are handled by the virtual methods of the
+ * implementations.
  *  @author    Adam Roberts
  *  @date      2012
  *  @copyright Artistic License 2.0
  **/
 class Sequence {
+ protected:
+  /**
+   * A char array that stores the encoded sequence with 2 bits per nucleotide,
+   * in the format produced by serialize. Deleted with this.
+   */
+  boost::scoped_array<char> _ref_seq;
+  /**
+   * A size_t storing the allocated length of _ref_seq in bytes, which may
+   * exceed that needed when the object is reused for a shorter sequence.
+   */
+  size_t _capacity;
+  /**
+   * A size_t storing the number of nucleotides in the sequence.
+   */
+  size_t _len;
+  /**
+   * A bool specifying whether the sequence is probabilistic.
+   */
+  bool _is_prob;
+  /**
+   * A member function that resizes the sequence, only reallocating _ref_seq
+   * if it is too short. The encoded sequence is zeroed.
+   * @param len the new length of the sequence.
+   * @return A pointer to the first byte of _ref_seq.
+   */
+  char* resize(size_t len);
+  /**
+   * An accessor for the mode of the posterior nucleotide distribution at the
+   * given index of a probabilistic sequence.
+   * @param index the index of the position to access (assumed to be < _len).
+   * @return The encoded nucleotide with the highest posterior probability.
+   */
+  virtual size_t get_mode(const size_t index) const = 0;
+
  public:
   /**
    * Dummy Sequence constructor.
    */
-  Sequence() {}
+  Sequence() : _ref_seq(NULL), _capacity(0), _len(0), _is_prob(false) {}
   /**
    * Dummy Sequence destructor.
    */
@@ -80,7 +120,13 @@ class Sequence {
    *        < _len)
    * @return The encoded character at the given index.
    */
-  virtual size_t operator[](const size_t index) const = 0;
+  size_t operator[](const size_t index) const {
+    assert(index < _len);
+    if (_is_prob) {
+      return get_mode(index);
+    }
+    return get_ref(index);
+  }
   /**
    * An accessor for the encoded reference character at the given index. May
    * differ from the operator[] if the sequence is probabilistic.
@@ -88,7 +134,10 @@ class Sequence {
    *        (assumed to be < _len)
    * @return The encoded reference character at the given index.
    */
-  virtual size_t get_ref(const size_t index) const = 0;
+  size_t get_ref(const size_t index) const {
+    assert(index < _len);
+    return ((unsigned char)_ref_seq[index >> 2] >> ((index & 3) << 1)) & 3;
+  }
   /**
    * A member function that updates the posterior nucleotide distribution if
    * probabilistic.
@@ -141,17 +190,17 @@ class Sequence {
    * Accessor to determine if the sequence is probabilistic.
    * @return True iff the sequence is probabilistic.
    */
-  virtual bool prob() const = 0;
+  bool prob() const { return _is_prob; }
   /**
    * An accessor for the length of the encoded sequence.
    * @return The length of the encoded sequence.
    */
-  virtual size_t length() const = 0;
+  size_t length() const { return _len; }
   /**
    * Accessor to determine if the sequence has 0 length.
    * @return True iff the sequence has 0 length.
    */
-  virtual bool empty() const = 0;
+  bool empty() const { return _len == 0; }
   /**
    * A member function that calculates p-values based on the observed and
    * expected nucleotide frequences for the sequence. Experimental.
@@ -177,34 +226,42 @@ class Sequence {
 class SequenceFwd: public Sequence
 {
   /**
-   * A char array that stores the encoded sequence (not null terminated).
-   * Deleted with this.
-   */
-  boost::scoped_array<const char> _ref_seq;
-  /**
-   * A private FrequencyMatrix to store the posterior nucleotide distributions
-   * (if _prob).
+   * The ProbSeq struct stores the nucleotide distributions of a probabilistic
+   * sequence.
    */
-  FrequencyMatrix<float> _est_seq;
+  struct ProbSeq {
+    /**
+     * A public FrequencyMatrix to store the posterior nucleotide distributions.
+     */
+    FrequencyMatrix<float> est;
+    /**
+     * A public FrequencyMatrix to store the observed nucleotide frequencies.
+     */
+    FrequencyMatrix<float> obs;
+    /**
+     * A public FrequencyMatrix to store the expected nucleotide frequencies.
+     */
+    FrequencyMatrix<float> exp;
+  };
   /**
-   * A private FrequencyMatrix to store the observed nucleotide frequencies
-   * (if _prob).
+   * A private pointer to the nucleotide distributions if the sequence is
+   * probabilistic, or NULL if it is fixed to the reference. Deleted with this.
    */
-  FrequencyMatrix<float> _obs_seq;
+  boost::scoped_ptr<ProbSeq> _prob;
   /**
-   * A private FrequencyMatrix to store the expected nucleotide frequencies
-   * (if _prob).
-   */
-  FrequencyMatrix<float> _exp_seq;
-  /**
-   * A private bool specifying if the sequence is probabilistic (true) or fixed
-   * to the reference (false).
+   * A private member function that copies the given sequence into this.
+   * @param other the SequenceFwd object to copy.
    */
-  bool _prob;
+  void copy(const SequenceFwd& other);
   /**
-   * A private size_t storing the number of nucleotides in the sequence.
+   * A private member function that allocates the nucleotide distributions of a
+   * probabilistic sequence with the given length.
+   * @param len the length of the sequence.
    */
-  size_t _len;
+  void init_prob(size_t len);
+
+ protected:
+  size_t get_mode(const size_t index) const;
 
  public:
   /**
@@ -218,6 +275,14 @@ class SequenceFwd: public Sequence
    *        before encoding.
    */
   SequenceFwd(const std::string& seq, bool rev, bool prob=false);
+  /**
+   * SequenceFwd constructor that stores a sequence from an array of bytes
+   * produced by serialize, with each nucleotide represented by 2 bits.
+   * @param data a pointer to the serialized sequence.
+   * @param len the number of nucleotides in the sequence.
+   * @param prob a bool specifying whether the sequence is probabilistic.
+   */
+  SequenceFwd(const char* data, size_t len, bool prob);
   /**
    * SequenceFwd copy constructor.
    * @param other the SequenceFwd object to copy.
@@ -228,29 +293,42 @@ class SequenceFwd: public Sequence
    * @param other the Sequence object to copy.
    */
   SequenceFwd& operator=(const SequenceFwd& other);
+  /**
+   * A member function that sets the sequence from a character array that need
+   * not be NUL-terminated, avoiding the construction of a temporary string.
+   * @param seq a pointer to the first character of the sequence.
+   * @param len the length of the sequence.
+   * @param rev a bool specifying whether the sequence should be reverse
+   *        complemented.
+   */
+  void set(const char* seq, size_t len, bool rev);
+  /**
+   * A member function that sets the sequence from an array of bytes produced
+   * by serialize, with each nucleotide represented by 2 bits.
+   * @param data a pointer to the serialized sequence.
+   * @param len the number of nucleotides in the sequence.
+   */
+  void deserialize(const char* data, size_t len);
   // The following methods are documented in the abstract Sequence class.
   void set(const std::string& seq, bool rev);
-  size_t operator[](const size_t index) const;
-  size_t get_ref(const size_t index) const;
   float get_exp(const size_t index, const size_t nuc) const;
   float get_obs(const size_t index, const size_t nuc) const;
   void update_est(const size_t index, const size_t nuc, float mass);
   void update_obs(const size_t index, const size_t nuc, float mass);
   void update_exp(const size_t index, const size_t nuc, float mass);
   float get_prob(const size_t index, const size_t nuc) const;
-  bool prob() const { return _prob; }
-  bool empty() const { return _len==0; }
-  size_t length() const { return _len; }
   void calc_p_vals(std::vector<double>& p_vals) const;
 };
 
 /**
  * The SequenceRev class implements the Sequence abstract class for accessing
  * the reverse sequence. Documentation is only provided for methods not
- * documented in the abstract Sequence class and SequenceFwd class. This class
- * acts by storing a pointer to a SequenceFwd object and reverse complementing
-
- * the input and output appropriately.
+ * documented in the abstract Sequence class and SequenceFwd class. The
+ * reverse complement of the reference is encoded once on construction so that
+ * it can be read directly, while the probabilistic methods act through a
+ * pointer to the SequenceFwd object, reverse complementing the input and
+ * output appropriately. The forward sequence should therefore not be reset
+ * after this object is constructed.
  *  @author    Adam Roberts
  *  @date      2012
  *  @copyright Artistic License 2.0
@@ -262,40 +340,32 @@ class SequenceRev: public Sequence {
    */
   SequenceFwd* _seq;
 
+ protected:
+  size_t get_mode(const size_t index) const {
+    return complement((*_seq)[_len-index-1]); }
+
  public:
   SequenceRev() : _seq(NULL){}
-  SequenceRev(SequenceFwd& seq) : _seq(&seq) {}
-  size_t length() const {
-    if (_seq == NULL) {
-	return 0;
-    }
-      return _seq->length();
-  }
-  bool empty() const {
-    if (_seq == NULL) {
-      return true;
-    }
-    return _seq->empty();
-  }
+  /**
+   * SequenceRev constructor encodes and stores the reverse complement of the
+   * given forward sequence.
+   * @param seq the SequenceFwd object to be the reverse complement of.
+   */
+  SequenceRev(SequenceFwd& seq);
   // Set is not allowed in this class.
   void set(const std::string& seq, bool rev) { assert(false); exit(1); }
-  size_t operator[](const size_t index) const {
-    return complement(_seq->operator[](length()-index-1)); }
-  size_t get_ref(const size_t index) const {
-    return complement(_seq->get_ref(length()-index-1)); }
   float get_obs(const size_t index, const size_t nuc) const {
-    return _seq->get_obs(length()-index-1, complement(nuc)); }
+    return _seq->get_obs(_len-index-1, complement(nuc)); }
   float get_exp(const size_t index, const size_t nuc) const {
-    return _seq->get_exp(length()-index-1, complement(nuc)); }
+    return _seq->get_exp(_len-index-1, complement(nuc)); }
   void update_est(const size_t index, const size_t nuc, float mass) {
-    _seq->update_est(length()-index-1, complement(nuc), mass); }
+    _seq->update_est(_len-index-1, complement(nuc), mass); }
   void update_obs(const size_t index, const size_t nuc, float mass) {
-    _seq->update_obs(length()-index-1, complement(nuc), mass); }
+    _seq->update_obs(_len-index-1, complement(nuc), mass); }
   void update_exp(const size_t index, const size_t nuc, float mass) {
-    _seq->update_exp(length()-index-1, complement(nuc), mass); }
+    _seq->update_exp(_len-index-1, complement(nuc), mass); }
   float get_prob(const size_t index, const size_t nuc) const {
-    return _seq->get_prob(length()-index-1, complement(nuc)); }
-  bool prob() const { return _seq->prob(); }
+    return _seq->get_prob(_len-index-1, complement(nuc)); }
   void calc_p_vals(std::vector<double>& p_vals) const;
 };
 
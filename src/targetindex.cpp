@@ -0,0 +1,137 @@
+//
+//  targetindex.cpp
+//  express
+//
+//  Copyright 2014 Adam Roberts. All rights reserved.
+//
+
+#include "targetindex.h"
+#include "main.h"
+#include "biascorrection.h"
+#include "sequence.h"
+#include <boost/unordered_set.hpp>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+const char TargetIndex::MAGIC[8] = {'E', 'X', 'P', 'I', 'D', 'X', '0', '1'};
+
+void TargetIndex::write(const string& fasta_file_name,
+                        const string& index_file_name, size_t bias_order) {
+  ifstream infile(fasta_file_name.c_str());
+  if (!infile.is_open()) {
+    logger.severe("Unable to open MultiFASTA file '%s'.",
+                  fasta_file_name.c_str());
+  }
+
+  vector<IndexEntry> entries;
+  string names;
+  string seqs;
+  BiasBoss bg_table(bias_order, 0);
+  boost::unordered_set<string> target_names;
+
+  string line;
+  string seq = "";
+  string name = "";
+  while (true) {
+    bool more = !getline(infile, line, '\n').fail();
+    if (more && line.empty()) {
+      continue;
+    }
+    if (!more || line[0] == '>') {
+      if (!name.empty()) {
+        SequenceFwd seq_fwd(seq, false);
+        SequenceRev seq_rev(seq_fwd);
+        bg_table.update_expectations(seq_fwd, seq_rev);
+
+        IndexEntry entry;
+        entry.name_offset = names.size();
+        entry.name_length = name.size();
+        entry.seq_offset = seqs.size();
+        entry.length = seq.size();
+        entries.push_back(entry);
+        names += name;
+        seqs += seq_fwd.serialize();
+      }
+      if (!more) {
+        break;
+      }
+      name = line.substr(1,line.find(' ')-1);
+      if (target_names.count(name)) {
+        logger.severe("Target '%s' is duplicated in the input FASTA. Ensure "
+                      "target names are unique before indexing.",
+                      name.c_str());
+      }
+      target_names.insert(name);
+      seq = "";
+    } else {
+      seq += line;
+    }
+  }
+  infile.close();
+
+  if (entries.empty()) {
+    logger.severe("No targets found in MultiFASTA file '%s'.",
+                  fasta_file_name.c_str());
+  }
+
+  string bias = bg_table.serialize_expectations();
+
+  // The names and sequences follow the entries, and their offsets are made
+  // relative to the start of the file.
+  IndexHeader header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.num_targs = entries.size();
+  header.bias_order = bias_order;
+  size_t names_offset = sizeof(IndexHeader) + entries.size()*sizeof(IndexEntry);
+  size_t seqs_offset = names_offset + names.size();
+  header.bias_offset = seqs_offset + seqs.size();
+  header.bias_size = bias.size();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    entries[i].name_offset += names_offset;
+    entries[i].seq_offset += seqs_offset;
+  }
+
+  ofstream outfile(index_file_name.c_str(),
+                   ios::out | ios::binary | ios::trunc);
+  if (!outfile.is_open()) {
+    logger.severe("Unable to open index file '%s' for writing.",
+                  index_file_name.c_str());
+  }
+  outfile.write((const char*)&header, sizeof(IndexHeader));
+  outfile.write((const char*)&entries[0], entries.size()*sizeof(IndexEntry));
+  outfile.write(names.data(), names.size());
+  outfile.write(seqs.data(), seqs.size());
+  outfile.write(bias.data(), bias.size());
+  outfile.close();
+  if (outfile.fail()) {
+    logger.severe("Unable to write index file '%s'.", index_file_name.c_str());
+  }
+
+  logger.info("Indexed %d targets.", entries.size());
+}
+
+bool TargetIndex::open(const string& file_name) {
+  _header = NULL;
+  _entries = NULL;
+  if (!_map.open(file_name)) {
+    return false;
+  }
+  if (_map.size() < sizeof(IndexHeader) ||
+      memcmp(_map.data(), MAGIC, sizeof(MAGIC))) {
+    _map.close();
+    return false;
+  }
+
+  _header = (const IndexHeader*)_map.data();
+  _entries = (const IndexEntry*)(_map.data() + sizeof(IndexHeader));
+  if (_header->num_targs > (_map.size() - sizeof(IndexHeader)) /
+                           sizeof(IndexEntry) ||
+      _header->bias_offset + _header->bias_size != _map.size()) {
+    logger.severe("Index file '%s' is truncated or corrupt.",
+                  file_name.c_str());
+  }
+  return true;
+}
@@ -0,0 +1,164 @@
+/**
+ *  targetindex.h
+ *  express
+ *
+ *  Copyright 2014 Adam Roberts. All rights reserved.
+ */
+
+#ifndef express_targetindex_h
+#define express_targetindex_h
+
+#include <stdint.h>
+#include <string>
+#include "mappedfile.h"
+
+/**
+ * The TargetIndex class provides access to a binary index of a MultiFASTA file,
+ * which can be given in its place so that the target sequences need not be
+ * parsed and encoded, nor the background bias expectations measured, on every
+ * run. The index stores the name, length and 2-bit encoded sequence of each
+ * target in the order of the MultiFASTA file, followed by the unnormalized
+ * background expectations of a BiasBoss over all of the targets. The file is
+ * memory-mapped, so opening it takes constant time.
+ *  @copyright Artistic License 2.0
+ **/
+class TargetIndex {
+  /**
+   * The IndexHeader struct is stored at the beginning of the index file.
+   */
+  struct IndexHeader {
+    /**
+     * A public char array identifying the file and format version.
+     */
+    char magic[8];
+    /**
+     * A public uint64_t storing the number of targets in the index.
+     */
+    uint64_t num_targs;
+    /**
+     * A public uint64_t storing the order of the Markov chains used to measure
+     * the background bias expectations.
+     */
+    uint64_t bias_order;
+    /**
+     * A public uint64_t storing the offset of the serialized background bias
+     * expectations in the file.
+     */
+    uint64_t bias_offset;
+    /**
+     * A public uint64_t storing the size of the serialized background bias
+     * expectations in bytes.
+     */
+    uint64_t bias_size;
+  };
+  /**
+   * The IndexEntry struct stores the location of a target in the index file.
+   * An array of entries, one per target, follows the header.
+   */
+  struct IndexEntry {
+    /**
+     * A public uint64_t storing the offset of the target name in the file.
+     */
+    uint64_t name_offset;
+    /**
+     * A public uint64_t storing the length of the target name.
+     */
+    uint64_t name_length;
+    /**
+     * A public uint64_t storing the offset of the encoded sequence in the file.
+     */
+    uint64_t seq_offset;
+    /**
+     * A public uint64_t storing the number of nucleotides in the sequence.
+     */
+    uint64_t length;
+  };
+  /**
+   * A private char array identifying index files.
+   */
+  static const char MAGIC[8];
+  /**
+   * A private MappedFile for the index file.
+   */
+  MappedFile _map;
+  /**
+   * A private pointer to the header of the mapped index file.
+   */
+  const IndexHeader* _header;
+  /**
+   * A private pointer to the first entry of the mapped index file.
+   */
+  const IndexEntry* _entries;
+
+ public:
+  /**
+   * TargetIndex constructor.
+   */
+  TargetIndex() : _header(NULL), _entries(NULL) {}
+  /**
+   * A static member function that parses a MultiFASTA file, measures the
+   * background bias expectations of its targets in both directions, and
+   * writes them to an index file.
+   * @param fasta_file_name the path to the MultiFASTA file to index.
+   * @param index_file_name the path to the index file to write.
+   * @param bias_order the order of the Markov chains used to measure the
+   *        background bias expectations.
+   */
+  static void write(const std::string& fasta_file_name,
+                    const std::string& index_file_name, size_t bias_order);
+  /**
+   * A member function that maps the given file if it is an index.
+   * @param file_name the path to the file to map.
+   * @return True iff the file is an index and was mapped.
+   */
+  bool open(const std::string& file_name);
+  /**
+   * An accessor for the number of targets in the index.
+   * @return The number of targets in the index.
+   */
+  size_t size() const { return (size_t)_header->num_targs; }
+  /**
+   * An accessor for the name of a target.
+   * @param i the position of the target in the index.
+   * @return The name of the target.
+   */
+  std::string name(size_t i) const {
+    return std::string(_map.data() + _entries[i].name_offset,
+                       (size_t)_entries[i].name_length);
+  }
+  /**
+   * An accessor for the encoded sequence of a target, in the format produced
+   * by Sequence::serialize. Returned pointer does not outlive this.
+   * @param i the position of the target in the index.
+   * @return A pointer to the first byte of the encoded sequence.
+   */
+  const char* seq(size_t i) const {
+    return _map.data() + _entries[i].seq_offset;
+  }
+  /**
+   * An accessor for the length of a target.
+   * @param i the position of the target in the index.
+   * @return The number of nucleotides in the target sequence.
+   */
+  size_t length(size_t i) const { return (size_t)_entries[i].length; }
+  /**
+   * An accessor for the order of the Markov chains used to measure the
+   * background bias expectations.
+   * @return The order of the background bias Markov chains.
+   */
+  size_t bias_order() const { return (size_t)_header->bias_order; }
+  /**
+   * An accessor for the serialized background bias expectations, in the format
+   * produced by BiasBoss::serialize_expectations. Returned pointer does not
+   * outlive this.
+   * @return A pointer to the first byte of the serialized expectations.
+   */
+  const char* bias_data() const { return _map.data() + _header->bias_offset; }
+  /**
+   * An accessor for the size of the serialized background bias expectations.
+   * @return The size of the serialized expectations in bytes.
+   */
+  size_t bias_size() const { return (size_t)_header->bias_size; }
+};
+
+#endif
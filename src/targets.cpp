@@ -14,22 +14,40 @@
 #include "mismatchmodel.h"
 #include "mapparser.h"
 #include "library.h"
+#include "logmath.h"
+#include "mappedfile.h"
+#include "targetindex.h"
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <cstring>
 #include <stdio.h>
 #include <limits>
 #include <float.h>
+#include <boost/bind.hpp>
 
 using namespace std;
 
-Target::Target(TargID id, const std::string& name, const std::string& seq,
-               bool prob_seq, double alpha, const Librarian* libs,
+/**
+ * Atomically adds to a (logged) value, capping the result at a maximum.
+ * @param val the atomic (logged) value to add to.
+ * @param incr_amt the (logged) amount to add.
+ * @param max_val the (logged) maximum value of the sum.
+ */
+inline void atomic_log_add(boost::atomic<double>& val, double incr_amt,
+                           double max_val = HUGE_VAL) {
+  double old_val = val.load(boost::memory_order_relaxed);
+  while (!val.compare_exchange_weak(old_val,
+                                    min(log_add(old_val, incr_amt), max_val))) {}
+}
+
+Target::Target(TargID id, const std::string& name, const SequenceFwd& seq,
+               double alpha, const Librarian* libs,
                const BiasBoss* known_bias_boss, const LengthDistribution* known_fld)
    : _libs(libs),
      _id(id),
      _name(name),
-     _seq_f(seq, 0, prob_seq),
+     _seq_f(seq),
      _seq_r(_seq_f),
      _alpha(log(alpha)),
      _ret_params(&_curr_params),
@@ -51,27 +69,30 @@ Target::Target(TargID id, const std::string& name, const std::string& seq,
 
 void Target::add_hit(const FragHit& hit, double v, double m) {
   double p = hit.params()->posterior;
-  _curr_params.mass = log_add(_curr_params.mass, p+m);
-  double mass_with_pseudo = log_add(_ret_params->mass, _init_pseudo_mass);
+  atomic_log_add(_curr_params.mass, p+m);
+  double mass_with_pseudo = log_add(_ret_params->mass.load(),
+                                    _init_pseudo_mass);
   if (p != LOG_1 || v != LOG_0) {
+    // The total ambiguous mass is added before and read after the ambiguous
+    // mass, so that p_hat is at most 1 under concurrent updates.
     if (p != LOG_0) {
-      _curr_params.ambig_mass = log_add(_curr_params.ambig_mass, p+m);
-      _curr_params.tot_ambig_mass = log_add(_curr_params.tot_ambig_mass, m);
+      atomic_log_add(_curr_params.tot_ambig_mass, m);
+      atomic_log_add(_curr_params.ambig_mass, p+m);
     }
-    double p_hat = _curr_params.ambig_mass;
-    if (_curr_params.tot_ambig_mass != LOG_0) {
-      p_hat -= _curr_params.tot_ambig_mass;
+    double p_hat = _curr_params.ambig_mass.load();
+    double tot_ambig_mass = _curr_params.tot_ambig_mass.load();
+    if (tot_ambig_mass != LOG_0) {
+      p_hat -= tot_ambig_mass;
     } else {
       assert(p_hat == LOG_0);
     }
     assert(p_hat == LOG_0 || p_hat <= LOG_1);
-    _curr_params.var_sum = min(log_add(_curr_params.var_sum, v + m),
-                               _curr_params.tot_ambig_mass + p_hat
-                               + log_sub(LOG_1, p_hat));
+    atomic_log_add(_curr_params.var_sum, v + m,
+                   tot_ambig_mass + p_hat + log_sub(LOG_1, p_hat));
     double var_update = log_add(p + 2*m, v + 2*m);
-    _curr_params.mass_var = min(log_add(_curr_params.mass_var, var_update),
-                                mass_with_pseudo + log_sub(_bundle->mass(),
-                                                      mass_with_pseudo));
+    atomic_log_add(_curr_params.mass_var, var_update,
+                   mass_with_pseudo + log_sub(_bundle->mass(),
+                                              mass_with_pseudo));
   }
   if (_curr_params.haplotype) {
     _curr_params.haplotype->update_mass(this, hit.frag_name(),
@@ -126,7 +147,8 @@ double Target::sample_likelihood(bool with_pseudo,
   return ll;
 }
 
-double Target::align_likelihood(const FragHit& frag) const {
+double Target::align_likelihood(const FragHit& frag,
+                                MismatchCache* mm_cache) const {
 
   const Library& lib = _libs->curr_lib();
 
@@ -135,7 +157,7 @@ double Target::align_likelihood(const FragHit& frag) const {
   const PairStatus ps = frag.pair_status();
 
   if (lib.mismatch_table) {
-    ll += (lib.mismatch_table)->log_likelihood(frag);
+    ll += (lib.mismatch_table)->log_likelihood(frag, mm_cache);
   }
 
   if (lib.bias_table) {
@@ -171,9 +193,7 @@ double Target::est_effective_length(const LengthDistribution* fld,
   if (log_length < fld->mean()) {
     eff_len = log_length;
   } else {
-    for(size_t l = fld->min_val(); l <= min(length(), fld->max_val()); l++) {
-      eff_len = log_add(eff_len, fld->pmf(l)+log((double)length()-l+1));
-    }
+    eff_len = fld->effective_length(length());
   }
   
   if (with_bias) {
@@ -255,6 +275,7 @@ size_t HaplotypeHandler::find_target(const Target* targ) {
 }
 
 double HaplotypeHandler::get_mass(const Target* targ, bool with_pseudo) {
+  boost::unique_lock<boost::mutex> lock(_mut);
   commit_buffer();
   
   TargID i = find_target(targ);;
@@ -272,6 +293,7 @@ double HaplotypeHandler::get_mass(const Target* targ, bool with_pseudo) {
 
 void HaplotypeHandler::update_mass(const Target* targ, const string& frag_name,
                                    double align_likelihood, double mass) {
+  boost::unique_lock<boost::mutex> lock(_mut);
   if (frag_name != _frag_name_buff) {
     commit_buffer();
     _frag_name_buff = frag_name;
@@ -307,13 +329,80 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
   _targ_map = vector<Target*>(num_targs, NULL);
   _total_fpb = log(alpha*num_targs);
 
-  boost::unordered_set<string> target_names;
-      
-  ifstream infile (targ_fasta_file.c_str());
-  string line;
-  string seq = "";
-  string name = "";
-  if (infile.is_open()) {
+  TargetIndex index;
+  MappedFile fasta;
+  ifstream infile;
+  vector<TargetRecord> records;
+  BiasBoss* lib_bg_table = NULL;
+  if (lib.bias_table && !known_aux_params) {
+    lib_bg_table = lib.bias_table.get();
+  }
+  // The BiasBoss to measure the background expectations in, or NULL if they
+  // are not needed or are loaded from an index.
+  BiasBoss* bg_table = lib_bg_table;
+  bool mapped = true;
+  if (index.open(targ_fasta_file)) {
+    index_records(index, alpha, alpha_map, targ_index, targ_lengths, records);
+    // The stored expectations are summed over every target in the index, so
+    // they are only used if no targets were skipped.
+    if (bg_table && records.size() == index.size() &&
+        index.bias_order() == bg_table->order() &&
+        bg_table->deserialize_expectations(index.bias_data(),
+                                           index.bias_size())) {
+      bg_table = NULL;
+    }
+  } else if (fasta.open(targ_fasta_file)) {
+    index_fasta(fasta.data(), fasta.size(), alpha, alpha_map, targ_index,
+                targ_lengths, records);
+  } else {
+    // Fall back to stream input for pipes and special files.
+    infile.open(targ_fasta_file.c_str());
+    mapped = false;
+  }
+
+  if (mapped) {
+    // Construct the targets and measure their background expectations over
+    // contiguous ranges of records in parallel. No fragments are processed
+    // while loading, so all of the threads given by -p may be used.
+    size_t num_workers = max((size_t)1, min(max_threads, records.size()));
+    vector<boost::shared_ptr<BiasBoss> > worker_bg_tables;
+    boost::thread_group workers;
+    for (size_t k = 1; k < num_workers; ++k) {
+      BiasBoss* worker_bg_table = NULL;
+      if (bg_table) {
+        worker_bg_tables.push_back(boost::shared_ptr<BiasBoss>(
+            new BiasBoss(bg_table->order(), 0)));
+        worker_bg_table = worker_bg_tables.back().get();
+        worker_bg_table->clear_expectations();
+      }
+      workers.create_thread(boost::bind(&TargetTable::load_targs, this,
+                                        &records,
+                                        k * records.size() / num_workers,
+                                        (k + 1) * records.size() / num_workers,
+                                        prob_seqs, known_aux_params,
+                                        worker_bg_table));
+    }
+    load_targs(&records, 0, records.size() / num_workers, prob_seqs,
+               known_aux_params, bg_table);
+    workers.join_all();
+
+    foreach(const boost::shared_ptr<BiasBoss>& worker_bg_table,
+            worker_bg_tables) {
+      bg_table->merge_expectations(*worker_bg_table);
+    }
+    // Bundles are created in the order of the file, as when loading serially.
+    foreach(const TargetRecord& record, records) {
+      Target* targ = _targ_map[record.id];
+      targ->bundle(_bundle_table.create_bundle(targ));
+    }
+    if (lib_bg_table) {
+      lib_bg_table->normalize_expectations();
+    }
+  } else if (infile.is_open()) {
+    boost::unordered_set<string> target_names;
+    string line;
+    string seq = "";
+    string name = "";
     while (infile.good()) {
       getline(infile, line, '\n');
       if (line.empty()) {
@@ -450,7 +539,8 @@ void TargetTable::add_targ(const string& name, const string& seq, bool prob_seq,
   const LengthDistribution* known_fld = (known_aux_params) ? lib.fld.get()
                                                            : NULL;
   
-  Target* targ = new Target(it->second, name, seq, prob_seq, alpha, _libs,
+  Target* targ = new Target(it->second, name,
+                            SequenceFwd(seq, false, prob_seq), alpha, _libs,
                             known_bias_boss, known_fld);
   if (lib.bias_table && !known_aux_params) {
     (lib.bias_table)->update_expectations(*targ);
@@ -459,6 +549,140 @@ void TargetTable::add_targ(const string& name, const string& seq, bool prob_seq,
   targ->bundle(_bundle_table.create_bundle(targ));
 }
 
+void TargetTable::index_fasta(const char* data, size_t size, double alpha,
+                              const AlphaMap* alpha_map,
+                              const TransIndex& targ_index,
+                              const TransIndex& targ_lengths,
+                              vector<TargetRecord>& records) const {
+  boost::unordered_set<string> target_names;
+  const char* end = data + size;
+  const char* p = data;
+  while (p < end) {
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    if (!eol) {
+      eol = end;
+    }
+    if (*p != '>') {
+      p = eol + 1;
+      continue;
+    }
+    const char* name_end = (const char*)memchr(p, ' ', eol - p);
+    string name(p + 1, (name_end) ? name_end : eol);
+    if (target_names.count(name)) {
+      logger.severe("Target '%s' is duplicated in the input FASTA. Ensure "
+                    "target names are unique and re-map before re-running "
+                    "eXpress.", name.c_str());
+    }
+    target_names.insert(name);
+
+    // The sequence lines run until the next header.
+    TargetRecord record;
+    record.name = name;
+    record.seq_begin = min(eol + 1, end);
+    record.encoded = false;
+    record.length = 0;
+    p = record.seq_begin;
+    while (p < end && *p != '>') {
+      eol = (const char*)memchr(p, '\n', end - p);
+      if (!eol) {
+        eol = end;
+      }
+      record.length += eol - p;
+      p = eol + 1;
+    }
+    record.seq_end = min(p, end);
+
+    if (!name.empty() && validate_record(record, alpha, alpha_map, targ_index,
+                                         targ_lengths)) {
+      records.push_back(record);
+    }
+  }
+}
+
+void TargetTable::index_records(const TargetIndex& index, double alpha,
+                                const AlphaMap* alpha_map,
+                                const TransIndex& targ_index,
+                                const TransIndex& targ_lengths,
+                                vector<TargetRecord>& records) const {
+  records.reserve(index.size());
+  for (size_t i = 0; i < index.size(); ++i) {
+    TargetRecord record;
+    record.name = index.name(i);
+    record.length = index.length(i);
+    record.seq_begin = index.seq(i);
+    record.seq_end = record.seq_begin + (record.length + 3) / 4;
+    record.encoded = true;
+    if (validate_record(record, alpha, alpha_map, targ_index, targ_lengths)) {
+      records.push_back(record);
+    }
+  }
+}
+
+bool TargetTable::validate_record(TargetRecord& record, double alpha,
+                                  const AlphaMap* alpha_map,
+                                  const TransIndex& targ_index,
+                                  const TransIndex& targ_lengths) const {
+  const string& name = record.name;
+  if (alpha_map && !alpha_map->count(name)) {
+    logger.severe("Target '%s' is was not found in the prior parameter "
+                  "file.", name.c_str());
+  }
+  TransIndex::const_iterator it = targ_index.find(name);
+  if (it == targ_index.end()) {
+    logger.warn("Target '%s' exists in MultiFASTA but not alignment "
+                "(SAM/BAM) file.", name.c_str());
+    return false;
+  }
+  if (targ_lengths.find(name)->second != record.length) {
+    logger.severe("Target '%s' differs in length between MultiFASTA and "
+                  "alignment (SAM/BAM) files (%d  vs. %d).", name.c_str(),
+                  record.length, targ_lengths.find(name)->second);
+  }
+  record.id = it->second;
+  record.alpha = (alpha_map) ? alpha_map->find(name)->second : alpha;
+  return true;
+}
+
+void TargetTable::load_targs(const vector<TargetRecord>* records, size_t begin,
+                             size_t end, bool prob_seqs, bool known_aux_params,
+                             BiasBoss* bg_table) {
+  const Library& lib = _libs->curr_lib();
+  const BiasBoss* known_bias_boss = (known_aux_params) ? lib.bias_table.get()
+                                                       : NULL;
+  const LengthDistribution* known_fld = (known_aux_params) ? lib.fld.get()
+                                                           : NULL;
+  string seq;
+  for (size_t i = begin; i < end; ++i) {
+    const TargetRecord& record = (*records)[i];
+    Target* targ;
+    if (record.encoded) {
+      targ = new Target(record.id, record.name,
+                        SequenceFwd(record.seq_begin, record.length, prob_seqs),
+                        record.alpha, _libs, known_bias_boss, known_fld);
+    } else {
+      seq.clear();
+      seq.reserve(record.length);
+      const char* p = record.seq_begin;
+      while (p < record.seq_end) {
+        const char* eol = (const char*)memchr(p, '\n', record.seq_end - p);
+        if (!eol) {
+          eol = record.seq_end;
+        }
+        seq.append(p, eol);
+        p = eol + 1;
+      }
+      targ = new Target(record.id, record.name,
+                        SequenceFwd(seq, false, prob_seqs), record.alpha,
+                        _libs, known_bias_boss, known_fld);
+    }
+    if (bg_table) {
+      bg_table->update_expectations(*targ);
+    }
+    // Each thread writes a distinct set of ids, so no lock is needed.
+    _targ_map[targ->id()] = targ;
+  }
+}
+
 Target* TargetTable::get_targ(TargID id) {
     return _targ_map[id];
 }
@@ -831,21 +1055,70 @@ void TargetTable::output_results(string output_dir, size_t tot_counts,
 }
 
 double TargetTable::total_fpb() const {
-  boost::unique_lock<boost::mutex>(_fpb_mut);
-  return _total_fpb;
+  return _total_fpb.load();
 }
 
 void TargetTable::update_total_fpb(double incr_amt) {
-  boost::unique_lock<boost::mutex>(_fpb_mut);
-  _total_fpb = log_add(_total_fpb, incr_amt);
+  atomic_log_add(_total_fpb, incr_amt);
+}
+
+/**
+ * The (logged) factor by which the abundance (rho) of a target without new mass
+ * must change before its bias parameters and effective length are refreshed.
+ */
+const double BIAS_REFRESH_RHO_TOL = log(1.1);
+/**
+ * The number of targets whose refreshed bias parameters are swapped in at a
+ * time, between which processing may continue.
+ */
+const size_t BIAS_SWAP_SHARD_SIZE = 1024;
+
+void TargetTable::refresh_bias_buffers(size_t begin, size_t end,
+                                       const BiasBoss* bias_table,
+                                       const LengthDistribution* fld,
+                                       const vector<double>* fl_cdf,
+                                       bool full_refresh, BiasBoss* bg_table,
+                                       vector<Target*>* dirty) {
+  for (size_t id = begin; id < end; ++id) {
+    Target* targ = _targ_map[id];
+    targ->lock();
+    double mass = targ->mass(false);
+    double rho = targ->rho();
+    if (full_refresh || mass != _refresh_mass[id] ||
+        (rho != _refresh_rho[id] &&
+         !approx_eq(rho, _refresh_rho[id], BIAS_REFRESH_RHO_TOL))) {
+      targ->update_target_bias_buffer(bias_table, fld);
+      _refresh_mass[id] = mass;
+      _refresh_rho[id] = rho;
+      dirty->push_back(targ);
+    }
+    if (bg_table) {
+      bg_table->update_expectations(*targ, rho, *fl_cdf);
+    }
+    targ->unlock();
+  }
 }
 
-void TargetTable::asynch_bias_update(boost::mutex* mutex) {
+void TargetTable::asynch_bias_update(boost::shared_mutex* mutex) {
   BiasBoss* bg_table = NULL;
   boost::scoped_ptr<BiasBoss> bias_table;
   boost::scoped_ptr<LengthDistribution> fld;
 
   bool burned_out_before = false;
+  // Refresh every target on the first pass and once burned out, so that the
+  // final parameters are used for all targets.
+  bool full_refresh = true;
+
+  _refresh_mass.assign(_targ_map.size(), LOG_0);
+  _refresh_rho.assign(_targ_map.size(), LOG_0);
+
+  // The targets are split into contiguous ranges, one per thread. The first
+  // range is handled by this thread and the others accumulate their background
+  // expectations in private tables.
+  size_t num_workers = max((size_t)1, min(aux_param_threads,
+                                          _targ_map.size()));
+  vector<vector<Target*> > dirty(num_workers);
+  vector<boost::shared_ptr<BiasBoss> > worker_bg_tables;
 
   const Library& lib = _libs->curr_lib();
 
@@ -854,7 +1127,7 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
       bg_table->normalize_expectations();
     }
     {
-      boost::unique_lock<boost::mutex> lock(*mutex);
+      boost::unique_lock<boost::shared_mutex> lock(*mutex);
       if(!fld) {
         fld.reset(new LengthDistribution(*(lib.fld)));
       } else {
@@ -870,6 +1143,12 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
           bias_table.reset(bg_table);
         }
         bg_table = new BiasBoss(lib_bias_table.order(), 0);
+        if (worker_bg_tables.empty()) {
+          for (size_t k = 1; k < num_workers; ++k) {
+            worker_bg_tables.push_back(boost::shared_ptr<BiasBoss>(
+                new BiasBoss(lib_bias_table.order(), 0)));
+          }
+        }
       }
       logger.info("Synchronized auxiliary parameter tables.");
     }
@@ -878,28 +1157,56 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
       break;
     }
 
+    full_refresh |= (burned_out && !burned_out_before);
     burned_out_before = burned_out;
 
-    vector<double> fl_cdf = fld->cmf();
-
-    // Buffer results of long computations.
-    foreach(Target* targ, _targ_map) {
-      targ->lock();
-      targ->update_target_bias_buffer(bias_table.get(), fld.get());
-      if (bg_table) {
-        bg_table->update_expectations(*targ, targ->rho(), fl_cdf);
+    const vector<double>& fl_cdf = fld->cmf();
+
+    // Buffer results of long computations for the targets that have gained
+    // mass or whose abundance has changed. The background expectations are a
+    // sum over all targets, so they are still recomputed for each.
+    boost::thread_group workers;
+    for (size_t k = 0; k < num_workers; ++k) {
+      size_t begin = k * _targ_map.size() / num_workers;
+      size_t end = (k + 1) * _targ_map.size() / num_workers;
+      BiasBoss* worker_bg_table = NULL;
+      if (bg_table && k) {
+        worker_bg_table = worker_bg_tables[k-1].get();
+        worker_bg_table->clear_expectations();
+      } else if (bg_table) {
+        worker_bg_table = bg_table;
+      }
+      dirty[k].clear();
+      if (k) {
+        workers.create_thread(boost::bind(&TargetTable::refresh_bias_buffers,
+                                          this, begin, end, bias_table.get(),
+                                          fld.get(), &fl_cdf, full_refresh,
+                                          worker_bg_table, &dirty[k]));
+      } else {
+        refresh_bias_buffers(begin, end, bias_table.get(), fld.get(), &fl_cdf,
+                             full_refresh, worker_bg_table, &dirty[k]);
       }
-      targ->unlock();
     }
-    {
-      boost::unique_lock<boost::mutex> lock(*mutex);
-      // Do quick atomic swap
-      foreach(Target* targ, _targ_map) {
-        targ->lock();
+    workers.join_all();
+    if (bg_table) {
+      foreach(const boost::shared_ptr<BiasBoss>& worker_bg_table,
+              worker_bg_tables) {
+        bg_table->merge_expectations(*worker_bg_table);
       }
-      foreach(Target* targ, _targ_map) {
-        targ->swap_bias_parameters();
-        targ->unlock();
+    }
+    full_refresh = false;
+
+    // Swap in the buffers a shard at a time, so that processing is only
+    // blocked briefly.
+    foreach(const vector<Target*>& worker_dirty, dirty) {
+      for (size_t i = 0; i < worker_dirty.size(); i += BIAS_SWAP_SHARD_SIZE) {
+        boost::unique_lock<boost::shared_mutex> lock(*mutex);
+        size_t end = min(worker_dirty.size(), i + BIAS_SWAP_SHARD_SIZE);
+        for (size_t j = i; j < end; ++j) {
+          worker_dirty[j]->lock();
+          worker_dirty[j]->swap_bias_parameters();
+          worker_dirty[j]->unlock();
+        }
       }
     }
   }
@@ -9,6 +9,7 @@
 #ifndef TRANSCRIPTS_H
 #define TRANSCRIPTS_H
 
+#include <boost/atomic.hpp>
 #include <boost/scoped_ptr.hpp>
 #include "boost/shared_ptr.hpp"
 #include <boost/thread.hpp>
@@ -26,42 +27,46 @@ class LengthDistribution;
 class FragHit;
 class BiasBoss;
 class MismatchTable;
+class MismatchCache;
+class TargetIndex;
 class Librarian;
 class HaplotypeHandler;
 class TargetTable;
 
 /**
  * The RoundParams struct stores the target parameters unique to a given round
- * (iteration) of EM.
+ * (iteration) of EM. The masses are atomic so that they can be updated without
+ * holding the target mutex.
  * @author    Adam Roberts
  * @date      2012
  * @copyright Artistic License 2.0
  **/
 struct RoundParams {
   /**
-   * A public double that stores the (logged) assigned mass based on observed
-   * fragment mapping probabilities.
+   * A public atomic double that stores the (logged) assigned mass based on
+   * observed fragment mapping probabilities.
    */
-  double mass;
+  boost::atomic<double> mass;
   /**
-   * A public double that stores the (logged) assigned ambiguous mass based on
-   * observed fragment mapping probabilities.
+   * A public atomic double that stores the (logged) assigned ambiguous mass
+   * based on observed fragment mapping probabilities.
    */
-  double ambig_mass;
+  boost::atomic<double> ambig_mass;
   /**
-   * A public double that stores the (logged) total mass of ambiguous fragments
-   * mapping to the target.
+   * A public atomic double that stores the (logged) total mass of ambiguous
+   * fragments mapping to the target.
    */
-  double tot_ambig_mass;
+  boost::atomic<double> tot_ambig_mass;
   /**
-   * A public double that stores the (logged) variance due to uncertainty on p.
+   * A public atomic double that stores the (logged) variance due to
+   * uncertainty on p.
    */
-  double mass_var;
+  boost::atomic<double> mass_var;
   /**
-   * A public double that stores the (logged) weighted sum of the variance on
-   * the assignments.
+   * A public atomic double that stores the (logged) weighted sum of the
+   * variance on the assignments.
    */
-  double var_sum;
+  boost::atomic<double> var_sum;
   /***
    * A shared pointer to the target's HaplotypeHandler.  Null if target has no
    * haplotype partner.
@@ -72,6 +77,27 @@ struct RoundParams {
    */
   RoundParams() : mass(LOG_0), ambig_mass(LOG_0), tot_ambig_mass(LOG_0),
                   mass_var(LOG_0), var_sum(LOG_0) {}
+  /**
+   * RoundParams copy constructor. Not safe to call during concurrent updates.
+   */
+  RoundParams(const RoundParams& other)
+      : mass(other.mass.load()), ambig_mass(other.ambig_mass.load()),
+        tot_ambig_mass(other.tot_ambig_mass.load()),
+        mass_var(other.mass_var.load()), var_sum(other.var_sum.load()),
+        haplotype(other.haplotype) {}
+  /**
+   * RoundParams assignment operator. Not safe to call during concurrent
+   * updates.
+   */
+  RoundParams& operator=(const RoundParams& other) {
+    mass.store(other.mass.load());
+    ambig_mass.store(other.ambig_mass.load());
+    tot_ambig_mass.store(other.tot_ambig_mass.load());
+    mass_var.store(other.mass_var.load());
+    var_sum.store(other.var_sum.load());
+    haplotype = other.haplotype;
+    return *this;
+  }
 };
 
 typedef size_t TargID;
@@ -131,16 +157,16 @@ class Target {
    */
   RoundParams* _ret_params;
   /**
-   * A private size_t that stores the number of fragments (non-logged)
+   * A private atomic size_t that stores the number of fragments (non-logged)
    * uniquely mapping to this target.
    */
-  size_t _uniq_counts;
+  boost::atomic<size_t> _uniq_counts;
   /**
-   * A private size_t that stores the fragment counts (non-logged) for the
-   * bundle. The total bundle counts is the sum of this value for all targets
-   * in the bundle.
+   * A private atomic size_t that stores the fragment counts (non-logged) for
+   * the bundle. The total bundle counts is the sum of this value for all
+   * targets in the bundle.
    */
-  size_t _tot_counts;
+  boost::atomic<size_t> _tot_counts;
   /**
    * A private double storing the initial pseudo mass assigned to the target.
    */
@@ -191,20 +217,20 @@ class Target {
    */
   double _cached_eff_len_buffer;
   /**
-   * A private boolean specifying whether a unique solution exists. True iff
-   * a unique read is mapped to the target or all other targets in a mapping
-   * are solvable.
+   * A private atomic boolean specifying whether a unique solution exists. True
+   * iff a unique read is mapped to the target or all other targets in a
+   * mapping are solvable.
    */
-  bool _solvable;
+  boost::atomic<bool> _solvable;
 
 public:
   /**
    * Target Constructor.
    * @param id a unique TargID identifier.
    * @param name a string that stores the target name.
-   * @param seq a string that stores the target sequence.
-   * @param prob_seq a bool that specifies if the sequence is to be treated
-   *        probablistically. For RDD detection.
+   * @param seq the encoded target sequence, which is copied. It is
+   *        probabilistic if the sequence is to be treated probabilistically,
+   *        for RDD detection.
    * @param alpha a double that specifies the intial pseudo-counts
    *        (non-logged).
    * @param libs a pointer to the struct containing pointers to the global
@@ -214,12 +240,13 @@ public:
    * @param known_fld a pointer to a fragment length distribution provided as
    *        input, NULL if none given.
    */
-  Target(TargID id, const std::string& name, const std::string& seq,
-         bool prob_seq, double alpha, const Librarian* libs,
+  Target(TargID id, const std::string& name, const SequenceFwd& seq,
+         double alpha, const Librarian* libs,
          const BiasBoss* known_bias_boss, const LengthDistribution* known_fld);
   /**
    * A member function that locks the target mutex to provide thread safety.
-   * The lock should be held by any thread that calls a method of the Target.
+   * The lock should be held by any thread that calls a method of the Target,
+   * unless the masses are only read and updated with add_hit.
    */
   void lock() const { _mutex.lock(); }
   /**
@@ -317,13 +344,13 @@ public:
    * either uniquely or ambiguously.
    * @return The total fragment count.
    */
-  size_t tot_counts() const { return _tot_counts; }
+  size_t tot_counts() const { return _tot_counts.load(); }
   /**
    * An accessor for the the current count of fragments uniquely mapped to this
    * target.
    * @return The unique fragment count.
    */
-  size_t uniq_counts() const { return _uniq_counts; }
+  size_t uniq_counts() const { return _uniq_counts.load(); }
   /**
    * An accessor for the pointer to the Bundle this Target is a member of.
    * @return A pointer to the Bundle this target is a member of.
@@ -336,7 +363,8 @@ public:
   void bundle(Bundle* b) { _bundle = b; }
   /**
    * A member function that increases the expected fragment counts and
-   * variance based on the assignment parameters of the given FagHit.
+   * variance based on the assignment parameters of the given FagHit. The
+   * masses are updated atomically, so the target mutex need not be held.
    * @param h the FragHit that is being added.
    * @param v a double for the (logged) approximate variance (uncertainty) on
    *        the probability p.
@@ -353,10 +381,10 @@ public:
    */
   void incr_counts(bool uniq, size_t incr_amt = 1) {
     if (uniq) {
-      _solvable = true;
+      _solvable.store(true, boost::memory_order_relaxed);
     }
-    _tot_counts += incr_amt;
-    _uniq_counts += incr_amt * uniq;
+    _tot_counts.fetch_add(incr_amt, boost::memory_order_relaxed);
+    _uniq_counts.fetch_add(incr_amt * uniq, boost::memory_order_relaxed);
   }
   /**
    * A member function that returns (a value proportional to) the probability
@@ -375,8 +403,11 @@ public:
    * A member function that returns (a value proportional to) the log likelihood
    * the given fragment has the given alignment.
    * @param frag a FragHit alignment to return the likelihood of.
+   * @param mm_cache optional pointer to a cache of the error model likelihoods
+   *        of the other alignments of the fragment.
    */
-  double align_likelihood(const FragHit& frag) const;
+  double align_likelihood(const FragHit& frag,
+                          MismatchCache* mm_cache = NULL) const;
   /**
    * A member function that calculates and returns the estimated effective
    * length of the target (logged) using the average bias.
@@ -419,13 +450,13 @@ public:
    *         solution for its abundance estimate.
    */
 
-  bool solvable() const { return _solvable; }
+  bool solvable() const { return _solvable.load(); }
   /**
    * A mutator that sets the _solvable flag.
    * @param a boolean specifying whether or not the target has a unique solution
    *        for its abundance estimate.
    */
-  void solvable(bool s) { _solvable = s; }
+  void solvable(bool s) { _solvable.store(s); }
 };
 
 /**
@@ -474,6 +505,11 @@ class HaplotypeHandler {
    * within the set.
    */
   bool _committed;
+  /**
+   * A private mutex protecting the buffers, which are shared by the targets in
+   * the set.
+   */
+  boost::mutex _mut;
   /**
    * Looks up the index of the given target pointer in _targets. Dies if not
    * found.
@@ -505,7 +541,6 @@ class HaplotypeHandler {
 
 typedef std::vector<Target*> TransMap;
 typedef boost::unordered_map<std::string, size_t> TransIndex;
-typedef boost::unordered_map<size_t, float> CovarMap;
 typedef boost::unordered_map<std::string, double> AlphaMap;
 typedef boost::unordered_set<std::vector<Target*> > HaplotypeSet;
 
@@ -543,14 +578,60 @@ class TargetTable {
    */
   HaplotypeSet _haplotype_groups;
   /**
-   * A private double that stores the (logged) total mass per base
+   * A private atomic double that stores the (logged) total mass per base
    * (including pseudo-counts) to allow for rho calculations.
    */
-  double _total_fpb;
+  boost::atomic<double> _total_fpb;
+  /**
+   * A private vector storing the (logged) mass of each target when its bias
+   * parameters were last refreshed by asynch_bias_update.
+   */
+  std::vector<double> _refresh_mass;
   /**
-   * A private mutex to make accesses to _total_fpb thread-safe.
+   * A private vector storing the (logged) rho of each target when its bias
+   * parameters were last refreshed by asynch_bias_update.
    */
-  mutable boost::mutex _fpb_mut;
+  std::vector<double> _refresh_rho;
+
+  /**
+   * The TargetRecord struct stores the location and validated metadata of a
+   * target sequence in a memory-mapped MultiFASTA or index file, so that the
+   * Target can be constructed on a separate thread.
+   */
+  struct TargetRecord {
+    /**
+     * A public string storing the name of the target.
+     */
+    std::string name;
+    /**
+     * A public pointer to the first byte of the sequence in the mapped file.
+     * This is either the (possibly multi-line) text of a MultiFASTA record or
+     * an encoded sequence produced by Sequence::serialize.
+     */
+    const char* seq_begin;
+    /**
+     * A public pointer to one past the last byte of the sequence in the mapped
+     * file.
+     */
+    const char* seq_end;
+    /**
+     * A public bool that is true iff the sequence is encoded.
+     */
+    bool encoded;
+    /**
+     * A public size_t storing the number of nucleotides in the sequence.
+     */
+    size_t length;
+    /**
+     * A public TargID storing the id of the target in the alignment file.
+     */
+    TargID id;
+    /**
+     * A public double storing the initial pseudo-counts for each bp of the
+     * target (non-logged).
+     */
+    double alpha;
+  };
 
   /**
    * A private function that validates and adds a target pointer to the table.
@@ -569,12 +650,107 @@ class TargetTable {
   void add_targ(const std::string& name, const std::string& seq, bool prob_seqs,
                 bool known_aux_params, double alpha,
                 const TransIndex& targ_index, const TransIndex& targ_lengths);
+  /**
+   * A private function that validates a target as add_targ does, filling in
+   * its id and pseudo-counts.
+   * @param record the record of the target, with its name and length set.
+   * @param alpha a double that specifies the initial pseudo-counts for each bp
+   *        of the targets (non-logged).
+   * @param alpha_map an optional pointer to a map object that specifies
+   *        proportional weights of pseudo-counts for each target.
+   * @param targ_index the target-to-index map from the alignment file.
+   * @param targ_lengths the target-to-length map from the alignment file, for
+   *        validation.
+   * @return True iff the target is also in the alignment file and should be
+   *         loaded.
+   */
+  bool validate_record(TargetRecord& record, double alpha,
+                       const AlphaMap* alpha_map, const TransIndex& targ_index,
+                       const TransIndex& targ_lengths) const;
+  /**
+   * A private function that fills in the records of the targets in an index
+   * file written by TargetIndex, validating each target as add_targ does.
+   * @param index the opened TargetIndex.
+   * @param alpha a double that specifies the initial pseudo-counts for each bp
+   *        of the targets (non-logged).
+   * @param alpha_map an optional pointer to a map object that specifies
+   *        proportional weights of pseudo-counts for each target.
+   * @param targ_index the target-to-index map from the alignment file.
+   * @param targ_lengths the target-to-length map from the alignment file, for
+   *        validation.
+   * @param records a reference to an empty vector to fill with a record for
+   *        each target also in the alignment file, in the order they appear.
+   */
+  void index_records(const TargetIndex& index, double alpha,
+                     const AlphaMap* alpha_map, const TransIndex& targ_index,
+                     const TransIndex& targ_lengths,
+                     std::vector<TargetRecord>& records) const;
+  /**
+   * A private function that indexes the records of a memory-mapped MultiFASTA
+   * file, validating each target as add_targ does.
+   * @param data a pointer to the first byte of the mapped file.
+   * @param size the size of the mapped file in bytes.
+   * @param alpha a double that specifies the initial pseudo-counts for each bp
+   *        of the targets (non-logged).
+   * @param alpha_map an optional pointer to a map object that specifies
+   *        proportional weights of pseudo-counts for each target.
+   * @param targ_index the target-to-index map from the alignment file.
+   * @param targ_lengths the target-to-length map from the alignment file, for
+   *        validation.
+   * @param records a reference to an empty vector to fill with a record for
+   *        each target also in the alignment file, in the order they appear.
+   */
+  void index_fasta(const char* data, size_t size, double alpha,
+                   const AlphaMap* alpha_map, const TransIndex& targ_index,
+                   const TransIndex& targ_lengths,
+                   std::vector<TargetRecord>& records) const;
+  /**
+   * A private function run by the constructor (possibly on several threads
+   * over disjoint ranges) that constructs the Targets for a range of
+   * records, stores them in the table, and adds their expectations to a
+   * background BiasBoss.
+   * @param records pointer to the target records.
+   * @param begin the index of the first record in the range.
+   * @param end one past the index of the last record in the range.
+   * @param prob_seqs a bool that specifies if the sequence is to be treated
+   *        probablistically, for RDD detection.
+   * @param known_aux_params a bool that is true iff the auxiliary parameters
+   *        (fld, bias) are provided and need not be learned.
+   * @param bg_table pointer to the BiasBoss in which to accumulate the
+   *        background expectations, or NULL if not used.
+   */
+  void load_targs(const std::vector<TargetRecord>* records, size_t begin,
+                  size_t end, bool prob_seqs, bool known_aux_params,
+                  BiasBoss* bg_table);
+  /**
+   * A private function run by asynch_bias_update (possibly on several threads
+   * over disjoint ranges) that buffers new bias parameters and effective
+   * lengths for the targets in a range that have changed since they were last
+   * refreshed, and adds the expectations of all targets in the range to a
+   * background BiasBoss.
+   * @param begin the id of the first target in the range.
+   * @param end one past the id of the last target in the range.
+   * @param bias_table pointer to the bias parameters, or NULL if not used.
+   * @param fld pointer to the fragment length distribution.
+   * @param fl_cdf the cumulative fragment length distribution.
+   * @param full_refresh a bool that is true iff every target in the range
+   *        should be refreshed.
+   * @param bg_table pointer to the BiasBoss in which to accumulate the
+   *        background expectations, or NULL if not used.
+   * @param dirty pointer to a vector to which the refreshed targets are added.
+   */
+  void refresh_bias_buffers(size_t begin, size_t end,
+                            const BiasBoss* bias_table,
+                            const LengthDistribution* fld,
+                            const std::vector<double>* fl_cdf,
+                            bool full_refresh, BiasBoss* bg_table,
+                            std::vector<Target*>* dirty);
 
 public:
   /**
    * TargetTable Constructor.
-   * @param targ_fasta_file a string storing the path to the fasta file from
-   *        which to load targets.
+   * @param targ_fasta_file a string storing the path to the fasta file, or an
+   *        index of it written by TargetIndex, from which to load targets.
    * @param haplotype_file a string storing the path to the haplotype file
    *        containing comma-separated target pairs to be considered alternative
    *        haplotypes (optional).
@@ -631,9 +807,16 @@ public:
    * @param targ2 the other target in the pair
    * @param covar a double specifying the amount to increase the pair's
    *        covariance by (logged)
-   */
-  void update_covar(TargID targ1, TargID targ2, double covar) {
-    _covar_table.increment(targ1, targ2, covar);
+   * @param buffer optional pointer to a thread-local buffer to accumulate the
+   *        update in, rather than adding it to the table directly.
+   */
+  void update_covar(TargID targ1, TargID targ2, double covar,
+                    CovarBuffer* buffer=NULL) {
+    if (buffer) {
+      buffer->increment(_covar_table, targ1, targ2, covar);
+    } else {
+      _covar_table.increment(targ1, targ2, covar);
+    }
   }
   /**
    * An accessor for the covariance between two targets. These returned value
@@ -683,10 +866,13 @@ public:
   /**
    * A member function to be run asynchronously that continuously updates the
    * background bias values, target bias values, and target effective lengths.
+   * After the first pass, the bias values and effective lengths are only
+   * refreshed for targets that have gained mass or whose abundance has changed.
+   * The targets are split between aux_param_threads threads.
    * @param mutex a pointer to the mutex to be used to protect the global fld
    *        and bias tables during updates.
    */
-  void asynch_bias_update(boost::mutex* mutex);
+  void asynch_bias_update(boost::shared_mutex* mutex);
   void enable_bundle_threadsafety() { _bundle_table.threadsafe_mode(true); }
   void disable_bundle_threadsafety() { _bundle_table.threadsafe_mode(false); }
   /**
@@ -9,46 +9,6 @@
 #include "threadsafety.h"
 #include "fragments.h"
 
-ThreadSafeFragQueue::ThreadSafeFragQueue(size_t max_size)
-    : _max_size(max_size) {
-}
-
-Fragment* ThreadSafeFragQueue::pop(bool block) {
-  boost::unique_lock<boost::mutex> lock(_mut);
-  while (_queue.empty()) {
-    if (!block) {
-            return NULL;
-    }
-        _cond.wait(lock);
-  }
-
-  _cond.notify_all();
-  Fragment* res = _queue.front();
-  _queue.pop();
-  return res;
-}
-
-void ThreadSafeFragQueue::push(Fragment* frag) {
-  boost::unique_lock<boost::mutex> lock(_mut);
-  while (_queue.size() == _max_size) {
-    _cond.wait(lock);
-  }
-
-  _cond.notify_all();
-  return _queue.push(frag);
-}
-
-bool ThreadSafeFragQueue::is_empty(bool block) {
-  boost::unique_lock<boost::mutex> lock(_mut);
-  while (!_queue.empty()) {
-    if (!block) {
-      return false;
-    }
-    _cond.wait(lock);
-  }
-  return true;
-}
-
 ThreadSafeInvalidQueue::ThreadSafeInvalidQueue(size_t max_size)
     : _max_size(max_size) {
 }
@@ -70,7 +30,7 @@ ReadHit* ThreadSafeInvalidQueue::pop(bool block) {
 
 void ThreadSafeInvalidQueue::push(ReadHit* frag) {
   boost::unique_lock<boost::mutex> lock(_mut);
-  while (_queue.size() == _max_size) {
+  while (_max_size && _queue.size() == _max_size) {
     _cond.wait(lock);
   }
 
@@ -9,71 +9,506 @@
 #ifndef express_thread_safety_h
 #define express_thread_safety_h
 
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
+#include <cstddef>
 #include <queue>
+#include <vector>
 
 class Fragment;
 class ReadHit;
 
 /**
- * The ThreadSafeFragQueue is a threadsafe queue of Fragment pointers.
- *  @author    Adam Roberts
- *  @date      2012
+ * The number of times a blocked push or pop retries before yielding the
+ * processor.
+ */
+const size_t QUEUE_SPIN_TRIES = 64;
+/**
+ * The number of times a blocked push or pop yields the processor before
+ * parking on a condition variable.
+ */
+const size_t QUEUE_YIELD_TRIES = 64;
+/**
+ * The assumed size of a cache line in bytes, used to pad the positions of the
+ * ring buffers onto separate lines.
+ */
+const size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * Helper function that returns the smallest power of two that is at least the
+ * given value.
+ * @param n the value to round up.
+ * @return The smallest power of two >= n.
+ */
+inline size_t next_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+/**
+ * The MPMCRing class is a bounded lock-free ring buffer that may be pushed to
+ * and popped from by any number of threads. Each cell carries a sequence number
+ * that tells producers and consumers whether it is free for the current lap of
+ * the buffer, so that claiming a cell takes a single compare-and-swap.
  *  @copyright Artistic License 2.0
  **/
-class ThreadSafeFragQueue {
+template <typename T>
+class MPMCRing {
   /**
-   * A private queue of Fragment objects.
+   * The Cell struct stores a value along with its sequence number.
    */
-  std::queue<Fragment*> _queue;
+  struct Cell {
+    boost::atomic<size_t> seq;
+    T val;
+  };
   /**
-   * A private size_t representing the number of Fragments allowed in the queue
-   * before blocking on a push.
+   * A private array of cells, with a size that is a power of two.
    */
-  size_t _max_size;
+  boost::scoped_array<Cell> _cells;
   /**
-   * A private mutex used to provide thread-safety and used in association with
-   * _cond to provide blocking behavior.
+   * A private size_t for the mask used to index _cells by position.
    */
-  boost::mutex _mut;
+  size_t _mask;
+  char _pad0[CACHE_LINE_SIZE];
   /**
-   * A private condition variable used with _mut for blocking when queue is
-   * empty on pop or full on push.
+   * A private atomic size_t for the position of the next push.
    */
-  boost::condition_variable _cond;
+  boost::atomic<size_t> _push_pos;
+  char _pad1[CACHE_LINE_SIZE];
+  /**
+   * A private atomic size_t for the position of the next pop.
+   */
+  boost::atomic<size_t> _pop_pos;
+  char _pad2[CACHE_LINE_SIZE];
 
  public:
   /**
-   * ThreadSafeFragQueue Constructor.
-   * @param max_size a size_t representing the number of Fragments allowed in
+   * MPMCRing constructor.
+   * @param min_size the minimum number of values the buffer must hold. Rounded
+   *        up to a power of two.
+   */
+  MPMCRing(size_t min_size)
+      : _cells(new Cell[next_pow2(std::max(min_size, (size_t)2))]),
+        _mask(next_pow2(std::max(min_size, (size_t)2)) - 1),
+        _push_pos(0),
+        _pop_pos(0) {
+    for (size_t i = 0; i <= _mask; ++i) {
+      _cells[i].seq.store(i, boost::memory_order_relaxed);
+    }
+  }
+  /**
+   * A member function that pushes a value if the buffer is not full.
+   * @param val the value to push.
+   * @return True iff the value was pushed.
+   */
+  bool try_push(const T& val) {
+    size_t pos = _push_pos.load(boost::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &_cells[pos & _mask];
+      size_t seq = cell->seq.load(boost::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+      if (diff == 0) {
+        if (_push_pos.compare_exchange_weak(pos, pos + 1,
+                                            boost::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _push_pos.load(boost::memory_order_relaxed);
+      }
+    }
+    cell->val = val;
+    cell->seq.store(pos + 1, boost::memory_order_release);
+    return true;
+  }
+  /**
+   * A member function that pops a value if the buffer is not empty.
+   * @param val a reference set to the popped value.
+   * @return True iff a value was popped.
+   */
+  bool try_pop(T& val) {
+    size_t pos = _pop_pos.load(boost::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &_cells[pos & _mask];
+      size_t seq = cell->seq.load(boost::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+      if (diff == 0) {
+        if (_pop_pos.compare_exchange_weak(pos, pos + 1,
+                                           boost::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _pop_pos.load(boost::memory_order_relaxed);
+      }
+    }
+    val = cell->val;
+    cell->seq.store(pos + _mask + 1, boost::memory_order_release);
+    return true;
+  }
+  /**
+   * A member function that returns true iff the buffer appears empty. The
+   * result may be stale if other threads are pushing or popping.
+   * @return True iff the buffer is empty.
+   */
+  bool empty() const {
+    return _pop_pos.load(boost::memory_order_acquire) ==
+           _push_pos.load(boost::memory_order_acquire);
+  }
+};
 
-   *        the queue before blocking on a push.
+/**
+ * The SPSCRing class is a bounded lock-free ring buffer that may be pushed to by
+ * a single thread and popped from by a single (possibly different) thread.
+ *  @copyright Artistic License 2.0
+ **/
+template <typename T>
+class SPSCRing {
+  /**
+   * A private array of values, with a size that is a power of two.
    */
-  ThreadSafeFragQueue(size_t max_size);
+  boost::scoped_array<T> _vals;
   /**
-   * A member function that pops the next Fragment pointer off the queue. If
-   * the queue is empty, returns NULL if block is false, otherwise blocks until
-   * one is available.
+   * A private size_t for the mask used to index _vals by position.
+   */
+  size_t _mask;
+  char _pad0[CACHE_LINE_SIZE];
+  /**
+   * A private atomic size_t for the position of the next push, only written by
+   * the producer.
+   */
+  boost::atomic<size_t> _push_pos;
+  char _pad1[CACHE_LINE_SIZE];
+  /**
+   * A private atomic size_t for the position of the next pop, only written by
+   * the consumer.
+   */
+  boost::atomic<size_t> _pop_pos;
+  char _pad2[CACHE_LINE_SIZE];
+
+ public:
+  /**
+   * SPSCRing constructor.
+   * @param min_size the minimum number of values the buffer must hold. Rounded
+   *        up to a power of two.
+   */
+  SPSCRing(size_t min_size)
+      : _vals(new T[next_pow2(std::max(min_size, (size_t)1))]),
+        _mask(next_pow2(std::max(min_size, (size_t)1)) - 1),
+        _push_pos(0),
+        _pop_pos(0) {
+  }
+  /**
+   * A member function that pushes a value if the buffer is not full. Must only
+   * be called by the producer thread.
+   * @param val the value to push.
+   * @return True iff the value was pushed.
+   */
+  bool try_push(const T& val) {
+    size_t pos = _push_pos.load(boost::memory_order_relaxed);
+    if (pos - _pop_pos.load(boost::memory_order_acquire) > _mask) {
+      return false;
+    }
+    _vals[pos & _mask] = val;
+    _push_pos.store(pos + 1, boost::memory_order_release);
+    return true;
+  }
+  /**
+   * A member function that pops a value if the buffer is not empty. Must only
+   * be called by the consumer thread.
+   * @param val a reference set to the popped value.
+   * @return True iff a value was popped.
+   */
+  bool try_pop(T& val) {
+    size_t pos = _pop_pos.load(boost::memory_order_relaxed);
+    if (pos == _push_pos.load(boost::memory_order_acquire)) {
+      return false;
+    }
+    val = _vals[pos & _mask];
+    _pop_pos.store(pos + 1, boost::memory_order_release);
+    return true;
+  }
+  /**
+   * A member function that returns true iff the buffer appears empty. The
+   * result may be stale if other threads are pushing or popping.
+   * @return True iff the buffer is empty.
+   */
+  bool empty() const {
+    return _pop_pos.load(boost::memory_order_acquire) ==
+           _push_pos.load(boost::memory_order_acquire);
+  }
+};
+
+/**
+ * The ThreadSafeQueue class is a blocking queue of pointers built on a
+ * lock-free ring buffer (MPMCRing or SPSCRing). A push or pop that cannot
+ * complete immediately first retries, then yields the processor, and finally
+ * parks on a condition variable. The mutex is only taken by parked threads and
+ * by those waking them, so it is not touched while the queue keeps flowing.
+ *  @copyright Artistic License 2.0
+ **/
+template <typename T, class Ring>
+class ThreadSafeQueue {
+  /**
+   * A private lock-free ring buffer storing the queued values.
+   */
+  Ring _ring;
+  /**
+   * A private mutex used with the condition variables to park blocked threads.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable signalled when a value is pushed while
+   * threads are parked in pop.
+   */
+  boost::condition_variable _not_empty;
+  /**
+   * A private condition variable signalled when a value is popped while
+   * threads are parked in push.
+   */
+  boost::condition_variable _not_full;
+  /**
+   * A private atomic size_t for the number of threads parked in pop.
+   */
+  boost::atomic<size_t> _pop_waiters;
+  /**
+   * A private atomic size_t for the number of threads parked in push.
+   */
+  boost::atomic<size_t> _push_waiters;
+
+  /**
+   * A private member function that wakes one thread parked on the given
+   * condition variable, if there are any. Called after a push or pop
+   * completes, so that either a parking thread sees the completed operation
+   * when it rechecks the ring, or this sees it waiting.
+   * @param waiters the number of threads parked on cond.
+   * @param cond the condition variable to signal.
+   */
+  void wake(boost::atomic<size_t>& waiters, boost::condition_variable& cond) {
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (waiters.load(boost::memory_order_relaxed)) {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      cond.notify_one();
+    }
+  }
+
+ public:
+  /**
+   * ThreadSafeQueue constructor.
+   * @param max_size a size_t representing the number of values allowed in the
+   *        queue before blocking on a push. Rounded up to a power of two.
+   */
+  ThreadSafeQueue(size_t max_size)
+      : _ring(max_size), _pop_waiters(0), _push_waiters(0) {
+  }
+  /**
+   * A member function that pops the next value off the queue. If the queue is
+   * empty, returns NULL if block is false, otherwise blocks until one is
+   * available.
    * @param block a bool specifying whether or not the function should block if
    *        the queue is empty.
-   * @return The next Fragment pointer on the queue or NULL if the queue is
-   *         empty and block is false.
+   * @return The next value on the queue or NULL if the queue is empty and
+   *         block is false.
    */
-  Fragment* pop(bool block=true);
+  T pop(bool block=true) {
+    T val;
+    for (size_t i = 0; i < QUEUE_SPIN_TRIES + QUEUE_YIELD_TRIES; ++i) {
+      if (_ring.try_pop(val)) {
+        wake(_push_waiters, _not_full);
+        return val;
+      }
+      if (!block) {
+        return NULL;
+      }
+      if (i >= QUEUE_SPIN_TRIES) {
+        boost::this_thread::yield();
+      }
+    }
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      _pop_waiters.fetch_add(1, boost::memory_order_seq_cst);
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      while (!_ring.try_pop(val)) {
+        _not_empty.wait(lock);
+      }
+      _pop_waiters.fetch_sub(1, boost::memory_order_relaxed);
+    }
+    wake(_push_waiters, _not_full);
+    return val;
+  }
   /**
-   * A member function that pushes the given Fragment pointer onto the queue.
-   * Blocks if the queue is full.
-   * @param frag the Fragment pointer to push onto the queue.
+   * A member function that pushes the given value onto the queue. Blocks if
+   * the queue is full.
+   * @param val the value to push onto the queue.
    */
-  void push(Fragment* frag);
+  void push(T val) {
+    for (size_t i = 0; i < QUEUE_SPIN_TRIES + QUEUE_YIELD_TRIES; ++i) {
+      if (_ring.try_push(val)) {
+        wake(_pop_waiters, _not_empty);
+        return;
+      }
+      if (i >= QUEUE_SPIN_TRIES) {
+        boost::this_thread::yield();
+      }
+    }
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      _push_waiters.fetch_add(1, boost::memory_order_seq_cst);
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      while (!_ring.try_push(val)) {
+        _not_full.wait(lock);
+      }
+      _push_waiters.fetch_sub(1, boost::memory_order_relaxed);
+    }
+    wake(_pop_waiters, _not_empty);
+  }
   /**
-   * A member function that returns true iff the queue is empty. If block is
-   * true, the function blocks until the queue is empty and returns true.
-   * @param block a bool specifying whether or not the function should block
-   *        until the queue is empty.
+   * A member function that returns true iff the queue is empty. The result may
+   * be stale if other threads are pushing or popping.
    * @return True iff the queue is empty.
    */
-  bool is_empty(bool block=false);
+  bool is_empty() const { return _ring.empty(); }
+};
+
+/**
+ * A block of Fragment pointers that is passed between threads as a unit.
+ */
+typedef std::vector<Fragment*> FragBatch;
+/**
+ * A queue of FragBatch pointers with a single producer and a single consumer.
+ */
+typedef ThreadSafeQueue<FragBatch*, SPSCRing<FragBatch*> > SPSCBatchQueue;
+/**
+ * A queue of FragBatch pointers with any number of producers and consumers.
+ */
+typedef ThreadSafeQueue<FragBatch*, MPMCRing<FragBatch*> > MPMCBatchQueue;
+
+/**
+ * The FragBatchWriter class collects Fragment pointers into a FragBatch and
+ * pushes it onto a queue once it holds the given number of Fragments, so that
+ * the queue is only synchronized once per batch. Each thread pushing onto a
+ * queue should use its own FragBatchWriter, and must call flush when it has
+ * no more Fragments to push.
+ *  @copyright Artistic License 2.0
+ **/
+template <class Queue>
+class FragBatchWriter {
+  /**
+   * A private reference to the queue that batches are pushed onto.
+   */
+  Queue& _queue;
+  /**
+   * A private size_t for the number of Fragments in a full batch.
+   */
+  size_t _batch_size;
+  /**
+   * A private pointer to the batch being filled, or NULL if there is none.
+   */
+  FragBatch* _batch;
+
+ public:
+  /**
+   * FragBatchWriter constructor.
+   * @param queue the queue to push batches onto.
+   * @param batch_size the number of Fragments in a full batch (at least 1).
+   */
+  FragBatchWriter(Queue& queue, size_t batch_size)
+      : _queue(queue), _batch_size(std::max(batch_size, (size_t)1)),
+        _batch(NULL) {
+  }
+  /**
+   * FragBatchWriter destructor deletes any unflushed batch, but not the
+   * Fragments in it.
+   */
+  ~FragBatchWriter() { delete _batch; }
+  /**
+   * A member function that adds a Fragment pointer to the current batch and
+   * pushes the batch onto the queue if it is full. Blocks if the queue is full.
+   * @param frag the Fragment pointer to add.
+   */
+  void push(Fragment* frag) {
+    if (!_batch) {
+      _batch = new FragBatch();
+      _batch->reserve(_batch_size);
+    }
+    _batch->push_back(frag);
+    if (_batch->size() >= _batch_size) {
+      flush();
+    }
+  }
+  /**
+   * A member function that pushes the current batch onto the queue, even if
+   * it is not full. Blocks if the queue is full.
+   */
+  void flush() {
+    if (_batch) {
+      _queue.push(_batch);
+      _batch = NULL;
+    }
+  }
+};
+
+/**
+ * The FragBatchReader class pops FragBatches off of a queue and returns the
+ * Fragment pointers in them one at a time. Each thread popping from a queue
+ * should use its own FragBatchReader.
+ *  @copyright Artistic License 2.0
+ **/
+template <class Queue>
+class FragBatchReader {
+  /**
+   * A private reference to the queue that batches are popped from.
+   */
+  Queue& _queue;
+  /**
+   * A private pointer to the batch being read, or NULL if there is none.
+   */
+  FragBatch* _batch;
+  /**
+   * A private size_t for the index of the next Fragment to return from _batch.
+   */
+  size_t _pos;
+
+ public:
+  /**
+   * FragBatchReader constructor.
+   * @param queue the queue to pop batches from.
+   */
+  FragBatchReader(Queue& queue) : _queue(queue), _batch(NULL), _pos(0) {}
+  /**
+   * FragBatchReader destructor deletes the current batch, but not the
+   * Fragments in it.
+   */
+  ~FragBatchReader() { delete _batch; }
+  /**
+   * A member function that returns the next Fragment pointer, popping the next
+   * batch off the queue once the current one is consumed. A NULL batch on the
+   * queue signals the end of the stream.
+   * @param block a bool specifying whether or not the function should block if
+   *        the current batch is consumed and the queue is empty.
+   * @return The next Fragment pointer, or NULL at the end of the stream or if
+   *         the queue is empty and block is false.
+   */
+  Fragment* pop(bool block=true) {
+    while (!_batch || _pos == _batch->size()) {
+      delete _batch;
+      _pos = 0;
+      _batch = _queue.pop(block);
+      if (!_batch) {
+        return NULL;
+      }
+    }
+    return (*_batch)[_pos++];
+  }
 };
 
 /**
@@ -107,8 +542,7 @@ class ThreadSafeInvalidQueue {
   /**
    * ThreadSafeInvalidQueue Constructor.
    * @param max_size a size_t representing the number of ReadHits allowed in
-
-   *        the queue before blocking on a push.
+   *        the queue before blocking on a push, or 0 if unbounded.
    */
   ThreadSafeInvalidQueue(size_t max_size);
   /**
@@ -146,32 +580,36 @@ class ThreadSafeInvalidQueue {
  **/
 struct ParseThreadSafety {
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been parsed
-   * but not pre-processed.
+   * A public queue of batches of Fragments that have been parsed but not
+   * pre-processed. Pushed by the parsing thread and popped by the main thread.
    */
-  ThreadSafeFragQueue proc_in;
+  SPSCBatchQueue proc_in;
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been
-   * pre-processed but not processed.
+   * A public queue of batches of Fragments that have been pre-processed but
+   * not processed. Pushed by the main thread and popped by the processing
+   * threads.
    */
-  ThreadSafeFragQueue proc_on;
+  MPMCBatchQueue proc_on;
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been
-   * processed but not post-processed.
+   * A public queue of batches of Fragments that have been processed but not
+   * post-processed. Pushed by the main or processing threads and popped by the
+   * parsing thread.
    */
-  ThreadSafeFragQueue proc_out;
+  MPMCBatchQueue proc_out;
   /**
    * A public ThreadSafeInvalidQueue of pointers to ReadHits that contain
-   * invalid alignments that should not be processed at all.
+   * invalid alignments that should not be processed at all. Unbounded, since it
+   * is filled and emptied by the parse thread.
    */
   ThreadSafeInvalidQueue proc_invalid;
   /**
    * PraseThreadSafety constructor intializes queues to the given size.
-   * @param q_size the maximum size for the ThreadSafeFragQueues.
+   * @param q_size the maximum number of batches in the Fragment queues, rounded
+   *        up to a power of two.
    */
   ParseThreadSafety(size_t q_size)
       : proc_in(q_size), proc_on(q_size),
-        proc_out(q_size), proc_invalid(q_size) {
+        proc_out(q_size), proc_invalid(0) {
   }
 };
 